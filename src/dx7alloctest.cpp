@@ -0,0 +1,139 @@
+/*! \file dx7alloctest.cpp
+ *  \brief Allocation test of dx7dump.
+ *
+ *  License: GPLv3+
+ *
+ *  The parameter-to-text converters and the formatting of banks (-d, -a, -l)
+ *  must not allocate memory on the heap. dx7dump.cpp is compiled into this
+ *  program, and operator new counts the allocations.
+ *
+ *  Build and run:
+ *    make test
+ */
+
+#define main dx7dumpMain
+#include "dx7dump.cpp"
+#undef main
+
+#include <new>
+
+//! number of allocations by operator new
+static std::atomic<unsigned long> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/*! Fill the file buffer with a bank whose operators cycle through all
+ *  oscillator modes, coarse and fine values, starting at a given index.
+ *
+ *  \param first index of the first combination (mode * 3200 + coarse * 100 + fine)
+ */
+void MakeBank(unsigned first)
+{
+    DX7Sysex *sysex = (DX7Sysex *)buffer;
+    memset(sysex, 0, sizeof(DX7Sysex));
+    for (unsigned voiceNum = 0; voiceNum < 32; voiceNum++)
+    {
+        VoiceUnpacked voice;
+        InitVoice(&voice);
+        voice.transpose = (first / 192 + voiceNum) % 49;
+        for (unsigned i = 0; i < 6; i++)
+        {
+            const unsigned n = (first + voiceNum * 6 + i) % 6400;
+            voice.op[i].oscillatorMode = n / 3200;
+            voice.op[i].frequencyCoarse = n / 100 % 32;
+            voice.op[i].frequencyFine = n % 100;
+            voice.op[i].levelScalingBreakPoint = n % 100;
+        }
+        PackVoice(&sysex->voices[voiceNum], &voice);
+    }
+    FixHeader(sysex);
+    fsize = sysexSize;
+    fileReadOk = true;
+}
+
+/*! Count the allocations of a function.
+ *
+ *  \param testName name of the test
+ *  \param test the function
+ *  \return 0 if there were no allocations
+ */
+template <class Test>
+int Check(const char *testName, Test test)
+{
+    test();     // once for the lazy initialisation of stdio and the renderers
+    allocations = 0;
+    test();
+    const unsigned long count = allocations;
+    fprintf(stdout, "%s %s: %lu allocations\n", count ? "FAIL" : "ok  ", testName, count);
+    return count ? 1 : 0;
+}
+
+int main()
+{
+    out = fopen("/dev/null", "w");
+    if (out == NULL)
+        return 1;
+    int failed = 0;
+
+    failed += Check("Transpose, Breakpoint, Frequency", []() {
+        OperatorUnpacked op;
+        memset(&op, 0, sizeof(op));
+        unsigned long length = 0;
+        for (unsigned x = 0; x < 100; x++)
+            length += strlen(Transpose(x % 49)) + strlen(Breakpoint(x));
+        for (unsigned mode = 0; mode < 2; mode++)
+        {
+            op.oscillatorMode = mode;
+            for (unsigned coarse = 0; coarse < 32; coarse++)
+            {
+                op.frequencyCoarse = coarse;
+                for (unsigned fine = 0; fine < 100; fine++)
+                {
+                    op.frequencyFine = fine;
+                    length += strlen(Frequency(op));
+                }
+            }
+        }
+        fprintf(out, "%lu\n", length);
+    });
+
+    static const struct { const char *name; bool dataList; bool unicode; } modes[] = {
+        { "-d", true, true },
+        { "-d -a", true, false },
+        { "-l", false, true },
+    };
+    for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        voiceDataList = modes[m].dataList;
+        useUnicode = modes[m].unicode;
+        SelectRenderer();
+        failed += Check(modes[m].name, []() {
+            for (unsigned first = 0; first < 6400; first += 192)
+            {
+                MakeBank(first);
+                ResetFileState();
+                processData("alloctest.syx");
+            }
+        });
+    }
+
+    fclose(out);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# ---------------------------------------------------
+# throughput benchmark of the dx7dump output formats
+#
+# Parameters :
+#   path    search path (all *.syx files are processed, default ".")
+#
+# The environment variable DX7DUMP selects the dx7dump binary.
+#
+# License: GPLv3+
+# ---------------------------------------------------
+
+if [ "$1" = "-h" ] || [ "$1" = "--help" ]; then
+	echo "Usage: dx7bench [PATH]"
+	exit
+fi
+
+searchpath="${1:-.}"
+list=$(mktemp)
+trap 'rm -f "$list"' EXIT
+find "$searchpath" -type f -iname "*.syx" -print0 | sort -z > "$list"
+files=$(tr -cd '\0' < "$list" | wc -c)
+echo "$files files"
+
+# warm up the page cache
+xargs -0 cat < "$list" > /dev/null
+
+bench () {
+	local start end bytes
+	start=$(date +%s.%N)
+	bytes=$(xargs -0 "${DX7DUMP:-dx7dump}" "$@" < "$list" 2>/dev/null | wc -c)
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" -v b="$bytes" -v f="$files" -v name="$*" \
+		'BEGIN { t = e - s; printf "%-18s %8.3f s %10.0f files/s %8.1f MB/s\n", name, t, f / t, b / t / 1e6 }'
+}
+
+bench -l
+bench -d
+bench --format json
+bench --format ndjson
+bench --format bin
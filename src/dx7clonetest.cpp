@@ -0,0 +1,113 @@
+/*! \file dx7clonetest.cpp
+ *  \brief Reflink test of the repair of dx7dump.
+ *
+ *  License: GPLv3+
+ *
+ *  The repair of a bank on a filesystem with reflinks (btrfs, XFS) patches
+ *  only the changed bytes of a reflink copy. dx7dump.cpp is compiled into
+ *  this program, and the reflink copy is emulated by a plain copy, so the
+ *  reflink path runs on any filesystem.
+ *
+ *  Build and run:
+ *    make test
+ */
+
+#define main dx7dumpMain
+#include "dx7dump.cpp"
+#undef main
+
+//! emulate a reflink copy by copying all bytes
+bool CopyFile(int source, int target)
+{
+    char data[8192];
+    ssize_t len;
+    off_t offset = 0;
+    while ((len = pread(source, data, sizeof(data), offset)) > 0)
+    {
+        if (pwrite(target, data, len, offset) != len)
+            return false;
+        offset += len;
+    }
+    return len == 0;
+}
+
+//! a filesystem without reflinks
+bool NoClone(int, int)
+{
+    return false;
+}
+
+/*! Write a file.
+ *
+ *  \param filename path of the file
+ *  \param data the content
+ *  \return true if ok
+ */
+bool WriteFile(const std::string &filename, const std::string &data)
+{
+    FILE *file = fopen(filename.c_str(), "wb");
+    if (file == NULL)
+        return false;
+    const bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return (fclose(file) == 0) && ok;
+}
+
+/*! Repair a bank with a wrong channel and checksum like --repair does, and
+ *  check the fixed file, the backup, and the written bytes.
+ *
+ *  \param testName name of the test
+ *  \param dir directory of the test files
+ *  \param written expected number of written bytes
+ *  \return 0 if ok
+ */
+int Check(const char *testName, const std::string &dir, unsigned long written)
+{
+    DX7Sysex sysex;
+    memset(&sysex, 0, sizeof(sysex));
+    for (unsigned i = 0; i < rawDataSize; i++)
+        ((unsigned char *)sysex.voices)[i] = i % 100;
+    FixHeader(&sysex);
+    const std::string fixed((const char *)&sysex, sysexSize);
+    sysex.subStatusAndChannel = 3;
+    sysex.checksum ^= 0x11;
+    const std::string broken((const char *)&sysex, sysexSize);
+
+    // an older backup is replaced
+    const std::string filename = dir + "/bank.syx";
+    std::vector<std::string> files(1, filename);
+    std::vector<RepairEntry> entries(1);
+    std::atomic<unsigned> next(0);
+    OptionState options;
+    SaveOptions(&options);
+    fixWrittenBytes = 0;
+    std::string data, backup;
+    const bool ok = WriteFile(filename, broken) && WriteFile(filename + ".ORIG", "old backup") &&
+                    (RepairWorker(&files, &entries, &next, &options), entries[0].fixed) &&
+                    ReadWholeFile(filename.c_str(), data) == 0 &&
+                    ReadWholeFile((filename + ".ORIG").c_str(), backup) == 0 &&
+                    data == fixed && backup == broken && fixWrittenBytes == written;
+    fprintf(stdout, "%s %s: %lu bytes written\n", ok ? "ok  " : "FAIL", testName, fixWrittenBytes.load());
+    unlink(filename.c_str());
+    unlink((filename + ".ORIG").c_str());
+    return ok ? 0 : 1;
+}
+
+int main()
+{
+    out = fopen("/dev/null", "w");
+    char dir[] = "/tmp/dx7clonetest.XXXXXX";
+    if (out == NULL || mkdtemp(dir) == NULL)
+        return 1;
+    int failed = 0;
+
+    cloneFile = CopyFile;
+    failed += Check("--repair with reflinks", dir, 2);
+    failed += clonedBackups != 1;
+    cloneFile = NoClone;
+    failed += Check("--repair without reflinks", dir, sysexSize);
+    failed += linkedBackups != 1;
+
+    rmdir(dir);
+    fclose(out);
+    return failed ? 1 : 0;
+}
@@ -28,6 +28,31 @@
  *              A different table layout for the first 2 tables can be compiled (TABLE_VARIANT).
  *  2024-04-12: Option -f implemented. Table formatting optimized
  *  2024-04-13: Minor code optimisations
+ *  2026-10-16: Option --watch and --catalog implemented
+ *  2026-10-16: Server mode (--serve or dx7dumpd) implemented
+ *  2026-10-16: HTTP/JSON query server (--http) implemented
+ *  2026-10-16: Option --format implemented (JSON and NDJSON output)
+ *  2026-10-16: Binary voice record output (--format bin)
+ *  2026-10-16: Option --output implemented (several outputs in one run)
+ *  2026-10-16: Option --template implemented
+ *  2026-10-16: Frequency, Transpose, and Breakpoint use compile-time tables
+ *  2026-10-16: Voice data tables rendered by templates. TABLE_VARIANT is now option --table-variant
+ *  2026-10-16: Voice names decoded without rescans (SSE2 for ASCII), 8-bit name bytes flagged
+ *  2026-10-16: Option --validate implemented
+ *  2026-10-16: Option --repair (parallel batch repair) and --dry-run implemented
+ *  2026-10-16: Options --in-place, --fsync, and --undo implemented
+ *  2026-10-16: --fix writes a temp file and renames it, backups are reflinks where possible
+ *  2026-10-16: Bulk parameter edit (--set, --where) with write-ahead journal (--journal, --resume)
+ *  2026-10-16: Single voice dumps are formatted like bank voices and no longer count as errors
+ *  2026-10-16: Options --split and --merge implemented
+ *  2026-10-16: Option --assemble (banks from the voices matching --where) and --unique implemented
+ *  2026-10-16: Option --defrag implemented
+ *  2026-10-16: Option --diff implemented (voice-level diff of banks and directory trees)
+ *  2026-10-16: Option --compare implemented (voice sets of two directory trees)
+ *  2026-10-16: Option --provenance implemented (MinHash/LSH clusters of similar banks)
+ *  2026-10-16: Known factory voices (dx7factory.h, perfect hash) tagged in listings, --factory-table
+ *  2026-10-16: Option --dedup implemented (identical files replaced by hard links or reflinks)
+ *  2026-10-16: Sharded index build (--index-map, --index-merge)
  *
  */
 
@@ -38,16 +63,49 @@
 #include <string>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <getopt.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "dx7algorithms.h"
+#include "dx7factory.h"
 
 // disable to use 7-bit ASCII LCD translation
 #define USE_UNICODE_DEFAULT         // ASCII or UNICODE to be used for displaying LCD content 
 
-// compile with table variant 1 or 2
-#define TABLE_VARIANT 2
-
 // ***************************************************************************
 
 //! program version
@@ -64,42 +122,105 @@ const unsigned singleSysexSize = 163;
 //! file-size of a dx7 headerless single-voice-dump
 const unsigned singleRawDataSize = 155;
 
-//! horizontal ruler position in a table (used for setting unicode border characters)
-enum HorRulerPos {
-    TOP,
-    MIDDLE,
-    BOTTOM
-};
-
 //! set by option "-x" to show some data in hexadecimal
-bool showHex = false;
+thread_local bool showHex = false;
 
 //! set by option "-e" print errors only
-bool errorsOnly = false;
+thread_local bool errorsOnly = false;
 
 //! set by option "-d" for voice data listing
-bool voiceDataList = false;
+thread_local bool voiceDataList = false;
 
 //! set by option "-l" for long listing
-bool tabularListing = true;
+thread_local bool tabularListing = true;
 
 //! set by option "-i" to find duplicate patches
-bool findDupes = false;
+thread_local bool findDupes = false;
 
 //! set by option "-p" to specify patch number; -1 means all.
-int patch = -1;
+thread_local int patch = -1;
 
 //! set by option "--fix": try to fix corrupted files
-bool fixFiles = false;
+thread_local bool fixFiles = false;
 
 //! set by option "-n": show plain sysex filenames
-bool plainFilenames = false;
+thread_local bool plainFilenames = false;
 
 //! set by option "-y" to say "yes" to fix files
-bool askToFix = true;
+thread_local bool askToFix = true;
 
 //! set by option "-no-backup": don't create backups when fixing files
-bool noBackup = false;
+thread_local bool noBackup = false;
+
+//! set by option "--repair": file the repair plan is written to ("-" = stdout)
+thread_local const char *repairPlan = NULL;
+
+//! set by option "--dry-run": only write the repair plan
+thread_local bool dryRun = false;
+
+//! set by option "--undo": journal of the in-place repairs to undo
+thread_local const char *undoFile = NULL;
+
+//! fsync policies of the repair and the other writing modes
+enum FsyncPolicy {
+    FSYNC_ALWAYS,       // sync the journal before and the file after each patch
+    FSYNC_END,          // sync the journal before each patch, the written files at the end
+    FSYNC_NEVER
+};
+
+//! set by option "--in-place": undo journal of the in-place repair
+thread_local const char *undoJournal = NULL;
+
+//! set by option "--fsync"
+thread_local FsyncPolicy fsyncPolicy = FSYNC_END;
+
+//! set by option "--set FIELD=VALUE": parameter assignments of the bulk edit
+thread_local std::vector<std::string> editSets;
+
+//! set by option "--where": condition of the voices changed by the bulk edit
+thread_local const char *editWhere = NULL;
+
+//! set by option "--journal": write-ahead journal of the bulk edit
+thread_local const char *editJournal = NULL;
+
+//! set by option "--resume": journal of an interrupted bulk edit to complete
+thread_local const char *resumeJournal = NULL;
+
+//! set by option "--split": directory the single voices of the banks are written to
+thread_local const char *splitDir = NULL;
+
+//! set by option "--merge": filename of the (first) bank merged from single voices
+thread_local const char *mergeBank = NULL;
+
+//! set by option "--assemble": filename of the (first) bank of the voices matching --where
+thread_local const char *assembleBank = NULL;
+
+//! set by option "--unique": drop voices with the same sound as an earlier voice
+thread_local bool uniqueVoices = false;
+
+//! set by option "--defrag": filename of the (first) bank of the unique voices
+thread_local const char *defragBank = NULL;
+
+//! set by option "--diff": compare two banks or directory trees
+thread_local bool diffFiles = false;
+
+//! set by option "--compare": compare the voices of two directory trees
+thread_local bool compareTrees = false;
+
+//! set by option "--provenance": minimal similarity of banks in percent, 0 = off
+thread_local unsigned provenanceThreshold = 0;
+
+//! set by option "--factory-table": print dx7factory.h for the voices of FILEs
+thread_local bool factoryTable = false;
+
+//! set by option "--dedup": replace duplicate files by "hardlink" or "reflink"
+thread_local const char *dedupMode = NULL;
+
+//! set by option "--index-map": path prefix of the index of one shard
+thread_local const char *indexMap = NULL;
+
+//! set by option "--index-merge": path prefix of the merged index
+thread_local const char *indexMerge = NULL;
 
 #ifdef USE_UNICODE_DEFAULT  
 #define USE_UNICODE true
@@ -107,43 +228,95 @@ bool noBackup = false;
 #define USE_UNICODE false
 #endif
 //! set by option "-u" or "-a" to use unicode or ascii
-bool useUnicode = USE_UNICODE;
+thread_local bool useUnicode = USE_UNICODE;
+
+//! output formats selectable by option "--format"
+enum OutputFormat {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_NDJSON,
+    FORMAT_BIN,
+    FORMAT_TEMPLATE,
+    FORMAT_VALIDATE
+};
+
+//! set by option "--format": output format
+thread_local OutputFormat outputFormat = FORMAT_TEXT;
+
+//! set by option "--table-variant": layout of the voice and LFO tables (1 or 2)
+thread_local int tableVariant = 2;
+
+//! set by option "--template": output template, one line per voice
+thread_local const char *templateText = NULL;
+
+//! set by option "--watch": directory to be watched for new or modified files
+thread_local const char *watchDir = NULL;
+
+//! set by option "--catalog": voice catalog file kept up to date
+thread_local const char *catalogFile = NULL;
+
+//! quiet time (ms) after the last filesystem event before files are processed
+const int watchDebounceMs = 20;
+
+//! set by option "--serve": unix domain socket of the server mode
+thread_local const char *serveSocket = NULL;
+
+//! number of files kept in the LRU cache of the server mode
+const unsigned serverCacheSize = 1024;
+
+//! set by option "--http": TCP port of the HTTP/JSON query server
+thread_local int httpPort = 0;
+
+//! output stream of the current thread (stdout, an output file, or a server response)
+thread_local FILE *out = stdout;
+
+//! output sinks given by option "--output KIND=PATH"
+thread_local std::vector<std::string> outputSinks;
+
+/*! Write a line to the output stream (like puts()).
+ *
+ *  \param text a pointer to the text
+ */
+void PutLine(const char *text)
+{
+    fputs(text, out);
+    fputc('\n', out);
+}
 
 //! filesize of opened file
-int fsize;
+thread_local int fsize;
 
 //! sysex file data buffer
-unsigned char buffer[sysexSize];
+thread_local unsigned char buffer[sysexSize];
+
+//! false if the file could not be read completely
+thread_local bool fileReadOk = true;
+
+//! errno of a file that could not be opened
+thread_local int loadError = 0;
 
 //! error & info message buffer
-char msgBuffer[100] = "";
+thread_local char msgBuffer[100] = "";
 
 //! true if we have a recoverable error
-bool softError = false;
+thread_local bool softError = false;
 
 //! if file has no sysex header, it might be a raw file
-bool sysexFile = true;
+thread_local bool sysexFile = true;
 
 //! the open file seems corrupted and could need a fix
-bool fixNeeded = false;
+thread_local bool fixNeeded = false;
 
 //! the open file is a single voice file
-bool singleVoiceFile = false;
+thread_local bool singleVoiceFile = false;
 
 //! set by option "-f" to use form-feed instead of separator line
-bool formfeed = false;
+thread_local bool formfeed = false;
 
 //! printable voice-name in ASCII or UNICODE 
-char name[41];      // max. length required for unicode
+thread_local char name[41];      // max. length required for unicode
 //char name[11];        // max. length required for ASCII only
 
-//! vertical table line symbols for ASCII and UNICODE
-const char vertLineAscii[4] = "|";
-const char vertLineUnicode[4] = "│";
-
-//! actual vertical line character
-const char* vl;
-
 //! symbols for UNICODE table borders
 const char tl[4] = "┌";
 const char tm[4] = "┬";
@@ -157,13 +330,8 @@ const char br[4] = "┘";
 //const char vv[] = "│";
 //const char hh[] = "─";
 
-//! unicode character groups for left, middle, and right borders
-const char leftBorder[3][4] = {"┌", "├", "└"};
-const char middleBorder[3][4] = {"┬", "┼", "┴"};
-const char rightBorder[3][4] = {"┐", "┤", "┘"};
-
 //! LCD-character translation table to UNICODE
-const char lcdTableUnicode[][4] = {
+constexpr char lcdTableUnicode[][4] = {
     "₁", "₂", "₃", "₄", "₅", "₆", "₇", "₈", "₁", "₂", "₃", "₄", "₅", "₆", "₇", "₈",   // 0x00
     " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ",   // 0x10
     " ", "!", "\"", "#", "$", "%", "&", "'", "(", ")", "*", "+", ",", "-", ".", "/",  // 0x20
@@ -183,7 +351,7 @@ const char lcdTableUnicode[][4] = {
 };
 
 //! LCD-character translation table for 7-bit ASCII (voice-name in sysex is also 7-bit)
-const char lcdTableAscii[] = {
+constexpr char lcdTableAscii[] = {
     ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',   // 0x00
     ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',   // 0x10
     ' ', '!', '"', '#', '$', '%', '&', '\'', '(', ')', '*', '+', ',', '-', '.', '/',  // 0x20
@@ -196,7 +364,7 @@ const char lcdTableAscii[] = {
 
 //! help-text  
 const char usageText[] = {
-    "Usage: dx7dump [OPTIONS] FILE\n"
+    "Usage: dx7dump [OPTIONS] FILE...\n"
 };
 
 const char optionsText[] = {
@@ -210,10 +378,73 @@ const char optionsText[] = {
     "  --no-backup         don't create backups when fixing files\n"
     "                        WARNING: This option might result in data-loss!\n"
     "                        make sure you already have a backup of the sysex-file\n"
+    "  --repair PLAN       check FILEs and directory trees in parallel, fix all fixable\n"
+    "                        files (like --fix -y) and write the repair plan to PLAN\n"
+    "  --dry-run           with --repair, --set, --split, --merge, --assemble, or --defrag:\n"
+    "                        don't change any file\n"
+    "  --in-place JOURNAL  with --fix or --repair: write only the changed bytes into the\n"
+    "                        files (no backups), original bytes are appended to JOURNAL\n"
+    "  --fsync MODE        with --fix, --repair, --in-place, --set, --split, --merge,\n"
+    "                        --assemble, or --defrag:\n"
+    "                        always (every file), end (default), or never\n"
+    "  --undo JOURNAL      restore the original bytes of the files in JOURNAL\n"
+    "  --set FIELD=VALUE   change a parameter of all voices of FILEs and directory trees,\n"
+    "                        e.g. 'transpose=C3' or 'op*.detune=7'. Can be given several times\n"
+    "  --where EXPR        with --set or --assemble: voices matching all conditions of EXPR,\n"
+    "                        e.g. 'lfoSpeed>90,op1.outputLevel>=80,name~BASS'\n"
+    "  --journal JOURNAL   with --set: write-ahead journal of the changed bytes\n"
+    "  --resume JOURNAL    complete an interrupted --set run (--undo rolls it back)\n"
+    "  --split DIR         write every voice of the banks in FILEs and directory trees\n"
+    "                        as single voice dump: DIR/BANK/NN-NAME.syx\n"
+    "  --merge BANK        merge the single voice dumps in FILEs and directory trees\n"
+    "                        into banks: BANK, BANK-2, ... (unused voices: INIT VOICE)\n"
+    "  --assemble BANK     collect the voices matching --where from the banks and single\n"
+    "                        voices in FILEs and directory trees into banks: BANK, BANK-2, ...\n"
+    "  --unique            with --assemble: drop voices with the same sound (name ignored)\n"
+    "  --defrag BANK       repack the unique voices of FILEs and directory trees, similar\n"
+    "                        sounds together, into banks: BANK, BANK-2, ...\n"
+    "                        BANK.map lists the new bank and voice-# of every voice\n"
+    "  --diff A B          compare the voices of two banks or of two directory trees:\n"
+    "                        moved, renamed, changed (parameters), removed, added\n"
+    "  --compare DIR1 DIR2 compare the voices of two directory trees: identical files,\n"
+    "                        banks with other order or names, voices only on one side\n"
+    "  --provenance PCT    find banks of FILEs and directory trees that are edited\n"
+    "                        copies of each other (at least PCT percent of the voices\n"
+    "                        shared) and list them in clusters\n"
+    "  --factory-table     print the header dx7factory.h (known factory voices) for the\n"
+    "                        banks and single voices in FILEs and directory trees\n"
+    "  --dedup MODE        replace identical files in FILEs and directory trees by\n"
+    "                        links of one of them. MODE: hardlink or reflink.\n"
+    "                        With --fix, banks are compared with fixed headers\n"
+    "  --index-map PREFIX  index the banks and single voices in FILEs and directory\n"
+    "                        trees: PREFIX.catalog, PREFIX.names, PREFIX.hashes\n"
+    "  --index-merge PREFIX merge the indexes of shards (FILEs: their PREFIXes) into\n"
+    "                        one index: PREFIX.catalog, PREFIX.names, PREFIX.hashes\n"
     "  -n, --plain-names   print plain filenames\n"
     "  -y, --yes           no questions asked. Answer everything with YES for '--fix'\n"
     "  -e, --errors        report only files with errors\n"
     "  -x, --hex           show voice names also as HEX and print single voice data in HEX\n"
+    "  --format FORMAT     output format: text (default), json, ndjson, or bin\n"
+    "                        (json/ndjson: status, header, and all voice parameters)\n"
+    "                        (bin: fixed-size binary voice records, see README)\n"
+    "  --validate          check all voice parameters against their ranges and\n"
+    "                        print every out-of-range value\n"
+    "  --template TEXT     print one line per voice with the fields given in TEXT,\n"
+    "                        e.g. '{path}\\t{slot}\\t{name}\\t{algorithmNumber}\\t{op1.frequency}'\n"
+    "                        (fields: see README)\n"
+    "  --output KIND=PATH  write an additional output to PATH (\"-\" = stdout). KIND is\n"
+    "                        names, data, errors, json, ndjson, bin, template, validate,\n"
+    "                        or catalog.\n"
+    "                        Can be given several times; every file is read once.\n"
+    "  --watch DIR         watch DIR recursively and process new or modified files\n"
+    "  --catalog FILE      voice catalog updated incrementally in watch mode\n"
+    "                        (one line per voice: path, voice-#, name, voice data in HEX)\n"
+    "  --serve SOCKET      run as server on a unix domain socket (same as dx7dumpd SOCKET)\n"
+    "                        a request is one line of options and a filename,\n"
+    "                        the response is the output followed by a NUL byte\n"
+    "  --http PORT         run HTTP/JSON query server for the voice catalog on\n"
+    "                        localhost:PORT (requires --catalog)\n"
+    "  --table-variant N   layout of the voice and LFO tables: 1 or 2 (default)\n"
 #ifdef USE_UNICODE_DEFAULT
     "  -a, --ascii         use ASCII characters for voice-names, algorithms, and tables\n"
     "                        (default = Unicode)\n"
@@ -408,6 +639,135 @@ struct DX7SingleSysex
 
 // ***************************************************************************
 
+// Binary output format (--format bin)
+
+/*! Stream header of the binary output, written once at the beginning.
+ *
+ *  All numbers are in host byte order (little endian on x86 and ARM).
+ */
+struct BinHeader
+{
+    char magic[4];          // "DX7V"
+    uint16_t version;       // 1
+    uint16_t recordSize;    // sizeof(BinRecord) = 160
+};
+
+//! One voice in the binary output.
+struct BinRecord
+{
+    uint32_t sourceId;      // index of the file on the command line, starting at 0
+    uint8_t slot;           // voice number in the bank, starting at 0
+    VoiceUnpacked voice;    // 155 bytes, see section D of sysex-format.txt
+};
+
+static_assert(sizeof(BinHeader) == 8, "unexpected BinHeader size");
+static_assert(sizeof(BinRecord) == 160, "unexpected BinRecord size");
+
+// ***************************************************************************
+
+// Parameter tables
+
+//! Name, position, and maximum value of one voice parameter.
+struct ParamField
+{
+    const char *name;
+    unsigned char offset;   // offset in VoiceUnpacked or OperatorUnpacked
+    unsigned char max;
+};
+
+//! parameters of one operator (OperatorUnpacked)
+constexpr ParamField operatorFields[] = {
+    { "EG_R1", offsetof(OperatorUnpacked, EG_R1), 99 },
+    { "EG_R2", offsetof(OperatorUnpacked, EG_R2), 99 },
+    { "EG_R3", offsetof(OperatorUnpacked, EG_R3), 99 },
+    { "EG_R4", offsetof(OperatorUnpacked, EG_R4), 99 },
+    { "EG_L1", offsetof(OperatorUnpacked, EG_L1), 99 },
+    { "EG_L2", offsetof(OperatorUnpacked, EG_L2), 99 },
+    { "EG_L3", offsetof(OperatorUnpacked, EG_L3), 99 },
+    { "EG_L4", offsetof(OperatorUnpacked, EG_L4), 99 },
+    { "levelScalingBreakPoint", offsetof(OperatorUnpacked, levelScalingBreakPoint), 99 },
+    { "scaleLeftDepth", offsetof(OperatorUnpacked, scaleLeftDepth), 99 },
+    { "scaleRightDepth", offsetof(OperatorUnpacked, scaleRightDepth), 99 },
+    { "scaleLeftCurve", offsetof(OperatorUnpacked, scaleLeftCurve), 3 },
+    { "scaleRightCurve", offsetof(OperatorUnpacked, scaleRightCurve), 3 },
+    { "rateScale", offsetof(OperatorUnpacked, rateScale), 7 },
+    { "amplitudeModulationSensitivity", offsetof(OperatorUnpacked, amplitudeModulationSensitivity), 3 },
+    { "keyVelocitySensitivity", offsetof(OperatorUnpacked, keyVelocitySensitivity), 7 },
+    { "outputLevel", offsetof(OperatorUnpacked, outputLevel), 99 },
+    { "oscillatorMode", offsetof(OperatorUnpacked, oscillatorMode), 1 },
+    { "frequencyCoarse", offsetof(OperatorUnpacked, frequencyCoarse), 31 },
+    { "frequencyFine", offsetof(OperatorUnpacked, frequencyFine), 99 },
+    { "detune", offsetof(OperatorUnpacked, detune), 14 },
+};
+
+//! number of parameters of one operator
+constexpr unsigned operatorFieldCount = sizeof(operatorFields) / sizeof(operatorFields[0]);
+
+//! parameters of a voice without operators and name (VoiceUnpacked)
+constexpr ParamField voiceFields[] = {
+    { "pitchEGR1", offsetof(VoiceUnpacked, pitchEGR1), 99 },
+    { "pitchEGR2", offsetof(VoiceUnpacked, pitchEGR2), 99 },
+    { "pitchEGR3", offsetof(VoiceUnpacked, pitchEGR3), 99 },
+    { "pitchEGR4", offsetof(VoiceUnpacked, pitchEGR4), 99 },
+    { "pitchEGL1", offsetof(VoiceUnpacked, pitchEGL1), 99 },
+    { "pitchEGL2", offsetof(VoiceUnpacked, pitchEGL2), 99 },
+    { "pitchEGL3", offsetof(VoiceUnpacked, pitchEGL3), 99 },
+    { "pitchEGL4", offsetof(VoiceUnpacked, pitchEGL4), 99 },
+    { "algorithm", offsetof(VoiceUnpacked, algorithm), 31 },
+    { "feedback", offsetof(VoiceUnpacked, feedback), 7 },
+    { "oscKeySync", offsetof(VoiceUnpacked, oscKeySync), 1 },
+    { "lfoSpeed", offsetof(VoiceUnpacked, lfoSpeed), 99 },
+    { "lfoDelay", offsetof(VoiceUnpacked, lfoDelay), 99 },
+    { "lfoPitchModDepth", offsetof(VoiceUnpacked, lfoPitchModDepth), 99 },
+    { "lfoAMDepth", offsetof(VoiceUnpacked, lfoAMDepth), 99 },
+    { "lfoSync", offsetof(VoiceUnpacked, lfoSync), 1 },
+    { "lfoWave", offsetof(VoiceUnpacked, lfoWave), 5 },
+    { "lfoPitchModSensitivity", offsetof(VoiceUnpacked, lfoPitchModSensitivity), 7 },
+    { "transpose", offsetof(VoiceUnpacked, transpose), 48 },
+};
+
+//! number of parameters of a voice without operators and name
+constexpr unsigned voiceFieldCount = sizeof(voiceFields) / sizeof(voiceFields[0]);
+
+/*! Find a voice parameter by name.
+ *
+ *  Voice parameters are named like the members of VoiceUnpacked, operator
+ *  parameters are prefixed with the operator number: "op1.outputLevel".
+ *
+ *  \param paramName a pointer to the parameter name
+ *  \param len length of the parameter name
+ *  \param field optional pointer to the found parameter description
+ *  \return offset of the parameter in VoiceUnpacked, -1 if unknown
+ */
+int FindParamField(const char *paramName, size_t len, const ParamField **field = NULL)
+{
+    unsigned base = 0;
+    const ParamField *fields = voiceFields;
+    unsigned count = voiceFieldCount;
+    if (len > 4 && strncmp(paramName, "op", 2) == 0 && paramName[2] >= '1' && paramName[2] <= '6' &&
+        paramName[3] == '.')
+    {
+        // operators are stored in backward order
+        base = (6 - (paramName[2] - '0')) * sizeof(OperatorUnpacked);
+        fields = operatorFields;
+        count = operatorFieldCount;
+        paramName += 4;
+        len -= 4;
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (strlen(fields[i].name) == len && strncmp(fields[i].name, paramName, len) == 0)
+        {
+            if (field)
+                *field = &fields[i];
+            return base + fields[i].offset;
+        }
+    }
+    return -1;
+}
+
+// ***************************************************************************
+
 // Functions to convert data to text
 
 
@@ -494,6 +854,10 @@ const char *Mode(unsigned x)
         return modes[x];
 }
 
+//! note names of one octave
+constexpr const char *noteNames[] =
+    { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+
 /*! Convert parameter value to Note-name string.
  *
  * \param x parameter value
@@ -501,27 +865,198 @@ const char *Mode(unsigned x)
  */
 const char *Note(unsigned x)
 {
-    x = x % 12;
-    const char *notes[] = 
-        { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
-    return notes[x];
+    return noteNames[x % 12];
+}
+
+//! Text of one converted parameter value.
+struct ValueText
+{
+    char text[12];
+};
+
+//! Table of converted parameter values, built at compile time.
+template <unsigned N>
+struct ValueTable
+{
+    ValueText values[N];
+};
+
+/*! Append a string to a value text.
+ *
+ * \param value value text
+ * \param len current length of the text, updated
+ * \param text string to append
+ */
+constexpr void AppendText(ValueText &value, unsigned &len, const char *text)
+{
+    while (*text)
+        value.text[len++] = *text++;
+    value.text[len] = 0;
+}
+
+/*! Append a number to a value text.
+ *
+ * \param value value text
+ * \param len current length of the text, updated
+ * \param number number to append
+ */
+constexpr void AppendNumber(ValueText &value, unsigned &len, int number)
+{
+    if (number < 0)
+    {
+        value.text[len++] = '-';
+        number = -number;
+    }
+    char digits[10] = {};
+    unsigned n = 0;
+    do
+    {
+        digits[n++] = '0' + number % 10;
+        number /= 10;
+    } while (number);
+    while (n)
+        value.text[len++] = digits[--n];
+    value.text[len] = 0;
+}
+
+/*! Append a fixed-point number like printf("%g") to a value text.
+ *
+ * \param value value text
+ * \param len current length of the text, updated
+ * \param number the number multiplied by 10^decimals
+ * \param decimals number of decimals
+ */
+constexpr void AppendDecimal(ValueText &value, unsigned &len, unsigned number, unsigned decimals)
+{
+    unsigned scale = 1;
+    for (unsigned i = 0; i < decimals; i++)
+        scale *= 10;
+    AppendNumber(value, len, number / scale);
+    unsigned fraction = number % scale;
+    if (fraction == 0)
+        return;
+    while (fraction % 10 == 0)
+    {
+        fraction /= 10;
+        scale /= 10;
+    }
+    value.text[len++] = '.';
+    for (scale /= 10; scale > 0; scale /= 10)
+        value.text[len++] = '0' + fraction / scale % 10;
+    value.text[len] = 0;
+}
+
+/*! Build the table of transpose values (C1..C5).
+ *
+ * \return table of transpose strings
+ */
+constexpr ValueTable<49> MakeTransposeTable()
+{
+    ValueTable<49> table = {};
+    for (unsigned x = 0; x < 49; x++)
+    {
+        unsigned len = 0;
+        AppendText(table.values[x], len, noteNames[x % 12]);
+        AppendNumber(table.values[x], len, x / 12 + 1);
+    }
+    return table;
+}
+
+/*! Build the table of breakpoint values (A-1..C8).
+ *
+ * \return table of breakpoint strings
+ */
+constexpr ValueTable<100> MakeBreakpointTable()
+{
+    ValueTable<100> table = {};
+    for (unsigned x = 0; x < 100; x++)
+    {
+        // Playing some tricks (add 12 tones, subtract one octave) to avoid
+        // the fact that -3/12 rounds to 0 and messes everything up.  Shifting
+        // everything up an octave and then subtracting one solves the problem.
+        unsigned len = 0;
+        AppendText(table.values[x], len, noteNames[(x + 9) % 12]);
+        AppendNumber(table.values[x], len, ((int)x - 3 + 12) / 12 - 1);
+    }
+    return table;
+}
+
+/*! Build the table of frequency ratios (coarse 0..31 * 100 + fine 0..99).
+ *
+ *  ratio = coarse * (1 + fine / 100), coarse 0 is 0.5
+ *
+ * \return table of ratio strings
+ */
+constexpr ValueTable<3200> MakeRatioTable()
+{
+    ValueTable<3200> table = {};
+    for (unsigned coarse = 0; coarse < 32; coarse++)
+    {
+        for (unsigned fine = 0; fine < 100; fine++)
+        {
+            // in 1/1000
+            const unsigned ratio = (coarse == 0) ? (100 + fine) * 5 : coarse * (100 + fine) * 10;
+            unsigned len = 0;
+            AppendDecimal(table.values[coarse * 100 + fine], len, ratio, 3);
+        }
+    }
+    return table;
+}
+
+//! 10^(fine/100) rounded to 6 significant digits (like printf("%g"))
+constexpr unsigned fixedMantissa[100] = {
+    100000, 102329, 104713, 107152, 109648, 112202, 114815, 117490,
+    120226, 123027, 125893, 128825, 131826, 134896, 138038, 141254,
+    144544, 147911, 151356, 154882, 158489, 162181, 165959, 169824,
+    173780, 177828, 181970, 186209, 190546, 194984, 199526, 204174,
+    208930, 213796, 218776, 223872, 229087, 234423, 239883, 245471,
+    251189, 257040, 263027, 269153, 275423, 281838, 288403, 295121,
+    301995, 309030, 316228, 323594, 331131, 338844, 346737, 354813,
+    363078, 371535, 380189, 389045, 398107, 407380, 416869, 426580,
+    436516, 446684, 457088, 467735, 478630, 489779, 501187, 512861,
+    524807, 537032, 549541, 562341, 575440, 588844, 602560, 616595,
+    630957, 645654, 660693, 676083, 691831, 707946, 724436, 741310,
+    758578, 776247, 794328, 812831, 831764, 851138, 870964, 891251,
+    912011, 933254, 954993, 977237,
+};
+
+/*! Build the table of fixed frequencies (coarse 0..3 * 100 + fine 0..99).
+ *
+ *  frequency = 10^(coarse + fine / 100) Hz
+ *
+ * \return table of frequency strings
+ */
+constexpr ValueTable<400> MakeFixedTable()
+{
+    ValueTable<400> table = {};
+    for (unsigned coarse = 0; coarse < 4; coarse++)
+    {
+        for (unsigned fine = 0; fine < 100; fine++)
+        {
+            unsigned len = 0;
+            AppendDecimal(table.values[coarse * 100 + fine], len, fixedMantissa[fine], 5 - coarse);
+            AppendText(table.values[coarse * 100 + fine], len, " Hz");
+        }
+    }
+    return table;
 }
 
+constexpr ValueTable<49> transposeTable = MakeTransposeTable();
+constexpr ValueTable<100> breakpointTable = MakeBreakpointTable();
+constexpr ValueTable<3200> ratioTable = MakeRatioTable();
+constexpr ValueTable<400> fixedTable = MakeFixedTable();
+
 /*! Convert parameter value to Transpose string.
  *
  * \param x parameter value
  * \return pointer to transpose value string
  */
-std::string Transpose(unsigned x)
+const char *Transpose(unsigned x)
 {
     if (x > 48)
         return OutOfRange();
 
-    // Anything's better than sstream!
-    char buffer[10];
-    snprintf(buffer, 9, "%s%u", Note(x), x / 12 + 1);
-
-    return buffer;
+    return transposeTable.values[x].text;
 }
 
 /*! Convert parameter value to Breakpoint string.
@@ -529,49 +1064,46 @@ std::string Transpose(unsigned x)
  * \param x parameter value
  * \return pointer to breakpoint value string
  */
-std::string Breakpoint(unsigned x)
+const char *Breakpoint(unsigned x)
 {
     if (x > 99)
         return OutOfRange();
-        
-    char buffer[10];
-
-    // Playing some tricks (add 12 tones, subtract one octave) to avoid
-    // the fact that -3/12 rounds to 0 and messes everything up.  Shifting
-    // everything up an octave and then subtracting one solves the problem.
-    const int octave = ((int)x - 3 + 12) / 12 - 1;
-    
-    // Anything's better than sstream!
-    snprintf(buffer, 9, "%s%d", Note(x + 9), octave);
 
-    return buffer;
+    return breakpointTable.values[x].text;
 }
 
 /*! Frequency calculation and output as string
  *
- * \param op pointer to struct of values for one operator
+ * \param op struct of values for one operator (packed or unpacked)
  * \return pointer to frequency value string
  */
-std::string Frequency(OperatorPacked op)
+template <class Operator>
+const char *Frequency(const Operator &op)
 {
-    char buffer[18];
+    const unsigned coarse = op.frequencyCoarse;
+    const unsigned fine = op.frequencyFine;
+
     // If ratio mode
     if (op.oscillatorMode == 0)
     {
-        double coarse = op.frequencyCoarse;
-        if (coarse == 0)
-            coarse = .5;
-    
-        const double freq = coarse + ((double)op.frequencyFine * coarse / 100);
-        
-        sprintf(buffer, "%g", freq);
+        if (coarse < 32 && fine < 100)
+            return ratioTable.values[coarse * 100 + fine].text;
+    }
+    else if (fine < 100)  // fixed mode
+    {
+        return fixedTable.values[(coarse % 4) * 100 + fine].text;
+    }
+
+    // fine values above 99 are only found in corrupt files
+    static thread_local char buffer[24];
+    if (op.oscillatorMode == 0)
+    {
+        const double ratio = (coarse == 0) ? .5 : coarse;
+        sprintf(buffer, "%g", ratio + (double)fine * ratio / 100);
     }
-    else  // fixed mode
+    else
     {
-        const double power = (double)(op.frequencyCoarse % 4) +
-                             (double)op.frequencyFine / 100;
-        const double freq = pow(10, power);
-        sprintf(buffer, "%g Hz", freq);
+        sprintf(buffer, "%g Hz", pow(10, (double)(coarse % 4) + (double)fine / 100));
     }
     return buffer;
 }
@@ -583,8 +1115,9 @@ std::string Frequency(OperatorPacked op)
  *
  *  \param argc argument count
  *  \param argv argument vector
+ *  \return -1 to continue, otherwise the exit code of the program
  */
-void processOpts(int *argc, char ***argv)
+int processOpts(int *argc, char ***argv)
 {
     struct option opts[] = {
         { "voicedata", 0, 0, 'd' },
@@ -598,6 +1131,36 @@ void processOpts(int *argc, char ***argv)
         { "no-backup", 0, 0, 'K' },
         { "errors", 0, 0, 'e' },
         { "hex", 0, 0, 'x' },
+        { "format", 1, 0, 'T' },
+        { "output", 1, 0, 'O' },
+        { "template", 1, 0, 'M' },
+        { "table-variant", 1, 0, 'V' },
+        { "validate", 0, 0, 'A' },
+        { "repair", 1, 0, 'R' },
+        { "dry-run", 0, 0, 'N' },
+        { "in-place", 1, 0, 'I' },
+        { "fsync", 1, 0, 'Y' },
+        { "undo", 1, 0, 'U' },
+        { "set", 1, 0, 'E' },
+        { "where", 1, 0, 'Q' },
+        { "journal", 1, 0, 'J' },
+        { "resume", 1, 0, 'B' },
+        { "split", 1, 0, 'L' },
+        { "merge", 1, 0, 'G' },
+        { "assemble", 1, 0, 'Z' },
+        { "unique", 0, 0, 'X' },
+        { "defrag", 1, 0, 'P' },
+        { "diff", 0, 0, 'g' },
+        { "compare", 0, 0, 'i' },
+        { "provenance", 1, 0, 'b' },
+        { "factory-table", 0, 0, 'j' },
+        { "dedup", 1, 0, 'k' },
+        { "index-map", 1, 0, 'm' },
+        { "index-merge", 1, 0, 'q' },
+        { "watch", 1, 0, 'W' },
+        { "catalog", 1, 0, 'C' },
+        { "serve", 1, 0, 'S' },
+        { "http", 1, 0, 'H' },
         { "version", 0, 0, 'v' },
         { "help", 0, 0, 'h' },
 #ifdef USE_UNICODE_DEFAULT
@@ -644,6 +1207,129 @@ void processOpts(int *argc, char ***argv)
         case 'K':  // --no-backup (long option only)
             noBackup = true;
             break;
+        case 'T':  // --format (long option only)
+            if (strcmp(optarg, "text") == 0)
+                outputFormat = FORMAT_TEXT;
+            else if (strcmp(optarg, "json") == 0)
+                outputFormat = FORMAT_JSON;
+            else if (strcmp(optarg, "ndjson") == 0)
+                outputFormat = FORMAT_NDJSON;
+            else if (strcmp(optarg, "bin") == 0)
+                outputFormat = FORMAT_BIN;
+            else
+            {
+                fprintf(out, "Unknown output format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':  // --repair (long option only)
+            repairPlan = optarg;
+            break;
+        case 'I':  // --in-place (long option only)
+            undoJournal = optarg;
+            break;
+        case 'Y':  // --fsync (long option only)
+            if (strcmp(optarg, "always") == 0)
+                fsyncPolicy = FSYNC_ALWAYS;
+            else if (strcmp(optarg, "end") == 0)
+                fsyncPolicy = FSYNC_END;
+            else if (strcmp(optarg, "never") == 0)
+                fsyncPolicy = FSYNC_NEVER;
+            else
+            {
+                fprintf(out, "Invalid fsync mode: %s (expecting always, end, or never)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':  // --undo (long option only)
+            undoFile = optarg;
+            break;
+        case 'E':  // --set (long option only)
+            editSets.push_back(optarg);
+            break;
+        case 'Q':  // --where (long option only)
+            editWhere = optarg;
+            break;
+        case 'J':  // --journal (long option only)
+            editJournal = optarg;
+            break;
+        case 'B':  // --resume (long option only)
+            resumeJournal = optarg;
+            break;
+        case 'L':  // --split (long option only)
+            splitDir = optarg;
+            break;
+        case 'G':  // --merge (long option only)
+            mergeBank = optarg;
+            break;
+        case 'Z':  // --assemble (long option only)
+            assembleBank = optarg;
+            break;
+        case 'X':  // --unique (long option only)
+            uniqueVoices = true;
+            break;
+        case 'P':  // --defrag (long option only)
+            defragBank = optarg;
+            break;
+        case 'g':  // --diff (long option only)
+            diffFiles = true;
+            break;
+        case 'i':  // --compare (long option only)
+            compareTrees = true;
+            break;
+        case 'b':  // --provenance (long option only)
+            provenanceThreshold = strtoul(optarg, NULL, 10);
+            if (provenanceThreshold < 1 || provenanceThreshold > 100)
+            {
+                fprintf(out, "Invalid similarity: %s (expecting 1..100)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':  // --factory-table (long option only)
+            factoryTable = true;
+            break;
+        case 'k':  // --dedup (long option only)
+            dedupMode = optarg;
+            break;
+        case 'm':  // --index-map (long option only)
+            indexMap = optarg;
+            break;
+        case 'q':  // --index-merge (long option only)
+            indexMerge = optarg;
+            break;
+        case 'N':  // --dry-run (long option only)
+            dryRun = true;
+            break;
+        case 'A':  // --validate (long option only)
+            outputFormat = FORMAT_VALIDATE;
+            break;
+        case 'V':  // --table-variant (long option only)
+            tableVariant = atoi(optarg);
+            if (tableVariant != 1 && tableVariant != 2)
+            {
+                fprintf(out, "Invalid table variant: %s (expecting 1 or 2)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'M':  // --template (long option only)
+            templateText = optarg;
+            outputFormat = FORMAT_TEMPLATE;
+            break;
+        case 'O':  // --output (long option only)
+            outputSinks.push_back(optarg);
+            break;
+        case 'W':  // --watch (long option only)
+            watchDir = optarg;
+            break;
+        case 'C':  // --catalog (long option only)
+            catalogFile = optarg;
+            break;
+        case 'S':  // --serve (long option only)
+            serveSocket = optarg;
+            break;
+        case 'H':  // --http (long option only)
+            httpPort = strtol(optarg, NULL, 0);
+            break;
         case 'n':
             plainFilenames = true;
             break;
@@ -663,26 +1349,27 @@ void processOpts(int *argc, char ***argv)
             break;
 #endif
         case 'v':
-            printf("dx7dump %s\n", version);
+            fprintf(out, "dx7dump %s\n", version);
             //printf("%s", versionText);
-            puts(versionText);
-            exit(0);
+            PutLine(versionText);
+            return 0;
         case 'h':
             //printf("%s", helpText);
-            puts(usageText);
+            PutLine(usageText);
         case 'o':  // a hidden option (internally used for dx7dumpall -h)
-            puts(optionsText);
-            exit(0);
+            PutLine(optionsText);
+            return 0;
         default:
-            puts("Try -h for help.");
-            exit(1);
-            break;
+            PutLine("Try -h for help.");
+            return 1;
         }
     }
   
     // Bump to the end of the options.
     *argc -= optind;
     *argv += optind;
+
+    return -1;
 }
 
 // ***************************************************************************
@@ -739,14 +1426,11 @@ unsigned char ChecksumSingle(const VoiceUnpacked *voice, unsigned blocksize)
 
 // ***************************************************************************
 
-/*! Repair corrupt sysex files.
+/*! Set the header, checksum, and end of a sysex bank.
  *
  *  \param sysex a pointer to a DX7Sysex data block
- *  \param filename a pointer to the filename
- *  \return 0 for successful fixing the file
- *          1 for a failed attempt to fix the file
  */
-int FixFile(DX7Sysex *sysex, const char *filename)
+void FixHeader(DX7Sysex *sysex)
 {
     sysex->sysexBeginF0 = 0xF0;
     sysex->yamaha43 = 0x43;
@@ -756,46 +1440,505 @@ int FixFile(DX7Sysex *sysex, const char *filename)
     sysex->sizeLSB = 0;
     sysex->checksum = Checksum(sysex);
     sysex->sysexEndF7 = 0xF7;
+}
 
-    if (!noBackup)
+/*! Sync the directory of a file, so a created or renamed entry is on disk.
+ *
+ *  \param filename path of the file
+ *  \return 0 if ok
+ */
+int SyncDirectory(const std::string &filename)
+{
+    const size_t slash = filename.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return 1;
+    const int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+//! files written with fsync policy "end", and the directories of the created files
+std::mutex writtenFilesMutex;
+std::vector<std::string> writtenFiles;
+std::set<std::string> writtenDirs;
+
+/*! Remember a written file to be synced at the end of the run (fsync policy
+ *  "end").
+ *
+ *  \param filename path of the file
+ *  \param created true if the file was created (its directory is synced too)
+ */
+void FileWritten(const std::string &filename, bool created)
+{
+    if (fsyncPolicy != FSYNC_END)
+        return;
+    std::lock_guard<std::mutex> lock(writtenFilesMutex);
+    writtenFiles.push_back(filename);
+    if (created)
+    {
+        const size_t slash = filename.find_last_of('/');
+        writtenDirs.insert(slash == std::string::npos ? "." : filename.substr(0, slash + 1));
+    }
+}
+
+/*! Sync the files remembered by FileWritten() and the directories of the
+ *  created files. Unlike sync() this leaves the other files of the host alone.
+ *
+ *  \return number of files that could not be synced
+ */
+unsigned SyncWrittenFiles()
+{
+    unsigned errors = 0;
+    std::lock_guard<std::mutex> lock(writtenFilesMutex);
+    for (unsigned i = 0; i < writtenFiles.size(); i++)
     {
-        // create a backup of the sysex-file
-        std::string backupFile;
-        backupFile = filename;
-        backupFile += ".ORIG";
-        if (rename(filename, backupFile.c_str()))
+        const int fd = open(writtenFiles[i].c_str(), O_RDONLY);
+        if (fd < 0 || fdatasync(fd) != 0)
         {
-            printf("File could not be renamed for backup. File-fix aborted. %s\n", strerror(errno));
-            return 1;
+            fprintf(out, "Error writing to file: %s. %s\n", writtenFiles[i].c_str(), strerror(errno));
+            errors++;
         }
+        if (fd >= 0)
+            close(fd);
     }
+    for (std::set<std::string>::const_iterator dir = writtenDirs.begin(); dir != writtenDirs.end(); ++dir)
+        SyncDirectory(*dir);
+    writtenFiles.clear();
+    writtenDirs.clear();
+    return errors;
+}
 
-    // fix file
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL)
+//! number of files fixed by FixFile(), bytes written, bytes shared with the
+//! original by reflinks, reflink and hard link backups, and time spent (µs)
+std::atomic<unsigned> fixCount(0), clonedBackups(0), linkedBackups(0);
+std::atomic<unsigned long> fixWrittenBytes(0), fixSharedBytes(0), fixMicroseconds(0);
+
+/*! List the bytes that differ between a bank and its fixed version. Only the
+ *  header (0..5) and the checksum and end (4102..4103) can differ.
+ *
+ *  \param oldSysex a pointer to the original data
+ *  \param newSysex a pointer to the fixed data
+ *  \param offsets array (8 entries) the offsets of the changed bytes are written to
+ *  \return number of changed bytes
+ */
+unsigned ChangedBytes(const DX7Sysex *oldSysex, const DX7Sysex *newSysex, unsigned offsets[8])
+{
+    const unsigned char *oldBytes = (const unsigned char *)oldSysex;
+    const unsigned char *newBytes = (const unsigned char *)newSysex;
+    unsigned count = 0;
+    for (unsigned i = 0; i < sysexSize; i = (i == 5) ? sysexSize - 2 : i + 1)
     {
-        printf("Can't open the file for writing: %s. %s\n", filename, strerror(errno));
-        return 1;
+        if (oldBytes[i] != newBytes[i])
+            offsets[count++] = i;
     }
-    if (fwrite(sysex, sysexSize, 1, file) != 1)
+    return count;
+}
+
+/*! Write single bytes into a file, adjacent bytes with one pwrite.
+ *
+ *  \param fd file descriptor
+ *  \param bytes a pointer to the data of the whole file
+ *  \param offsets offsets of the bytes to write (ascending)
+ *  \param count number of offsets
+ *  \return 0 if ok
+ */
+int PatchBytes(int fd, const unsigned char *bytes, const unsigned *offsets, unsigned count)
+{
+    for (unsigned i = 0; i < count; )
     {
-        printf("Error writing to file: %s. %s\n", filename, strerror(errno));
-        return 1;
+        unsigned n = 1;
+        while (i + n < count && offsets[i + n] == offsets[i] + n)
+            n++;
+        if (pwrite(fd, bytes + offsets[i], n, offsets[i]) != (ssize_t)n)
+            return 1;
+        i += n;
     }
-
     return 0;
 }
 
-// ***************************************************************************
-
-/*! Unpack a packed voice data-block.
+/*! Make a file a reflink copy of another file (btrfs, XFS, ...). The copy
+ *  shares all data blocks with the original until one of them is changed.
  *
- *  \param uVoice a pointer to the generated unpacked data
- *  \param pVoice a pointer to the packed voice data
+ *  \param source file descriptor of the original
+ *  \param target file descriptor of the copy
+ *  \return true if the filesystem could do it
  */
-void UnpackVoice(VoiceUnpacked *uVoice, const VoicePacked *pVoice)
+bool CloneFile(int source, int target)
 {
-    // unpack data for each operator
+    return ioctl(target, FICLONE, source) == 0;
+}
+
+//! reflink copy function, the tests replace it to take the reflink paths on any filesystem
+bool (*cloneFile)(int source, int target) = CloneFile;
+
+/*! Repair corrupt sysex files.
+ *
+ *  The fixed file is written to a temporary file which replaces the original
+ *  by rename. If the filesystem supports reflinks, the backup (*.ORIG) and
+ *  the fixed file share the data blocks of the original, and only the
+ *  changed bytes are written. Otherwise the backup is a hard link to the
+ *  original, so the bank path exists at all times. The backup is made under
+ *  a temporary name too and replaces an older backup only when the fixed
+ *  file was written.
+ *
+ *  \param sysex a pointer to a DX7Sysex data block
+ *  \param filename a pointer to the filename
+ *  \return 0 for successful fixing the file
+ *          1 for a failed attempt to fix the file
+ */
+int FixFile(DX7Sysex *sysex, const char *filename)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    FixHeader(sysex);
+
+    const int source = open(filename, O_RDONLY);
+    struct stat st;
+    if (source < 0 || fstat(source, &st) != 0)
+    {
+        fprintf(out, "Can't open the file: %s. %s\n", filename, strerror(errno));
+        if (source >= 0)
+            close(source);
+        return 1;
+    }
+    const mode_t mode = st.st_mode & 07777;
+
+    // backup of the sysex-file: a reflink copy, or later a hard link if there are no reflinks
+    const std::string backupFile = std::string(filename) + ".ORIG";
+    std::string backupTemp = backupFile + ".XXXXXX";
+    bool clonedBackup = false;
+    if (!noBackup)
+    {
+        const int backup = mkstemp(&backupTemp[0]);
+        if (backup < 0)
+        {
+            fprintf(out, "Can't create a file: %s. %s\n", backupTemp.c_str(), strerror(errno));
+            close(source);
+            return 1;
+        }
+        clonedBackup = fchmod(backup, mode) == 0 && cloneFile(source, backup);
+        close(backup);
+        if (!clonedBackup)
+            unlink(backupTemp.c_str());
+    }
+
+    // fixed file: reflink of a regular bank with the changed bytes, or all bytes
+    std::string tempFile = std::string(filename) + ".XXXXXX";
+    const int fd = mkstemp(&tempFile[0]);
+    if (fd < 0)
+    {
+        fprintf(out, "Can't create a file: %s. %s\n", tempFile.c_str(), strerror(errno));
+        close(source);
+        if (clonedBackup)
+            unlink(backupTemp.c_str());
+        return 1;
+    }
+    unsigned written = sysexSize;
+    bool ok = fchmod(fd, mode) == 0;
+    if (ok && fsize == sysexSize && cloneFile(source, fd))
+    {
+        // the changed bytes against the bytes on disk, the buffer may be fixed already
+        DX7Sysex original;
+        unsigned offsets[8];
+        ok = pread(source, &original, sysexSize, 0) == (ssize_t)sysexSize;
+        written = ok ? ChangedBytes(&original, sysex, offsets) : 0;
+        ok = ok && PatchBytes(fd, (const unsigned char *)sysex, offsets, written) == 0;
+        fixSharedBytes += sysexSize - written;
+    }
+    else if (ok)
+    {
+        ok = write(fd, sysex, sysexSize) == (ssize_t)sysexSize;
+    }
+    close(source);
+    ok = ok && (fsyncPolicy != FSYNC_ALWAYS || fdatasync(fd) == 0);
+    ok = (close(fd) == 0) && ok;
+    if (!ok)
+    {
+        fprintf(out, "Error writing to file: %s. %s\n", tempFile.c_str(), strerror(errno));
+        unlink(tempFile.c_str());
+        if (clonedBackup)
+            unlink(backupTemp.c_str());
+        return 1;
+    }
+
+    if (!noBackup)
+    {
+        if ((!clonedBackup && link(filename, backupTemp.c_str())) ||
+            rename(backupTemp.c_str(), backupFile.c_str()))
+        {
+            fprintf(out, "File could not be linked for backup. File-fix aborted. %s\n", strerror(errno));
+            unlink(tempFile.c_str());
+            unlink(backupTemp.c_str());
+            return 1;
+        }
+        if (clonedBackup)
+        {
+            clonedBackups++;
+            fixSharedBytes += st.st_size;
+        }
+        else
+        {
+            linkedBackups++;
+        }
+        FileWritten(backupFile, true);
+    }
+    if (rename(tempFile.c_str(), filename))
+    {
+        fprintf(out, "Can't replace the file: %s. %s\n", filename, strerror(errno));
+        unlink(tempFile.c_str());
+        return 1;
+    }
+    FileWritten(filename, true);
+    if (fsyncPolicy == FSYNC_ALWAYS && SyncDirectory(filename))
+    {
+        fprintf(out, "Error writing to file: %s. %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    fixCount++;
+    fixWrittenBytes += written;
+    fixMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return 0;
+}
+
+// ***************************************************************************
+
+//! file descriptor of the undo journal
+int journalFd = -1;
+
+//! number of files patched in place, bytes written, and bytes a rewrite would have written
+std::atomic<unsigned> patchedFiles(0);
+std::atomic<unsigned long> patchedBytes(0), rewriteBytes(0);
+
+/*! Open the undo journal of the in-place repair (appending).
+ *
+ *  \return 0 if ok
+ */
+int OpenJournal()
+{
+    journalFd = open(undoJournal, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journalFd < 0)
+    {
+        fprintf(out, "Can't open the journal: %s. %s\n", undoJournal, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*! Close the undo journal, sync according to the fsync policy, and print
+ *  the number of bytes written.
+ */
+void CloseJournal()
+{
+    if (fsyncPolicy == FSYNC_END)
+        SyncWrittenFiles();
+    close(journalFd);
+    journalFd = -1;
+    fprintf(out, "%u files patched in place: %lu bytes written (rewriting: %lu bytes)\n",
+            patchedFiles.load(), patchedBytes.load(), rewriteBytes.load());
+}
+
+/*! Repair a corrupt sysex bank by writing only the changed header bytes and
+ *  the checksum into the file. The original bytes are appended to the undo
+ *  journal before the file is changed.
+ *
+ *  Journal line: PATH<tab>OFFSET:OLD>NEW OFFSET:OLD>NEW ... (hex bytes)
+ *
+ *  \param sysex a pointer to the DX7Sysex data block as read from the file
+ *  \param filename a pointer to the filename
+ *  \return 0 for successful fixing the file
+ *          1 for a failed attempt to fix the file
+ */
+int FixFileInPlace(DX7Sysex *sysex, const char *filename)
+{
+    DX7Sysex fixed = *sysex;
+    FixHeader(&fixed);
+
+    const unsigned char *oldBytes = (const unsigned char *)sysex;
+    const unsigned char *newBytes = (const unsigned char *)&fixed;
+    unsigned offsets[8];
+    const unsigned count = ChangedBytes(sysex, &fixed, offsets);
+    std::string entry = filename;
+    entry += '\t';
+    for (unsigned i = 0; i < count; i++)
+    {
+        char change[16];
+        sprintf(change, "%s%u:%2.2X>%2.2X", i ? " " : "", offsets[i],
+                oldBytes[offsets[i]], newBytes[offsets[i]]);
+        entry += change;
+    }
+    entry += '\n';
+    *sysex = fixed;
+    if (count == 0)
+        return 0;
+
+    // the journal entry must be on disk before the file is changed
+    if (write(journalFd, entry.data(), entry.size()) != (ssize_t)entry.size() ||
+        (fsyncPolicy != FSYNC_NEVER && fdatasync(journalFd) != 0))
+    {
+        fprintf(out, "Error writing to the journal: %s. %s\n", undoJournal, strerror(errno));
+        return 1;
+    }
+
+    const int fd = open(filename, O_WRONLY);
+    if (fd < 0)
+    {
+        fprintf(out, "Can't open the file for writing: %s. %s\n", filename, strerror(errno));
+        return 1;
+    }
+    if (PatchBytes(fd, newBytes, offsets, count))
+    {
+        fprintf(out, "Error writing to file: %s. %s\n", filename, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if ((fsyncPolicy == FSYNC_ALWAYS && fdatasync(fd) != 0) || close(fd) != 0)
+    {
+        fprintf(out, "Error writing to file: %s. %s\n", filename, strerror(errno));
+        return 1;
+    }
+    FileWritten(filename, false);
+
+    patchedFiles++;
+    patchedBytes += count;
+    rewriteBytes += sysexSize;
+    return 0;
+}
+
+//! state of the last transaction of a journal (bulk edit)
+enum JournalState {
+    JOURNAL_NONE,           // no transaction (in-place repair journal)
+    JOURNAL_OPEN,           // BEGIN without COMMIT: no file was changed
+    JOURNAL_COMMITTED,      // COMMIT without END: files may be partly changed
+    JOURNAL_CLOSED          // END or ROLLBACK
+};
+
+/*! Read the entries of a journal. The entries of a transaction that was
+ *  never committed are dropped, no file was changed by it.
+ *
+ *  \param journal a pointer to the filename of the journal
+ *  \param entries vector the entries are appended to (without newline)
+ *  \param state set to the state of the last transaction
+ *  \return 0 if ok
+ */
+int ReadJournal(const char *journal, std::vector<std::string> &entries, JournalState &state)
+{
+    FILE *file = fopen(journal, "r");
+    if (file == NULL)
+        return 1;
+    state = JOURNAL_NONE;
+    size_t begin = entries.size();
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, file)) > 0)
+    {
+        // an incomplete last line was written when the run was interrupted
+        if (line[len - 1] != '\n')
+            break;
+        line[--len] = 0;
+        if (strcmp(line, "BEGIN") == 0)
+        {
+            if (state == JOURNAL_OPEN)
+                entries.resize(begin);
+            begin = entries.size();
+            state = JOURNAL_OPEN;
+        }
+        else if (strcmp(line, "COMMIT") == 0)
+            state = JOURNAL_COMMITTED;
+        else if (strcmp(line, "END") == 0 || strcmp(line, "ROLLBACK") == 0)
+            state = JOURNAL_CLOSED;
+        else if (strchr(line, '\t'))
+            entries.push_back(std::string(line, len));
+    }
+    free(line);
+    fclose(file);
+    if (state == JOURNAL_OPEN)
+        entries.resize(begin);
+    return 0;
+}
+
+/*! Undo the changes recorded in a journal (in-place repair or bulk edit),
+ *  newest first. A byte is only restored if the file still holds the value
+ *  written by the repair or edit.
+ *
+ *  \param journal a pointer to the filename of the journal
+ *  \return 0 if ok
+ */
+int UndoJournal(const char *journal)
+{
+    std::vector<std::string> lines;
+    JournalState state;
+    if (ReadJournal(journal, lines, state))
+    {
+        fprintf(out, "Can't open the journal: %s. %s\n", journal, strerror(errno));
+        return 1;
+    }
+
+    unsigned restored = 0, skipped = 0, errors = 0;
+    for (size_t l = lines.size(); l-- > 0; )
+    {
+        const std::string &entry = lines[l];
+        const size_t tab = entry.rfind('\t');
+        const std::string path = entry.substr(0, tab);
+        const int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0)
+        {
+            fprintf(out, "Can't open the file: %s. %s\n", path.c_str(), strerror(errno));
+            errors++;
+            continue;
+        }
+        const char *p = entry.c_str() + tab + 1;
+        unsigned offset, oldByte, newByte;
+        int n;
+        bool changed = false;
+        while (sscanf(p, "%u:%2X>%2X%n", &offset, &oldByte, &newByte, &n) == 3)
+        {
+            p += n;
+            unsigned char current;
+            if (pread(fd, &current, 1, offset) != 1 || current != newByte)
+                continue;
+            const unsigned char value = oldByte;
+            if (pwrite(fd, &value, 1, offset) != 1)
+            {
+                fprintf(out, "Error writing to file: %s. %s\n", path.c_str(), strerror(errno));
+                errors++;
+                break;
+            }
+            changed = true;
+        }
+        if (fsyncPolicy != FSYNC_NEVER)
+            fdatasync(fd);
+        close(fd);
+        if (changed)
+            restored++;
+        else
+            skipped++;
+    }
+
+    // an interrupted bulk edit can't be resumed after the rollback
+    if (state == JOURNAL_COMMITTED && errors == 0)
+    {
+        FILE *file = fopen(journal, "a");
+        if (file == NULL || fputs("ROLLBACK\n", file) == EOF || fclose(file) != 0)
+            fprintf(out, "Error writing to the journal: %s. %s\n", journal, strerror(errno));
+    }
+    fprintf(out, "%u files restored, %u unchanged\n", restored, skipped);
+    return errors ? 1 : 0;
+}
+
+// ***************************************************************************
+
+/*! Unpack a packed voice data-block.
+ *
+ *  \param uVoice a pointer to the generated unpacked data
+ *  \param pVoice a pointer to the packed voice data
+ */
+void UnpackVoice(VoiceUnpacked *uVoice, const VoicePacked *pVoice)
+{
+    // unpack data for each operator
     for (unsigned i = 0; i < 6; ++i)
     {
         uVoice->op[i].EG_R1 = pVoice->op[i].EG_R1;
@@ -850,6 +1993,68 @@ void UnpackVoice(VoiceUnpacked *uVoice, const VoicePacked *pVoice)
 
 // ***************************************************************************
 
+/*! Pack a voice data-block. Bits of the packed voice that are not used by
+ *  any parameter are left as they are.
+ *
+ *  \param pVoice a pointer to the packed voice data, updated
+ *  \param uVoice a pointer to the unpacked data
+ */
+void PackVoice(VoicePacked *pVoice, const VoiceUnpacked *uVoice)
+{
+    // pack data for each operator
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        pVoice->op[i].EG_R1 = uVoice->op[i].EG_R1;
+        pVoice->op[i].EG_R2 = uVoice->op[i].EG_R2;
+        pVoice->op[i].EG_R3 = uVoice->op[i].EG_R3;
+        pVoice->op[i].EG_R4 = uVoice->op[i].EG_R4;
+        pVoice->op[i].EG_L1 = uVoice->op[i].EG_L1;
+        pVoice->op[i].EG_L2 = uVoice->op[i].EG_L2;
+        pVoice->op[i].EG_L3 = uVoice->op[i].EG_L3;
+        pVoice->op[i].EG_L4 = uVoice->op[i].EG_L4;
+        pVoice->op[i].levelScalingBreakPoint = uVoice->op[i].levelScalingBreakPoint;
+        pVoice->op[i].scaleLeftDepth = uVoice->op[i].scaleLeftDepth;
+        pVoice->op[i].scaleRightDepth = uVoice->op[i].scaleRightDepth;
+        pVoice->op[i].scaleLeftCurve = uVoice->op[i].scaleLeftCurve;
+        pVoice->op[i].scaleRightCurve = uVoice->op[i].scaleRightCurve;
+        pVoice->op[i].rateScale = uVoice->op[i].rateScale;
+        pVoice->op[i].amplitudeModulationSensitivity = uVoice->op[i].amplitudeModulationSensitivity;
+        pVoice->op[i].keyVelocitySensitivity = uVoice->op[i].keyVelocitySensitivity;
+        pVoice->op[i].outputLevel = uVoice->op[i].outputLevel;
+        pVoice->op[i].oscillatorMode = uVoice->op[i].oscillatorMode;
+        pVoice->op[i].frequencyCoarse = uVoice->op[i].frequencyCoarse;
+        pVoice->op[i].frequencyFine = uVoice->op[i].frequencyFine;
+        pVoice->op[i].detune = uVoice->op[i].detune;
+    }
+
+    // pack remaining part of voice
+    pVoice->pitchEGR1 = uVoice->pitchEGR1;
+    pVoice->pitchEGR2 = uVoice->pitchEGR2;
+    pVoice->pitchEGR3 = uVoice->pitchEGR3;
+    pVoice->pitchEGR4 = uVoice->pitchEGR4;
+    pVoice->pitchEGL1 = uVoice->pitchEGL1;
+    pVoice->pitchEGL2 = uVoice->pitchEGL2;
+    pVoice->pitchEGL3 = uVoice->pitchEGL3;
+    pVoice->pitchEGL4 = uVoice->pitchEGL4;
+    pVoice->algorithm = uVoice->algorithm;
+    pVoice->feedback = uVoice->feedback;
+    pVoice->oscKeySync = uVoice->oscKeySync;
+    pVoice->lfoSpeed = uVoice->lfoSpeed;
+    pVoice->lfoDelay = uVoice->lfoDelay;
+    pVoice->lfoPitchModDepth = uVoice->lfoPitchModDepth;
+    pVoice->lfoAMDepth = uVoice->lfoAMDepth;
+    pVoice->lfoSync = uVoice->lfoSync;
+    pVoice->lfoWave = uVoice->lfoWave;
+    pVoice->lfoPitchModSensitivity = uVoice->lfoPitchModSensitivity;
+    pVoice->transpose = uVoice->transpose;
+    for (unsigned i = 0; i < 10; ++i)
+    {
+        pVoice->name[i] = uVoice->name[i];
+    }
+}
+
+// ***************************************************************************
+
 /*! Check the integrity of a sysex dump
  *
  *  \param sysex a pointer to a DX7Sysex data block
@@ -945,7 +2150,7 @@ int VerifySingle(const DX7SingleSysex *sysex)
         if (sum != sysex->checksum)
         {
             error += 2;
-            printf("CHECKSUM FAILED: Should have been 0x%2.2X\n", sum);
+            sprintf(msgBuffer, "CHECKSUM FAILED: Should have been 0x%2.2X\n", sum);
             //fixNeeded = true;
         }
 
@@ -958,119 +2163,135 @@ int VerifySingle(const DX7SingleSysex *sysex)
 
 // ***************************************************************************
 
-/*! set global vertical line character for UNICODE or ASCII
- */ 
-void setVertLineChar()
+/*! Print a separator-line between the parameters of two different voices.
+ */
+void VoiceSeparator()
 {
-    if (useUnicode)
-        vl = vertLineUnicode;
+    // same length (-1) as op-table
+    static const char separator[] =
+        "\n========================"
+        "==============================================================================\n\n";
+
+    if (formfeed)
+        fprintf(out, "\f");
     else
-        vl = vertLineAscii;
+        fwrite(separator, 1, sizeof(separator) - 1, out);
 }
 
 // ***************************************************************************
 
-char empty[1] = "";
-
-/*! Print one row of an OperatorTable (compact form).
- *
- *  \param name pointer to the parameter-name of the row
- *  \param data pointer to the stringified parameters of all 6 OP's
- */
-void OpTableRow(const char* name, char* data = empty)
+//! UTF-8 lengths of the entries of lcdTableUnicode
+struct LcdLengthTable
 {
-    printf("\n%s %-22s%s", vl, name, vl);
-    if (data[0] == 0)
-    {
-        // print a blank row if no data
-        for (unsigned i = 0; i < 6; i++)
-        {
-            printf("            %s", vl);
-        }
-    }
-    else
-    {
-        printf("%s", data);
-    }
-}
-
-// ***************************************************************************
+    unsigned char length[256];
+};
 
-/*! Print the horizontal line of an OperatorTable
+/*! Build the table of UTF-8 lengths of the LCD characters.
+ *
+ * \return table of lengths
  */
-void OpTableSeparator(HorRulerPos pos)
+constexpr LcdLengthTable MakeLcdLengthTable()
 {
-    if (useUnicode)
-    {
-        const char* middle = middleBorder[pos];
-        printf("\n%s───────────────────────%s",leftBorder[pos], middleBorder[pos]);
-        for (unsigned i = 1; i < 7; i++)
-        {
-            if (i == 6)
-                middle = rightBorder[pos];
-            printf("────────────%s", middle);
-        }
-    }
-    else
+    LcdLengthTable table = {};
+    for (unsigned i = 0; i < 256; i++)
     {
-        printf("\n+-----------------------+");
-        for (unsigned i = 1; i < 7; i++)
-        {
-            printf("------------+");
-        }
+        unsigned len = 0;
+        while (len < 4 && lcdTableUnicode[i][len] != 0)
+            len++;
+        table.length[i] = len;
     }
+    return table;
 }
 
-// ***************************************************************************
+constexpr LcdLengthTable lcdLengthTable = MakeLcdLengthTable();
 
-/*! Print a separator-line between the parameters of two different voices.
+#ifdef __SSE2__
+/*! Replace all bytes with one value by another value.
+ *
+ *  \param v 16 bytes
+ *  \param from value to replace
+ *  \param to new value
+ *  \return bytes with replaced values
  */
-void VoiceSeparator()
+inline __m128i ReplaceBytes(__m128i v, char from, char to)
 {
-    if (formfeed)
-    {
-        printf("\f");
-    }
-    else
-    {
-        // make voice separator same length (-1) as op-table
-        printf("\n========================");
-        for (unsigned i = 1; i < 7; i++)
-        {
-            printf("=============");
-        }
-        puts("\n");
-    }
+    const __m128i match = _mm_cmpeq_epi8(v, _mm_set1_epi8(from));
+    return _mm_or_si128(_mm_andnot_si128(match, v), _mm_and_si128(match, _mm_set1_epi8(to)));
 }
-
-// ***************************************************************************
+#endif
 
 /*! Convert the name of a voice from the stored format to printable ASCII.
+ *
+ *  Bytes with the 8th bit set are not valid in a sysex voice name. They are
+ *  decoded with the upper half of the LCD table in Unicode, like their lower
+ *  7 bits in ASCII, and reported by the return value.
  *
  *  \param nameAscii a pointer to the converted ASCII string
  *  \param nameLcd a pointer to the original name string as stored in file
+ *  \return true if all bytes of the name are 7-bit
  */
-void Name2Ascii(char *nameAscii, const unsigned char *nameLcd)
+bool Name2Ascii(char *nameAscii, const unsigned char *nameLcd)
 {
     if (useUnicode)
     {
-        // convert characters from LCD to Unicode
-        nameAscii[0] = 0; 
+        // convert characters from LCD to Unicode, the entries are padded to 4 bytes
+        unsigned char high = 0;
+        char *p = nameAscii;
         for (unsigned i = 0; i < 10; i++)
         {
-            strcat(nameAscii, lcdTableUnicode[int(nameLcd[i])]);
+            const unsigned c = nameLcd[i];
+            high |= c;
+            memcpy(p, lcdTableUnicode[c], 4);
+            p += lcdLengthTable.length[c];
         }
+        *p = 0;
+        return (high & 0x80) == 0;
     }
-    else
+
+    // convert characters from LCD to ASCII
+#ifdef __SSE2__
+    // only the control characters and 3 more characters are translated
+    unsigned char bytes[16] = {};
+    memcpy(bytes, nameLcd, 10);
+    __m128i v = _mm_loadu_si128((const __m128i *)bytes);
+    const int high = _mm_movemask_epi8(v);
+    v = _mm_and_si128(v, _mm_set1_epi8(0x7F));
+    const __m128i control = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+    v = _mm_or_si128(_mm_andnot_si128(control, v), _mm_and_si128(control, _mm_set1_epi8(' ')));
+    v = ReplaceBytes(v, 0x5C, lcdTableAscii[0x5C]);
+    v = ReplaceBytes(v, 0x7E, lcdTableAscii[0x7E]);
+    v = ReplaceBytes(v, 0x7F, lcdTableAscii[0x7F]);
+    _mm_storeu_si128((__m128i *)bytes, v);
+    memcpy(nameAscii, bytes, 10);
+    nameAscii[10] = 0;
+    return high == 0;
+#else
+    unsigned char high = 0;
+    for (unsigned i = 0; i < 10; i++)
     {
-        // convert characters from LCD to ASCII
-        //nameAscii = ""; 
-        for (unsigned i = 0; i < 10; i++)
-        {
-            nameAscii[i] = lcdTableAscii[int(nameLcd[i])];
-        }
-        nameAscii[10] = 0;
+        nameAscii[i] = lcdTableAscii[nameLcd[i] & 0x7F];
+        high |= nameLcd[i];
+    }
+    nameAscii[10] = 0;
+    return (high & 0x80) == 0;
+#endif
+}
+
+/*! Convert all voice names of a bank to printable ASCII.
+ *
+ *  \param names array the 32 converted names are written to
+ *  \param sysex a pointer to a DX7Sysex data block
+ *  \return bit mask of the voices (bit 0 = voice 1) with 8-bit bytes in the name
+ */
+uint32_t BankNames2Ascii(char names[32][41], const DX7Sysex *sysex)
+{
+    uint32_t invalid = 0;
+    for (unsigned voiceNum = 0; voiceNum < 32; voiceNum++)
+    {
+        if (!Name2Ascii(names[voiceNum], sysex->voices[voiceNum].name))
+            invalid |= 1u << voiceNum;
     }
+    return invalid;
 }
 
 // ***************************************************************************
@@ -1089,669 +2310,7555 @@ void PrintFilename(const char *filename)
     }
     if (plainFilenames)
     {
-        printf("%s\n", filename + n);
+        fprintf(out, "%s\n", filename + n);
     }
     else
     {
-        printf("File: \"%s\"\n", filename + n);
+        fprintf(out, "File: \"%s\"\n", filename + n);
     }
 }
 
 // ***************************************************************************
 
-/*! Format and print a complete bank-dump.
+// JSON output
+
+/*! Append a JSON string (quoted and escaped).
  *
- *  \param sysex a pointer to a DX7Sysex data block
- *  \param filename a pointer to the filename
+ *  \param json string the JSON text is appended to
+ *  \param text a pointer to the text
+ *  \param len length of the text
  */
-void Format(const DX7Sysex *sysex, const char *filename)
+void JsonString(std::string &json, const char *text, size_t len)
 {
-    if (!voiceDataList)
+    static const char hexDigits[] = "0123456789abcdef";
+    json += '"';
+    for (size_t i = 0; i < len; i++)
     {
-        // voice name listing only
-        unsigned rows = 32;
-        unsigned columns = 1;
-        char voiceDelimiter = '|';
-        if (tabularListing)
+        const unsigned char c = text[i];
+        if (c == '"' || c == '\\')
         {
-            if (!showHex)
-            {
-                rows = 8;
-                columns = 4;
-            }
-            else
-            {
-                rows = 16;
-                columns = 2;
-            }   
+            json += '\\';
+            json += c;
         }
-        else if (!showHex)
+        else if (c < 0x20)
         {
-            // no delimiter for plain full voice name listing
-            voiceDelimiter = ' ';
+            json += "\\u00";
+            json += hexDigits[c >> 4];
+            json += hexDigits[c & 0x0F];
         }
-
-        if (!softError)
+        else
+        {
+            json += c;
+        }
+    }
+    json += '"';
+}
+
+/*! Append a JSON string (quoted and escaped).
+ *
+ *  \param json string the JSON text is appended to
+ *  \param text a pointer to the zero-terminated text
+ */
+void JsonString(std::string &json, const char *text)
+{
+    JsonString(json, text, strlen(text));
+}
+
+/*! Append a JSON member with a numeric value: "key":value
+ *
+ *  \param json string the JSON text is appended to
+ *  \param key a pointer to the member name
+ *  \param value member value
+ */
+void JsonNumber(std::string &json, const char *key, int value)
+{
+    char text[16];
+    json += '"';
+    json += key;
+    json += "\":";
+    json.append(text, sprintf(text, "%d", value));
+}
+
+/*! Append a JSON member with a string value: "key":"value"
+ *
+ *  \param json string the JSON text is appended to
+ *  \param key a pointer to the member name
+ *  \param value a pointer to the member value
+ */
+void JsonText(std::string &json, const char *key, const char *value)
+{
+    json += '"';
+    json += key;
+    json += "\":";
+    JsonString(json, value);
+}
+
+/*! Append all parameters of a voice as JSON members (without braces).
+ *
+ *  The raw parameter values are named like the members of VoiceUnpacked;
+ *  the object "decoded" holds the same values as shown in the voice data list.
+ *  Operators are listed in the order operator 1 to 6.
+ *
+ *  \param json string the JSON text is appended to
+ *  \param voice a pointer to the unpacked voice data
+ */
+void JsonVoice(std::string &json, const VoiceUnpacked *voice)
+{
+    char text[41];
+    Name2Ascii(text, voice->name);
+    JsonText(json, "name", text);
+
+    const unsigned char *data = (const unsigned char *)voice;
+    for (unsigned i = 0; i < voiceFieldCount; i++)
+    {
+        json += ',';
+        JsonNumber(json, voiceFields[i].name, data[voiceFields[i].offset]);
+    }
+
+    json += ",\"decoded\":{";
+    JsonNumber(json, "algorithm", voice->algorithm + 1);
+    json += ',';
+    JsonText(json, "oscKeySync", OnOff(voice->oscKeySync));
+    json += ',';
+    JsonText(json, "lfoSync", OnOff(voice->lfoSync));
+    json += ',';
+    JsonText(json, "lfoWave", LFOWave(voice->lfoWave));
+    json += ',';
+    JsonNumber(json, "transpose", voice->transpose - 24);
+    json += ',';
+    JsonText(json, "transposeNote", Transpose(voice->transpose));
+    json += "},\"operators\":[";
+
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        // They're stored in backward order.
+        const OperatorUnpacked &op = voice->op[5 - i];
+        const unsigned char *opData = (const unsigned char *)&op;
+        if (i > 0)
+            json += ',';
+        json += '{';
+        JsonNumber(json, "operator", i + 1);
+        for (unsigned j = 0; j < operatorFieldCount; j++)
+        {
+            json += ',';
+            JsonNumber(json, operatorFields[j].name, opData[operatorFields[j].offset]);
+        }
+        json += ",\"decoded\":{";
+        JsonText(json, "oscillatorMode", Mode(op.oscillatorMode));
+        json += ',';
+        JsonText(json, "frequency", Frequency(op));
+        json += ',';
+        JsonNumber(json, "detune", op.detune - 7);
+        json += ',';
+        JsonText(json, "levelScalingBreakPoint", Breakpoint(op.levelScalingBreakPoint));
+        json += ',';
+        JsonText(json, "scaleLeftCurve", Curve(op.scaleLeftCurve));
+        json += ',';
+        JsonText(json, "scaleRightCurve", Curve(op.scaleRightCurve));
+        json += "}}";
+    }
+    json += ']';
+}
+
+// ***************************************************************************
+
+// Voice hashes and known factory voices
+
+/*! Hash a block of bytes, 8 bytes per step (multiply and xor-shift mixing,
+ *  finished like splitmix64).
+ *
+ *  \param data a pointer to the data
+ *  \param size number of bytes
+ *  \return 64-bit hash
+ */
+uint64_t HashBytes(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t hash = 0xCBF29CE484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ p[i]) * 0x100000001B3ULL;
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+/*! Hash the sound of a voice (the unpacked data without name).
+ *
+ *  \param voice a pointer to the unpacked voice data
+ *  \return 64-bit hash
+ */
+uint64_t VoiceHash(const VoiceUnpacked *voice)
+{
+    return HashBytes(voice, offsetof(VoiceUnpacked, name));
+}
+
+constexpr unsigned factoryVoiceCount = sizeof(factoryVoices) / sizeof(factoryVoices[0]);
+constexpr unsigned factoryBucketCount = sizeof(factoryDisplacements) / sizeof(factoryDisplacements[0]);
+
+/*! Bucket of a voice hash in the perfect hash of the factory voices.
+ *
+ *  \param hash voice hash
+ *  \param buckets number of buckets
+ *  \return bucket
+ */
+constexpr unsigned FactoryBucket(uint64_t hash, unsigned buckets)
+{
+    return (unsigned)((hash >> 32) % buckets);
+}
+
+/*! Slot of a voice hash in the perfect hash of the factory voices.
+ *
+ *  \param hash voice hash
+ *  \param displacement displacement of the bucket of the hash
+ *  \param slots number of slots
+ *  \return slot
+ */
+constexpr unsigned FactorySlot(uint64_t hash, unsigned displacement, unsigned slots)
+{
+    return (unsigned)((((hash ^ (displacement * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL) >> 32) % slots);
+}
+
+/*! Look up a voice in the table of known factory voices (dx7factory.h).
+ *
+ *  \param hash voice hash (VoiceHash())
+ *  \return label of the voice, or NULL if it isn't a known voice
+ */
+constexpr const char *FactoryLabel(uint64_t hash)
+{
+    const FactoryVoice &entry = factoryVoices[FactorySlot(hash,
+        factoryDisplacements[FactoryBucket(hash, factoryBucketCount)], factoryVoiceCount)];
+    return entry.hash == hash ? entry.label : NULL;
+}
+
+/*! Check at compile time that every voice of the table is found in its slot.
+ *
+ *  \return true if the table is a perfect hash
+ */
+constexpr bool FactoryTableOk()
+{
+    for (unsigned i = 0; i < factoryVoiceCount; i++)
+    {
+        if (factoryVoices[i].label && FactoryLabel(factoryVoices[i].hash) != factoryVoices[i].label)
+            return false;
+    }
+    return true;
+}
+
+static_assert(FactoryTableOk(), "dx7factory.h is no perfect hash, regenerate it with --factory-table");
+
+// ***************************************************************************
+
+// Voice data tables (option -d)
+
+//! Table borders and algorithm diagrams of one character set.
+template <bool Unicode>
+struct TableCharset;
+
+//! Voice and LFO tables of one character set and table variant.
+template <bool Unicode, int Variant>
+struct TableLayout;
+
+//! Table borders of the voice data listing in ASCII
+template <>
+struct TableCharset<false>
+{
+    static constexpr const char *vl = "|";
+    static constexpr const char **algorithmDiagram = algorithmDiagramAscii;
+    static constexpr char opTop[] =
+        "\n"
+        "+-----------------------+------------+------------+------------+------------+------------+------------+";
+    static constexpr char opMiddle[] =
+        "\n"
+        "+-----------------------+------------+------------+------------+------------+------------+------------+";
+    static constexpr char opBottom[] =
+        "\n"
+        "+-----------------------+------------+------------+------------+------------+------------+------------+";
+    static constexpr char opBlankCells[] =
+        "            |            |            |            |            |            |";
+};
+
+//! Table borders of the voice data listing in Unicode
+template <>
+struct TableCharset<true>
+{
+    static constexpr const char *vl = "│";
+    static constexpr const char **algorithmDiagram = algorithmDiagramUnicode;
+    static constexpr char opTop[] =
+        "\n"
+        "┌───────────────────────┬────────────┬────────────┬────────────┬────────────┬────────────┬────────────┐";
+    static constexpr char opMiddle[] =
+        "\n"
+        "├───────────────────────┼────────────┼────────────┼────────────┼────────────┼────────────┼────────────┤";
+    static constexpr char opBottom[] =
+        "\n"
+        "└───────────────────────┴────────────┴────────────┴────────────┴────────────┴────────────┴────────────┘";
+    static constexpr char opBlankCells[] =
+        "            │            │            │            │            │            │";
+};
+
+//! Voice and LFO tables of table variant 1 in ASCII
+template <>
+struct TableLayout<false, 1>
+{
+    static constexpr char voiceHead[] =
+        "+------------+-------+-------+------------+-------------------------------+--------+\n"
+        "|            | Algo- | Feed- | Oscillator |   Pitch Envelope Generator    | Trans- |\n"
+        "| Voice Name | rithm | back  | Key Sync   | R1:L1 | R2:L2 | R3:L3 | R4:L4 | pose   |\n"
+        "+------------+-------+-------+------------+-------+-------+-------+-------+--------+\n";
+    static constexpr char voiceFoot[] =
+        "+------------+-------+-------+------------+-------+-------+-------+-------+--------+\n"
+        "\n"
+        "\n"
+        "+---------------------------------------------------------------------+\n"
+        "|                                  LFO                                |\n"
+        "|          |       |       | Pitch     | Amplitude | Key   | Pitch    |\n"
+        "| Wave     | Speed | Delay | Mod Depth | Mod Depth | Sync  | Mod Sens |\n"
+        "+----------+-------+-------+-----------+-----------+-------+----------+\n";
+    static constexpr char lfoFoot[] =
+        "+----------+-------+-------+-----------+-----------+-------+----------+\n"
+        "\n";
+};
+
+//! Voice and LFO tables of table variant 2 in ASCII
+template <>
+struct TableLayout<false, 2>
+{
+    static constexpr char voiceHead[] =
+        "+------------+-------+-------+------------+--------+\n"
+        "|            | Algo- | Feed- | Oscillator | Trans- |\n"
+        "| Voice Name | rithm | back  | Key Sync   | pose   |\n"
+        "+------------+-------+-------+------------+--------+\n";
+    static constexpr char voiceFoot[] =
+        "+------------+-------+-------+------------+--------+\n"
+        "\n"
+        "\n"
+        "+---------------------------------------------------------------------+-------------------------------+\n"
+        "|                                  LFO                                |   Pitch Envelope Generator    |\n"
+        "+----------+-------+-------+-----------+-----------+-------+----------+-------+-------+-------+-------+\n"
+        "|          |       |       | Pitch     | Amplitude | Key   | Pitch    |       |       |       |       |\n"
+        "| Wave     | Speed | Delay | Mod Depth | Mod Depth | Sync  | Mod Sens | R1:L1 | R2:L2 | R3:L3 | R4:L4 |\n"
+        "+----------+-------+-------+-----------+-----------+-------+----------+-------+-------+-------+-------+\n";
+    static constexpr char lfoFoot[] =
+        "+----------+-------+-------+-----------+-----------+-------+----------+-------+-------+-------+-------+\n"
+        "\n";
+};
+
+//! Voice and LFO tables of table variant 1 in Unicode
+template <>
+struct TableLayout<true, 1>
+{
+    static constexpr char voiceHead[] =
+        "┌────────────┬───────┬───────┬────────────┬───────────────────────────────┬────────┐\n"
+        "│            │       │       │            │   Pitch Envelope Generator    │        │\n"
+        "│            │ Algo- │ Feed- │ Oscillator ├───────┬───────┬───────┬───────┤ Trans- │\n"
+        "│ Voice Name │ rithm │ back  │ Key Sync   │ R1:L1 │ R2:L2 │ R3:L3 │ R4:L4 │ pose   │\n"
+        "├────────────┼───────┼───────┼────────────┼───────┼───────┼───────┼───────┼────────┤\n";
+    static constexpr char voiceFoot[] =
+        "└────────────┴───────┴───────┴────────────┴───────┴───────┴───────┴───────┴────────┘\n"
+        "\n"
+        "┌─────────────────────────────────────────────────────────────────────┐\n"
+        "│                                  LFO                                │\n"
+        "├──────────┬───────┬───────┬───────────┬───────────┬───────┬──────────┤\n"
+        "│          │       │       │ Pitch     │ Amplitude │ Key   │ Pitch    │\n"
+        "│ Wave     │ Speed │ Delay │ Mod Depth │ Mod Depth │ Sync  │ Mod Sens │\n"
+        "├──────────┼───────┼───────┼───────────┼───────────┼───────┼──────────┤\n";
+    static constexpr char lfoFoot[] =
+        "└──────────┴───────┴───────┴───────────┴───────────┴───────┴──────────┘\n";
+};
+
+//! Voice and LFO tables of table variant 2 in Unicode
+template <>
+struct TableLayout<true, 2>
+{
+    static constexpr char voiceHead[] =
+        "┌────────────┬───────┬───────┬────────────┬────────┐\n"
+        "│            │ Algo- │ Feed- │ Oscillator │ Trans- │\n"
+        "│ Voice Name │ rithm │ back  │ Key Sync   │ pose   │\n"
+        "├────────────┼───────┼───────┼────────────┼────────┤\n";
+    static constexpr char voiceFoot[] =
+        "└────────────┴───────┴───────┴────────────┴────────┘\n"
+        "\n"
+        "┌─────────────────────────────────────────────────────────────────────┬───────────────────────────────┐\n"
+        "│                                  LFO                                │   Pitch Envelope Generator    │\n"
+        "├──────────┬───────┬───────┬───────────┬───────────┬───────┬──────────┼───────┬───────┬───────┬───────┤\n"
+        "│          │       │       │ Pitch     │ Amplitude │ Key   │ Pitch    │       │       │       │       │\n"
+        "│ Wave     │ Speed │ Delay │ Mod Depth │ Mod Depth │ Sync  │ Mod Sens │ R1:L1 │ R2:L2 │ R3:L3 │ R4:L4 │\n"
+        "├──────────┼───────┼───────┼───────────┼───────────┼───────┼──────────┼───────┼───────┼───────┼───────┤\n";
+    static constexpr char lfoFoot[] =
+        "└──────────┴───────┴───────┴───────────┴───────────┴───────┴──────────┴───────┴───────┴───────┴───────┘\n";
+};
+
+/*! Print a constant block of text.
+ *
+ *  \param block text
+ */
+template <size_t N>
+inline void PutBlock(const char (&block)[N])
+{
+    fwrite(block, 1, N - 1, out);
+}
+
+/*! Print one row of an OperatorTable (compact form).
+ *
+ *  \param name pointer to the parameter-name of the row
+ *  \param data pointer to the stringified parameters of all 6 OP's
+ */
+template <class Charset>
+void OpTableRow(const char *name, const char *data)
+{
+    fprintf(out, "\n%s %-22s%s%s", Charset::vl, name, Charset::vl, data);
+}
+
+/*! Print a row of an OperatorTable without data.
+ *
+ *  \param name pointer to the parameter-name of the row
+ */
+template <class Charset>
+void OpTableRow(const char *name)
+{
+    fprintf(out, "\n%s %-22s%s", Charset::vl, name, Charset::vl);
+    PutBlock(Charset::opBlankCells);
+}
+
+/*! Unpack a voice of a bank for the hex listing.
+ *
+ *  \param voice a pointer to the packed voice data
+ *  \param unpacked buffer for the unpacked data
+ *  \return pointer to the unpacked data
+ */
+inline const VoiceUnpacked *Unpacked(const VoicePacked *voice, VoiceUnpacked *unpacked)
+{
+    UnpackVoice(unpacked, voice);
+    return unpacked;
+}
+
+/*! The voice of a single voice dump is already unpacked.
+ *
+ *  \param voice a pointer to the unpacked voice data
+ *  \return voice
+ */
+inline const VoiceUnpacked *Unpacked(const VoiceUnpacked *voice, VoiceUnpacked *)
+{
+    return voice;
+}
+
+/*! Look up a voice of a single voice dump in the table of known factory voices.
+ *
+ *  \param voice a pointer to the unpacked voice data
+ *  \return label of the voice, or NULL if it isn't a known voice
+ */
+const char *FactoryLabel(const VoiceUnpacked *voice)
+{
+    return FactoryLabel(VoiceHash(voice));
+}
+
+//! number of entries of the factory label cache of a thread
+constexpr unsigned factoryCacheSize = 256;
+
+/*! Look up a voice of a bank in the table of known factory voices. The labels
+ *  are cached per thread by the hash of the packed voice without name: a bank
+ *  is looked up for the voice names, the voice data list, and --find-dupes,
+ *  and most banks repeat voices (INIT VOICE), so most voices are unpacked and
+ *  hashed for the table only once.
+ *
+ *  \param voice a pointer to the packed voice data
+ *  \return label of the voice, or NULL if it isn't a known voice
+ */
+const char *FactoryLabel(const VoicePacked *voice)
+{
+    struct CacheEntry
+    {
+        uint64_t key;
+        const char *label;
+        bool used;
+    };
+    static thread_local CacheEntry cache[factoryCacheSize];
+    const uint64_t key = HashBytes(voice, offsetof(VoicePacked, name));
+    CacheEntry &entry = cache[key % factoryCacheSize];
+    if (!entry.used || entry.key != key)
+    {
+        VoiceUnpacked unpacked;
+        UnpackVoice(&unpacked, voice);
+        entry.key = key;
+        entry.label = FactoryLabel(VoiceHash(&unpacked));
+        entry.used = true;
+    }
+    return entry.label;
+}
+
+/*! Print the head of the voice data list: filename, voice number, name.
+ *
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (0..31)
+ *  \param voice a pointer to the voice data (VoicePacked or VoiceUnpacked)
+ */
+template <bool Hex, class Voice>
+void VoiceListHead(const char *filename, unsigned voiceNum, const Voice *voice)
+{
+    PrintFilename(filename);
+    fprintf(out, "Voice-#: %d\n", voiceNum + 1);
+    Name2Ascii(name, voice->name);
+    fprintf(out, "Name: \"%s\"", name);
+    const char *label = FactoryLabel(voice);
+    if (label)
+        fprintf(out, " [%s]", label);
+    if (Hex)
+    {
+        // voice name: show name in hex
+        fprintf(out, " | ");
+        for (unsigned i = 0; i < 10; i++)
+        {
+            fprintf(out, " %2.2X", voice->name[i]);
+        }
+
+        // print single voice raw data
+        VoiceUnpacked unpackedVoice;
+        const VoiceUnpacked *uVoice = Unpacked(voice, &unpackedVoice);
+        fprintf(out, "\n\nVoice Data:");
+        const unsigned char* uVoiceChar = (const unsigned char*)uVoice;
+        for (unsigned i = 0; i < sizeof(VoiceUnpacked); i++)
+        {
+            fprintf(out, " %2.2X", uVoiceChar[i]);
+        }
+        fprintf(out, " %2.2X [last byte = checksum]", ChecksumSingle(uVoice, sizeof(VoiceUnpacked)));
+    }
+
+    PutLine("\n");
+}
+
+/*! Print the voice data list of one voice in tabular form.
+ *
+ *  One instance is compiled for each character set, table variant, hex
+ *  mode, and voice format (bank or single voice dump); the instances are
+ *  selected once by SelectRenderer().
+ *
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (0..31)
+ *  \param voice a pointer to the voice data (VoicePacked or VoiceUnpacked)
+ */
+template <bool Unicode, int Variant, bool Hex, class Voice>
+void VoiceTable(const char *filename, unsigned voiceNum, const Voice *voice)
+{
+    typedef TableCharset<Unicode> Charset;
+    typedef TableLayout<Unicode, Variant> Layout;
+    const char *vl = Charset::vl;
+
+    VoiceListHead<Hex>(filename, voiceNum, voice);
+
+    fprintf(out, "Algorithm: %u\n", voice->algorithm + 1);
+    // print algorithm diagram as ASCII-art (unpacked voices aren't masked to 0..31)
+    if (voice->algorithm < 32)
+        fprintf(out, "\n%s\n", Charset::algorithmDiagram[voice->algorithm]);
+    else
+        fprintf(out, "\n%s\n\n", OutOfRange());
+
+    PutBlock(Layout::voiceHead);
+    if (Variant == 2)
+    {
+        // +------------+-------+-------+------------+--------+
+        // |            | Algo- | Feed- | Oscillator | Trans- |
+        // | Voice Name | rithm | back  | Key Sync   | pose   |
+        // +------------+-------+-------+------------+--------+
+        fprintf(out, "%s %-10s %s %5u %s %5u %s %10s %s %6d %s\n",
+            vl, name, vl,
+            voice->algorithm + 1, vl,
+            voice->feedback, vl,
+            OnOff(voice->oscKeySync), vl,
+            voice->transpose - 24, vl);
+        PutBlock(Layout::voiceFoot);
+
+        // +--------------------------------------------------+-----------------------+
+        // |                       LFO                        | Pitch Env. Generator  |
+        // +----+-----+-----+---------+---------+----+--------+-----+-----+-----+-----+
+        // |    |     |     |Pitch    |Amplitude|Key |Pitch   |     |     |     |     |
+        // |Wave|Speed|Delay|Mod Depth|Mod Depth|Sync|Mod Sens|R1:L1|R2:L2|R3:L3|R4:L4|
+        // +----+-----+-----+---------+---------+----+--------+-----+-----+-----+-----+
+        fprintf(out, "%s %8s %s %5u %s %5u %s %9u %s %9u %s %5s %s %8u "
+               "%s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s\n",
+            vl, LFOWave(voice->lfoWave), vl,
+            voice->lfoSpeed, vl,
+            voice->lfoDelay, vl,
+            voice->lfoPitchModDepth, vl,
+            voice->lfoAMDepth, vl,
+            OnOff(voice->lfoSync), vl,
+            voice->lfoPitchModSensitivity, vl,
+            voice->pitchEGR1, voice->pitchEGL1, vl,
+            voice->pitchEGR2, voice->pitchEGL2, vl,
+            voice->pitchEGR3, voice->pitchEGL3, vl,
+            voice->pitchEGR4, voice->pitchEGL4, vl);
+        PutBlock(Layout::lfoFoot);
+    }
+    else
+    {
+        // +------------+-------+-------+------------+-------------------------------+--------+
+        // |            | Algo- | Feed- | Oscillator |   Pitch Envelope Generator    | Trans- |
+        // | Voice Name | rithm | back  | Key Sync   | R1:L1 | R2:L2 | R3:L3 | R4:L4 | pose   |
+        // +------------+-------+-------+------------+-------+-------+-------+-------+--------+
+        fprintf(out, "%s %-10s %s %5u %s %5u %s %10s %s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s %6d %s\n",
+            vl, name, vl,
+            voice->algorithm + 1, vl,
+            voice->feedback, vl,
+            OnOff(voice->oscKeySync), vl,
+            voice->pitchEGR1, voice->pitchEGL1, vl,
+            voice->pitchEGR2, voice->pitchEGL2, vl,
+            voice->pitchEGR3, voice->pitchEGL3, vl,
+            voice->pitchEGR4, voice->pitchEGL4, vl,
+            voice->transpose - 24, vl);
+        PutBlock(Layout::voiceFoot);
+
+        // +---------------------------------------------------------------------+
+        // |                                  LFO                                |
+        // |          |       |       | Pitch     | Amplitude | Key   | Pitch    |
+        // | Wave     | Speed | Delay | Mod Depth | Mod Depth | Sync  | Mod Sens |
+        // +----------+-------+-------+-----------+-----------+-------+----------+
+        // | Triangle |    30 |     0 |         8 |         0 |   Off |        2 |
+        // +----------+-------+-------+-----------+-----------+-------+----------+
+        fprintf(out, "%s %8s %s %5u %s %5u %s %9u %s %9u %s %5s %s %8u %s\n",
+            vl, LFOWave(voice->lfoWave), vl,
+            voice->lfoSpeed, vl,
+            voice->lfoDelay, vl,
+            voice->lfoPitchModDepth, vl,
+            voice->lfoAMDepth, vl,
+            OnOff(voice->lfoSync), vl,
+            voice->lfoPitchModSensitivity, vl);
+        PutBlock(Layout::lfoFoot);
+    }
+
+    // buffers for operator table row data
+    char tableHeader[120] = "";
+    char ampModSens[120] = "";
+    char oscMode[120] = "";
+    char frequency[120] = "";
+    char detune[120] = "";
+    char egR1L1[120] = "";
+    char egR2L2[120] = "";
+    char egR3L3[120] = "";
+    char egR4L4[120] = "";
+    char breakpoint[120] = "";
+    char leftCurve[120] = "";
+    char rightCurve[120] = "";
+    char leftDepth[120] = "";
+    char rightDepth[120] = "";
+    char rateScale[120] = "";
+    char outputLevel[120] = "";
+    char keyVelSens[120] = "";
+
+    // prepare table row data for each operator
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        const unsigned j = 5 - i;
+        const auto &op = voice->op[j];
+
+        sprintf(tableHeader + strlen(tableHeader),
+            " Operator %u %s", i + 1, vl);
+        sprintf(ampModSens + strlen(ampModSens),
+            " %10u %s", op.amplitudeModulationSensitivity, vl);
+        sprintf(oscMode + strlen(oscMode),
+            " %10s %s", Mode(op.oscillatorMode), vl);
+        sprintf(frequency + strlen(frequency),
+            " %10s %s", Frequency(op), vl);
+        sprintf(detune + strlen(detune),
+            " %+10d %s", op.detune - 7, vl);
+        sprintf(egR1L1 + strlen(egR1L1),
+            " %4u : %-3u %s", op.EG_R1, op.EG_L1, vl);
+        sprintf(egR2L2 + strlen(egR2L2),
+            " %4u : %-3u %s", op.EG_R2, op.EG_L2, vl);
+        sprintf(egR3L3 + strlen(egR3L3),
+            " %4u : %-3u %s", op.EG_R3, op.EG_L3, vl);
+        sprintf(egR4L4 + strlen(egR4L4),
+            " %4u : %-3u %s", op.EG_R4, op.EG_L4, vl);
+        sprintf(breakpoint + strlen(breakpoint),
+            " %10s %s", Breakpoint(op.levelScalingBreakPoint), vl);
+        sprintf(leftCurve + strlen(leftCurve),
+            " %10s %s", Curve(op.scaleLeftCurve), vl);
+        sprintf(rightCurve + strlen(rightCurve),
+            " %10s %s", Curve(op.scaleRightCurve), vl);
+        sprintf(leftDepth + strlen(leftDepth),
+            " %10u %s", op.scaleLeftDepth, vl);
+        sprintf(rightDepth + strlen(rightDepth),
+            " %10u %s", op.scaleRightDepth, vl);
+        sprintf(rateScale + strlen(rateScale),
+            " %10u %s", op.rateScale, vl);
+        sprintf(outputLevel + strlen(outputLevel),
+            " %10u %s", op.outputLevel, vl);
+        sprintf(keyVelSens + strlen(keyVelSens),
+            " %10u %s", op.keyVelocitySensitivity, vl);
+    }
+
+    // print operator table
+    // operator table head
+    PutBlock(Charset::opTop);
+    OpTableRow<Charset>("", tableHeader);
+    PutBlock(Charset::opMiddle);
+    OpTableRow<Charset>("Oscillator Freq. Mode", oscMode);
+    OpTableRow<Charset>("Frequency", frequency);
+    OpTableRow<Charset>("Detune", detune);
+    PutBlock(Charset::opMiddle);
+    OpTableRow<Charset>("Envelope Generator");
+    OpTableRow<Charset>("  Rate 1 : Level 1", egR1L1);
+    OpTableRow<Charset>("  Rate 2 : Level 2", egR2L2);
+    OpTableRow<Charset>("  Rate 3 : Level 3", egR3L3);
+    OpTableRow<Charset>("  Rate 4 : Level 4", egR4L4);
+    PutBlock(Charset::opMiddle);
+    OpTableRow<Charset>("Keybd. Level Scaling");
+    OpTableRow<Charset>("  Breakpoint", breakpoint);
+    OpTableRow<Charset>("  Left Curve", leftCurve);
+    OpTableRow<Charset>("  Right Curve", rightCurve);
+    OpTableRow<Charset>("  Left Depth", leftDepth);
+    OpTableRow<Charset>("  Right Depth", rightDepth);
+    PutBlock(Charset::opMiddle);
+    OpTableRow<Charset>("Keyboard Rate Scaling", rateScale);
+    OpTableRow<Charset>("Amplitude Mod. Sens.", ampModSens);
+    OpTableRow<Charset>("Key Velocity Sens.", keyVelSens);
+    OpTableRow<Charset>("Output Level", outputLevel);
+    PutBlock(Charset::opBottom);
+
+    PutLine("");
+}
+
+//! renderer of a voice data list in tabular form
+template <class Voice>
+using VoiceTableRenderer = void (*)(const char *filename, unsigned voiceNum, const Voice *voice);
+
+//! voice table renderers selected for the current options (bank and single voice dump)
+thread_local VoiceTableRenderer<VoicePacked> voiceTableRenderer;
+thread_local VoiceTableRenderer<VoiceUnpacked> singleVoiceTableRenderer;
+
+/*! Find the voice table renderer for the character set, table variant,
+ *  and hex mode.
+ *
+ *  \return renderer for voices of type Voice
+ */
+template <class Voice>
+VoiceTableRenderer<Voice> FindRenderer()
+{
+    static const VoiceTableRenderer<Voice> renderers[2][2][2] = {
+        { { VoiceTable<false, 1, false, Voice>, VoiceTable<false, 1, true, Voice> },
+          { VoiceTable<false, 2, false, Voice>, VoiceTable<false, 2, true, Voice> } },
+        { { VoiceTable<true, 1, false, Voice>, VoiceTable<true, 1, true, Voice> },
+          { VoiceTable<true, 2, false, Voice>, VoiceTable<true, 2, true, Voice> } },
+    };
+    return renderers[useUnicode][tableVariant == 2][showHex];
+}
+
+/*! Select the voice table renderers for the character set, table variant,
+ *  and hex mode. Must be called after the options are set.
+ */
+void SelectRenderer()
+{
+    voiceTableRenderer = FindRenderer<VoicePacked>();
+    singleVoiceTableRenderer = FindRenderer<VoiceUnpacked>();
+}
+
+/*! Print the voice data list of one voice, one line per parameter.
+ *
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (0..31)
+ *  \param voice a pointer to the voice data (VoicePacked or VoiceUnpacked)
+ */
+template <class Voice>
+void VoiceList(const char *filename, unsigned voiceNum, const Voice *voice)
+{
+    if (showHex)
+        VoiceListHead<true>(filename, voiceNum, voice);
+    else
+        VoiceListHead<false>(filename, voiceNum, voice);
+
+    fprintf(out, "Algorithm: %u\n", voice->algorithm + 1);
+    fprintf(out, "Feedback: %u\n", voice->feedback);
+
+    fprintf(out, "LFO\n");
+    fprintf(out, "  Wave: %s\n", LFOWave(voice->lfoWave));
+    fprintf(out, "  Speed: %u\n", voice->lfoSpeed);
+    fprintf(out, "  Delay: %u\n", voice->lfoDelay);
+    fprintf(out, "  Pitch Mod. Depth: %u\n", voice->lfoPitchModDepth);
+    fprintf(out, "  Amplitude Mod. Depth: %u\n", voice->lfoAMDepth);
+    fprintf(out, "  Key Sync: %s\n", OnOff(voice->lfoSync));  
+    fprintf(out, "  Pitch Mod. Sensitivity: %u\n", 
+           voice->lfoPitchModSensitivity);
+
+    fprintf(out, "Oscillator Key Sync: %s\n", OnOff(voice->oscKeySync));
+
+    fprintf(out, "Pitch Envelope Generator\n");
+    fprintf(out, "  Rate 1: %u\n", voice->pitchEGR1);
+    fprintf(out, "  Rate 2: %u\n", voice->pitchEGR2);
+    fprintf(out, "  Rate 3: %u\n", voice->pitchEGR3);
+    fprintf(out, "  Rate 4: %u\n", voice->pitchEGR4);
+    fprintf(out, "  Level 1: %u\n", voice->pitchEGL1);
+    fprintf(out, "  Level 2: %u\n", voice->pitchEGL2);
+    fprintf(out, "  Level 3: %u\n", voice->pitchEGL3);
+    fprintf(out, "  Level 4: %u\n", voice->pitchEGL4);
+
+    //printf("Transpose: %s\n", Transpose(voice->transpose));
+    fprintf(out, "Transpose: %d\n", voice->transpose - 24);
+
+    // For each operator
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        PutLine("");
+        fprintf(out, "Operator: %u\n", i + 1);
+        
+        // They're stored in backward order.
+        const unsigned j = 5 - i;
+        const auto &op = voice->op[j];
+        
+        fprintf(out, "  Oscillator Mode: %s\n", Mode(op.oscillatorMode));
+        fprintf(out, "  Frequency: %s\n", Frequency(op));
+        fprintf(out, "  Detune: %+d\n", op.detune - 7);
+        fprintf(out, "  Envelope Generator\n");
+        fprintf(out, "    Rate 1: %u\n", op.EG_R1);
+        fprintf(out, "    Rate 2: %u\n", op.EG_R2);
+        fprintf(out, "    Rate 3: %u\n", op.EG_R3);
+        fprintf(out, "    Rate 4: %u\n", op.EG_R4);
+        fprintf(out, "    Level 1: %u\n", op.EG_L1);
+        fprintf(out, "    Level 2: %u\n", op.EG_L2);
+        fprintf(out, "    Level 3: %u\n", op.EG_L3);
+        fprintf(out, "    Level 4: %u\n", op.EG_L4);
+        fprintf(out, "  Keyboard Level Scaling\n");
+        fprintf(out, "    Breakpoint: %s\n", 
+               Breakpoint(op.levelScalingBreakPoint));
+        fprintf(out, "    Left Curve: %s\n", Curve(op.scaleLeftCurve));
+        fprintf(out, "    Right Curve: %s\n", Curve(op.scaleRightCurve));
+        fprintf(out, "    Left Depth: %u\n", op.scaleLeftDepth);
+        fprintf(out, "    Right Depth: %u\n", op.scaleRightDepth);
+        fprintf(out, "  Keyboard Rate Scaling: %u\n", op.rateScale);
+        fprintf(out, "  Amp Mod Sensitivity: %u\n", 
+               op.amplitudeModulationSensitivity);
+        fprintf(out, "  Key Velocity Sensitivity: %u\n", 
+               op.keyVelocitySensitivity);
+        fprintf(out, "  Output Level: %u\n", op.outputLevel);
+    }
+}
+
+// ***************************************************************************
+
+/*! Print the known factory voices of a bank (voice-# and label), if any.
+ *  Runs of the same voice are printed as range, e.g. "2-32 [INIT VOICE]".
+ *
+ *  \param sysex a pointer to a DX7Sysex data block
+ */
+void PrintFactoryVoices(const DX7Sysex *sysex)
+{
+    const char *labels[33];
+    for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        labels[voiceNum] = FactoryLabel(&sysex->voices[voiceNum]);
+    labels[32] = NULL;
+
+    bool found = false;
+    for (unsigned first = 0, last; first < 32; first = last)
+    {
+        for (last = first + 1; labels[first] && labels[last] == labels[first]; last++)
+            ;
+        if (labels[first] == NULL)
+            continue;
+        fprintf(out, "%s %d", found ? "," : "Factory voices:", first + 1);
+        if (last - first > 1)
+            fprintf(out, "-%d", last);
+        fprintf(out, " [%s]", labels[first]);
+        found = true;
+    }
+    if (found)
+        PutLine("");
+}
+
+/*! Format and print a complete bank-dump.
+ *
+ *  \param sysex a pointer to a DX7Sysex data block
+ *  \param filename a pointer to the filename
+ */
+void Format(const DX7Sysex *sysex, const char *filename)
+{
+    if (!voiceDataList)
+    {
+        // voice name listing only
+        unsigned rows = 32;
+        unsigned columns = 1;
+        char voiceDelimiter = '|';
+        if (tabularListing)
+        {
+            if (!showHex)
+            {
+                rows = 8;
+                columns = 4;
+            }
+            else
+            {
+                rows = 16;
+                columns = 2;
+            }   
+        }
+        else if (!showHex)
+        {
+            // no delimiter for plain full voice name listing
+            voiceDelimiter = ' ';
+        }
+
+        if (!softError)
         {
             PrintFilename(filename);
         }
 
-        for (unsigned row = 0; row < rows; ++row)
+        char names[32][41];
+        const uint32_t invalidNames = BankNames2Ascii(names, sysex);
+        for (unsigned row = 0; row < rows; ++row)
+        {
+            for (unsigned column = 0; column < columns; ++column)
+            {
+                const unsigned voiceNum = column * rows + row;
+                const VoicePacked *voice = &(sysex->voices[voiceNum]);
+                fprintf(out, "%2d %c%10s%c ", voiceNum + 1, voiceDelimiter, names[voiceNum], voiceDelimiter);
+                if (showHex)
+                {
+                    for (unsigned i = 0; i < 10; i++)
+                    {
+                        fprintf(out, " %2.2X", voice->name[i]);          
+                    }
+                }
+                if (column < columns - 1)
+                    fprintf(out, "         ");
+            }
+            PutLine("");          
+        }
+        if (invalidNames)
+        {
+            const char *delimiter = "Voices with 8-bit name bytes:";
+            for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+            {
+                if (invalidNames & (1u << voiceNum))
+                {
+                    fprintf(out, "%s %d", delimiter, voiceNum + 1);
+                    delimiter = ",";
+                }
+            }
+            PutLine("");
+        }
+        PrintFactoryVoices(sysex);
+        PutLine("");          
+    }
+    else    // voice data listing
+    {
+        if (softError)
+            VoiceSeparator();
+
+        // For each voice.
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        {
+            if (patch == -1 or patch == voiceNum)
+            {
+                const VoicePacked *voice = &(sysex->voices[voiceNum]);
+
+                if (tabularListing)
+                {
+                    voiceTableRenderer(filename, voiceNum, voice);
+
+                    // don't print voice separator for a single patch 
+                    if (patch == -1)
+                        VoiceSeparator();
+                }
+                else    // line by line listing
+                {
+                    VoiceList(filename, voiceNum, voice);
+
+                    // don't print any voice separator for a single patch
+                    if (patch == -1)
+                    {
+                        // print big separator at EOF
+                        if (voiceNum == 31)
+                            VoiceSeparator();
+                        else
+                            PutLine("-------------------------------------------------\n");
+                    }
+                }
+            }
+        }
+    }
+}
+
+// ***************************************************************************
+
+/*! Format and print a single voice dump like one voice of a bank. The
+ *  voice is rendered from the unpacked data of the file.
+ *
+ *  \param sysex a pointer to a DX7SingleSysex data block
+ *  \param filename a pointer to the filename
+ */
+void FormatSingle(const DX7SingleSysex *sysex, const char *filename)
+{
+    const VoiceUnpacked *voice = &sysex->voice;
+    if (!voiceDataList)
+    {
+        // voice name only
+        if (!softError)
+            PrintFilename(filename);
+        Name2Ascii(name, voice->name);
+        fprintf(out, "File is a Single Voice Dump: \"%10s\"", name);
+        const char *label = FactoryLabel(voice);
+        if (label)
+            fprintf(out, " [%s]", label);
+        if (showHex)
+        {
+            for (unsigned i = 0; i < 10; i++)
+                fprintf(out, " %2.2X", voice->name[i]);
+        }
+        PutLine("\n");
+        return;
+    }
+
+    // -p selects the voice of the file with 1
+    if (patch > 0)
+        return;
+    if (softError)
+        VoiceSeparator();
+    if (tabularListing)
+        singleVoiceTableRenderer(filename, 0, voice);
+    else
+        VoiceList(filename, 0, voice);
+    if (patch == -1)
+        VoiceSeparator();
+}
+
+// ***************************************************************************
+
+/*! Find and print duplicates within a voice bank dump. Known factory voices
+ *  (e.g. several INIT VOICEs) don't count as duplicates.
+ *
+ *  \param sysex a pointer to a DX7Sysex data block
+ */
+void FindDupes(const DX7Sysex *sysex)
+{
+    bool dupeFound = false;
+
+    // For each patch
+    for (int i = 0; i < 31; ++i)
+    {
+        if (FactoryLabel(&sysex->voices[i]))
+            continue;
+
+        // For each patch after that patch
+        for (int j = i + 1; j < 32; ++j)
+        {
+            // memcmp the patches
+            // Subtract 10 to remove the name from the diff.
+            int rc = memcmp(&(sysex->voices[i]), &(sysex->voices[j]), 
+                            sizeof(VoicePacked) - 10);
+            if (rc == 0)
+            {
+                fprintf(out, "Found duplicate: %d = %d\n", i+1, j+1);
+                dupeFound = true;
+            }
+        }
+    }
+
+    if (dupeFound)
+    {
+        PutLine("");
+    }
+}
+
+// ***************************************************************************
+
+/*! Reset the per-file state before the next file is processed.
+ */
+void ResetFileState()
+{
+    msgBuffer[0] = 0;
+    softError = false;
+    sysexFile = true;
+    fixNeeded = false;
+    singleVoiceFile = false;
+}
+
+// ***************************************************************************
+
+/*! Read a sysex file into the file data buffer.
+ *
+ *  Only files with the size of a bank, a headerless bank, or a single voice
+ *  dump are read. A headerless dump is stored behind an empty sysex header.
+ *
+ *  \param filename a pointer to the filename
+ *  \param quiet don't print an error message if the file can't be opened
+ *  \return 0 if the file could be opened
+ */
+int LoadFile(const char *filename, bool quiet)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        loadError = errno;
+        fsize = -1;
+        if (!quiet)
+            fprintf(out, "ERROR: Can't open the file: %s\n", strerror(loadError));
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    fsize = ftell(file);
+    rewind(file);
+
+    memset(buffer, 0, sizeof(buffer));
+    fileReadOk = true;
+    if (fsize == sysexSize || fsize == singleSysexSize)
+        fileReadOk = (fread(buffer, fsize, 1, file) == 1);
+    else if (fsize == rawDataSize)
+        fileReadOk = (fread(buffer + 6, rawDataSize, 1, file) == 1);
+    fclose(file);
+
+    return 0;
+}
+
+// ***************************************************************************
+
+/*! Check the voice dump in the file data buffer without printing anything.
+ *
+ *  \param type set to the file type: bank, headerless, single, or unknown
+ *  \param message buffer (100 characters) for the warning or error message
+ *  \return status of the file: ok, warning, or error
+ */
+const char *CheckData(const char **type, char *message)
+{
+    const char *status = "ok";
+    *type = "bank";
+    message[0] = 0;
+
+    if (fsize < 0)
+    {
+        *type = "unknown";
+        status = "error";
+        sprintf(message, "Can't open the file: %.70s", strerror(loadError));
+    }
+    else if (fsize != sysexSize && fsize != rawDataSize && fsize != singleSysexSize)
+    {
+        *type = "unknown";
+        status = "error";
+        sprintf(message, "File too %s (%d Bytes)", fsize > (int)sysexSize ? "big" : "small", fsize);
+    }
+    else if (!fileReadOk)
+    {
+        status = "error";
+        strcpy(message, "File read error");
+    }
+    else if (fsize == rawDataSize)
+    {
+        *type = "headerless";
+        status = "warning";
+        sprintf(message, "WARNING: file seems to be a headerless dump (%d Bytes)", fsize);
+        sysexFile = false;
+        fixNeeded = true;
+    }
+    else if (fsize == singleSysexSize)
+    {
+        *type = "single";
+        singleVoiceFile = true;
+        if (VerifySingle((const DX7SingleSysex *)buffer) != 0)
+        {
+            status = "error";
+            strcpy(message, "Invalid single voice sysex header");
+        }
+        else if (msgBuffer[0] != 0)
+        {
+            status = "warning";
+            strcpy(message, msgBuffer);
+        }
+    }
+    else
+    {
+        const int rc = Verify((const DX7Sysex *)buffer);
+        if (rc != 0 || msgBuffer[0] != 0)
+        {
+            status = (rc != 0) ? "error" : "warning";
+            strcpy(message, msgBuffer);
+        }
+    }
+
+    // remove trailing newline of verify messages
+    const size_t len = strlen(message);
+    if (len > 0 && message[len - 1] == '\n')
+        message[len - 1] = 0;
+
+    return status;
+}
+
+// ***************************************************************************
+
+// Output templates (--template)
+
+//! Kinds of items of a compiled output template.
+enum TemplateItemKind {
+    TEMPLATE_TEXT,
+    TEMPLATE_PATH,
+    TEMPLATE_SLOT,
+    TEMPLATE_NAME,
+    TEMPLATE_RAW,
+    TEMPLATE_DECODED
+};
+
+//! Decoded values available in output templates.
+enum TemplateDecoded {
+    DECODED_ALGORITHM,
+    DECODED_OSCKEYSYNC,
+    DECODED_LFOSYNC,
+    DECODED_LFOWAVE,
+    DECODED_TRANSPOSE,
+    DECODED_TRANSPOSENOTE,
+    DECODED_MODE,
+    DECODED_FREQUENCY,
+    DECODED_DETUNE,
+    DECODED_BREAKPOINT,
+    DECODED_LEFTCURVE,
+    DECODED_RIGHTCURVE
+};
+
+//! Name of a decoded template field.
+struct DecodedField
+{
+    const char *name;
+    TemplateDecoded decoded;
+    bool perOperator;
+};
+
+//! decoded template fields (voice fields and "opN." fields)
+const DecodedField decodedFields[] = {
+    { "algorithmNumber", DECODED_ALGORITHM, false },
+    { "oscKeySyncName", DECODED_OSCKEYSYNC, false },
+    { "lfoSyncName", DECODED_LFOSYNC, false },
+    { "lfoWaveName", DECODED_LFOWAVE, false },
+    { "transposeValue", DECODED_TRANSPOSE, false },
+    { "transposeNote", DECODED_TRANSPOSENOTE, false },
+    { "mode", DECODED_MODE, true },
+    { "frequency", DECODED_FREQUENCY, true },
+    { "detuneValue", DECODED_DETUNE, true },
+    { "breakpoint", DECODED_BREAKPOINT, true },
+    { "leftCurve", DECODED_LEFTCURVE, true },
+    { "rightCurve", DECODED_RIGHTCURVE, true },
+};
+
+//! One item of a compiled output template.
+struct TemplateItem
+{
+    TemplateItemKind kind;
+    TemplateDecoded decoded;
+    unsigned offset;        // raw: offset in VoiceUnpacked, decoded: operator offset
+    std::string text;
+};
+
+//! the compiled output template of this thread
+thread_local std::vector<TemplateItem> compiledTemplate;
+
+//! reusable buffer of the template output
+thread_local std::string templateBuffer;
+
+/*! Compile an output template into a list of items.
+ *
+ *  Fields are written in braces: {path}, {slot}, {name}, the raw parameters
+ *  named like in the sysex data ({feedback}, {op1.outputLevel}), and decoded
+ *  values ({algorithmNumber}, {op1.frequency}, ...). "\t", "\n", and "\\"
+ *  are replaced by tab, newline, and backslash; "{{" and "}}" are literal
+ *  braces. A newline is appended to each line.
+ *
+ *  \param text a pointer to the template text
+ *  \param items vector the compiled items are written to
+ *  \param error string the error message is written to
+ *  \return 0 if ok
+ */
+int CompileTemplate(const char *text, std::vector<TemplateItem> &items, std::string &error)
+{
+    items.clear();
+    TemplateItem literal;
+    literal.kind = TEMPLATE_TEXT;
+
+    for (const char *p = text; *p != 0; p++)
+    {
+        if (*p == '\\' && p[1] != 0)
+        {
+            p++;
+            literal.text += (*p == 't') ? '\t' : (*p == 'n') ? '\n' : *p;
+            continue;
+        }
+        if ((*p == '{' && p[1] == '{') || (*p == '}' && p[1] == '}'))
+        {
+            literal.text += *p++;
+            continue;
+        }
+        if (*p != '{')
+        {
+            literal.text += *p;
+            continue;
+        }
+
+        const char *end = strchr(p, '}');
+        if (end == NULL)
+        {
+            error = "missing '}' in template";
+            return 1;
+        }
+        const std::string field(p + 1, end - p - 1);
+        p = end;
+
+        if (!literal.text.empty())
+        {
+            items.push_back(literal);
+            literal.text.clear();
+        }
+
+        TemplateItem item;
+        item.kind = TEMPLATE_RAW;
+        item.offset = 0;
+        if (field == "path")
+            item.kind = TEMPLATE_PATH;
+        else if (field == "slot")
+            item.kind = TEMPLATE_SLOT;
+        else if (field == "name")
+            item.kind = TEMPLATE_NAME;
+        else
+        {
+            const int offset = FindParamField(field.data(), field.size());
+            if (offset >= 0)
+            {
+                item.offset = offset;
+            }
+            else
+            {
+                // decoded value, optionally of an operator
+                std::string decodedName = field;
+                bool perOperator = false;
+                if (field.size() > 4 && field.compare(0, 2, "op") == 0 &&
+                    field[2] >= '1' && field[2] <= '6' && field[3] == '.')
+                {
+                    // operators are stored in backward order
+                    item.offset = (6 - (field[2] - '0')) * sizeof(OperatorUnpacked);
+                    decodedName = field.substr(4);
+                    perOperator = true;
+                }
+                unsigned i;
+                const unsigned count = sizeof(decodedFields) / sizeof(decodedFields[0]);
+                for (i = 0; i < count; i++)
+                {
+                    if (decodedName == decodedFields[i].name && decodedFields[i].perOperator == perOperator)
+                        break;
+                }
+                if (i == count)
+                {
+                    error = "unknown template field: {" + field + "}";
+                    return 1;
+                }
+                item.kind = TEMPLATE_DECODED;
+                item.decoded = decodedFields[i].decoded;
+            }
+        }
+        items.push_back(item);
+    }
+
+    literal.text += '\n';
+    items.push_back(literal);
+    return 0;
+}
+
+/*! Append an unsigned number in decimal.
+ *
+ *  \param text string the number is appended to
+ *  \param value number
+ */
+void AppendNumber(std::string &text, unsigned value)
+{
+    char digits[10];
+    unsigned n = 0;
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n)
+        text += digits[--n];
+}
+
+/*! Append the template line of one voice.
+ *
+ *  \param line string the line is appended to
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (1..32)
+ *  \param voice a pointer to the unpacked voice data
+ */
+void TemplateVoice(std::string &line, const char *filename, unsigned voiceNum,
+                   const VoiceUnpacked *voice)
+{
+    const unsigned char *data = (const unsigned char *)voice;
+    char text[41];
+
+    for (unsigned i = 0; i < compiledTemplate.size(); i++)
+    {
+        const TemplateItem &item = compiledTemplate[i];
+        switch (item.kind)
+        {
+        case TEMPLATE_TEXT:
+            line += item.text;
+            break;
+        case TEMPLATE_PATH:
+            line += filename;
+            break;
+        case TEMPLATE_SLOT:
+            AppendNumber(line, voiceNum);
+            break;
+        case TEMPLATE_NAME:
+            Name2Ascii(text, voice->name);
+            line += text;
+            break;
+        case TEMPLATE_RAW:
+            AppendNumber(line, data[item.offset]);
+            break;
+        case TEMPLATE_DECODED:
+        {
+            const OperatorUnpacked &op = *(const OperatorUnpacked *)(data + item.offset);
+            switch (item.decoded)
+            {
+            case DECODED_ALGORITHM:
+                AppendNumber(line, voice->algorithm + 1);
+                break;
+            case DECODED_OSCKEYSYNC:
+                line += OnOff(voice->oscKeySync);
+                break;
+            case DECODED_LFOSYNC:
+                line += OnOff(voice->lfoSync);
+                break;
+            case DECODED_LFOWAVE:
+                line += LFOWave(voice->lfoWave);
+                break;
+            case DECODED_TRANSPOSE:
+                line.append(text, sprintf(text, "%d", voice->transpose - 24));
+                break;
+            case DECODED_TRANSPOSENOTE:
+                line += Transpose(voice->transpose);
+                break;
+            case DECODED_MODE:
+                line += Mode(op.oscillatorMode);
+                break;
+            case DECODED_FREQUENCY:
+                line += Frequency(op);
+                break;
+            case DECODED_DETUNE:
+                line.append(text, sprintf(text, "%+d", op.detune - 7));
+                break;
+            case DECODED_BREAKPOINT:
+                line += Breakpoint(op.levelScalingBreakPoint);
+                break;
+            case DECODED_LEFTCURVE:
+                line += Curve(op.scaleLeftCurve);
+                break;
+            case DECODED_RIGHTCURVE:
+                line += Curve(op.scaleRightCurve);
+                break;
+            }
+            break;
+        }
+        }
+    }
+}
+
+/*! Process the voice dump in the file data buffer and print one template
+ *  line per voice. Warnings and errors are reported on stderr.
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if ok
+ */
+int processDataTemplate(const char *filename)
+{
+    const char *type;
+    char message[100];
+    const char *status = CheckData(&type, message);
+    if (message[0] != 0)
+        fprintf(stderr, "%s: %s\n", filename, message);
+    if (strcmp(status, "error") == 0)
+        return 1;
+
+    templateBuffer.clear();
+    if (singleVoiceFile)
+    {
+        TemplateVoice(templateBuffer, filename, 1, &((const DX7SingleSysex *)buffer)->voice);
+    }
+    else
+    {
+        const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        {
+            if (patch != -1 && patch != (int)voiceNum)
+                continue;
+            VoiceUnpacked uVoice;
+            UnpackVoice(&uVoice, &sysex->voices[voiceNum]);
+            TemplateVoice(templateBuffer, filename, voiceNum + 1, &uVoice);
+        }
+    }
+    fwrite(templateBuffer.data(), 1, templateBuffer.size(), out);
+    return 0;
+}
+
+// ***************************************************************************
+
+// Parameter validation (--validate)
+
+//! Maximum values of all bytes of VoiceUnpacked, padded to 16 bytes.
+struct LimitTable
+{
+    unsigned char max[160];
+};
+
+/*! Build the table of maximum values from the parameter field tables.
+ *
+ *  \return table of maximum values
+ */
+constexpr LimitTable MakeLimitTable()
+{
+    LimitTable table = {};
+    for (unsigned op = 0; op < 6; op++)
+    {
+        for (unsigned i = 0; i < operatorFieldCount; i++)
+        {
+            table.max[op * sizeof(OperatorUnpacked) + operatorFields[i].offset] = operatorFields[i].max;
+        }
+    }
+    for (unsigned i = 0; i < voiceFieldCount; i++)
+    {
+        table.max[voiceFields[i].offset] = voiceFields[i].max;
+    }
+    for (unsigned i = 0; i < 10; i++)
+    {
+        table.max[offsetof(VoiceUnpacked, name) + i] = 127;
+    }
+    // the padding bytes are always 0
+    return table;
+}
+
+constexpr LimitTable limitTable = MakeLimitTable();
+
+//! number of files, voices, voices with errors, and out-of-range values of a validation run
+thread_local unsigned validatedFiles, validatedVoices, invalidVoices, outOfRangeValues;
+
+/*! Find the bytes of a voice above their maximum value.
+ *
+ *  \param voice a pointer to the unpacked voice data
+ *  \param mask array of 10 masks, bit n of mask[i] is set if byte i * 16 + n is out of range
+ *  \return true if any byte is out of range
+ */
+bool FindOutOfRange(const VoiceUnpacked *voice, unsigned mask[10])
+{
+    unsigned char bytes[160] = {};
+    memcpy(bytes, voice, sizeof(VoiceUnpacked));
+
+    unsigned any = 0;
+    for (unsigned i = 0; i < 10; i++)
+    {
+#ifdef __SSE2__
+        // value - max with unsigned saturation is 0 if value <= max
+        const __m128i value = _mm_loadu_si128((const __m128i *)(bytes + i * 16));
+        const __m128i max = _mm_loadu_si128((const __m128i *)(limitTable.max + i * 16));
+        const __m128i ok = _mm_cmpeq_epi8(_mm_subs_epu8(value, max), _mm_setzero_si128());
+        mask[i] = ~_mm_movemask_epi8(ok) & 0xFFFF;
+#else
+        mask[i] = 0;
+        for (unsigned n = 0; n < 16; n++)
+        {
+            if (bytes[i * 16 + n] > limitTable.max[i * 16 + n])
+                mask[i] |= 1u << n;
+        }
+#endif
+        any |= mask[i];
+    }
+    return any != 0;
+}
+
+/*! Get the name of the parameter at an offset in VoiceUnpacked.
+ *
+ *  \param text buffer (40 characters) the name is written to
+ *  \param offset offset in VoiceUnpacked
+ */
+void ParamFieldName(char *text, unsigned offset)
+{
+    if (offset < 6 * sizeof(OperatorUnpacked))
+    {
+        // operators are stored in backward order
+        const unsigned op = offset / sizeof(OperatorUnpacked);
+        const unsigned fieldOffset = offset % sizeof(OperatorUnpacked);
+        for (unsigned i = 0; i < operatorFieldCount; i++)
+        {
+            if (operatorFields[i].offset == fieldOffset)
+            {
+                sprintf(text, "op%u.%s", 6 - op, operatorFields[i].name);
+                return;
+            }
+        }
+    }
+    for (unsigned i = 0; i < voiceFieldCount; i++)
+    {
+        if (voiceFields[i].offset == offset)
+        {
+            strcpy(text, voiceFields[i].name);
+            return;
+        }
+    }
+    sprintf(text, "name[%u]", offset - (unsigned)offsetof(VoiceUnpacked, name));
+}
+
+/*! Check all parameters of a voice and print every out-of-range value.
+ *
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (1..32)
+ *  \param voice a pointer to the unpacked voice data
+ *  \return number of out-of-range values
+ */
+unsigned ValidateVoice(const char *filename, unsigned voiceNum, const VoiceUnpacked *voice)
+{
+    validatedVoices++;
+    unsigned mask[10];
+    if (!FindOutOfRange(voice, mask))
+        return 0;
+
+    const unsigned char *data = (const unsigned char *)voice;
+    char voiceName[41];
+    char field[40];
+    unsigned count = 0;
+    Name2Ascii(voiceName, voice->name);
+    for (unsigned i = 0; i < 10; i++)
+    {
+        for (unsigned n = 0; n < 16; n++)
+        {
+            if ((mask[i] & (1u << n)) == 0)
+                continue;
+            const unsigned offset = i * 16 + n;
+            ParamFieldName(field, offset);
+            fprintf(out, "%s: voice %u \"%s\": %s = %u (max %u)\n", filename, voiceNum,
+                    voiceName, field, data[offset], limitTable.max[offset]);
+            count++;
+        }
+    }
+    invalidVoices++;
+    outOfRangeValues += count;
+    return count;
+}
+
+/*! Check the parameters of all voices in the file data buffer. Every
+ *  out-of-range value is printed with file, voice, parameter and value.
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if all values are in range
+ */
+int processDataValidate(const char *filename)
+{
+    const char *type;
+    char message[100];
+    const char *status = CheckData(&type, message);
+    if (message[0] != 0)
+        fprintf(out, "%s: %s\n", filename, message);
+    if (strcmp(status, "error") == 0)
+        return 1;
+
+    validatedFiles++;
+    unsigned count = 0;
+    if (singleVoiceFile)
+    {
+        count += ValidateVoice(filename, 1, &((const DX7SingleSysex *)buffer)->voice);
+    }
+    else
+    {
+        const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        {
+            if (patch != -1 && patch != (int)voiceNum)
+                continue;
+            VoiceUnpacked uVoice;
+            UnpackVoice(&uVoice, &sysex->voices[voiceNum]);
+            count += ValidateVoice(filename, voiceNum + 1, &uVoice);
+        }
+    }
+    return count ? 1 : 0;
+}
+
+// ***************************************************************************
+
+//! number of files written in the current JSON output
+thread_local unsigned jsonFileCount = 0;
+
+//! reusable buffer of the JSON output (one voice at a time)
+thread_local std::string jsonBuffer;
+
+//! index of the processed file on the command line (source id of --format bin)
+thread_local unsigned fileIndex = 0;
+
+//! output buffer of the binary format (records are written in large blocks)
+thread_local std::vector<unsigned char> binBuffer;
+
+//! number of bytes in the output buffer of the binary format
+thread_local size_t binBufferUsed = 0;
+
+/*! Write the output buffer of the binary format to the output stream.
+ *  Large blocks bypass the stdio buffer: they are written with write(2) to
+ *  the file descriptor of the stream. Streams without one (the captured
+ *  output of --server) are written with fwrite().
+ *
+ *  \return 0 if ok
+ */
+int FlushBin()
+{
+    const size_t used = binBufferUsed;
+    binBufferUsed = 0;
+    if (used == 0)
+        return 0;
+    const int fd = fileno(out);
+    bool ok;
+    if (fd < 0)
+        ok = fwrite(binBuffer.data(), used, 1, out) == 1;
+    else
+    {
+        ok = fflush(out) == 0;
+        for (size_t done = 0; ok && done < used; )
+        {
+            const ssize_t len = write(fd, binBuffer.data() + done, used - done);
+            if (len < 0 && errno == EINTR)
+                continue;
+            ok = len > 0;
+            if (ok)
+                done += len;
+        }
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Error writing binary output: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*! Append a voice record to the output buffer of the binary format.
+ *
+ *  \param slot voice number in the bank (0..31)
+ *  \param uVoice a pointer to the unpacked voice data
+ */
+void BinVoice(unsigned slot, const VoiceUnpacked *uVoice)
+{
+    if (binBufferUsed + sizeof(BinRecord) > binBuffer.size())
+        FlushBin();
+    BinRecord *record = (BinRecord *)(binBuffer.data() + binBufferUsed);
+    record->sourceId = fileIndex;
+    record->slot = slot;
+    memcpy(&record->voice, uVoice, sizeof(VoiceUnpacked));
+    binBufferUsed += sizeof(BinRecord);
+}
+
+/*! Start the output of a run (JSON: opening bracket of the file array,
+ *  binary format: stream header).
+ */
+void BeginOutput()
+{
+    jsonFileCount = 0;
+    validatedFiles = validatedVoices = invalidVoices = outOfRangeValues = 0;
+    if (outputFormat == FORMAT_TEMPLATE)
+    {
+        std::string error;
+        CompileTemplate(templateText, compiledTemplate, error);
+    }
+    if (outputFormat == FORMAT_JSON)
+        fputs("[", out);
+    if (outputFormat == FORMAT_BIN)
+    {
+        binBuffer.resize(4096 * sizeof(BinRecord));
+        const BinHeader header = { { 'D', 'X', '7', 'V' }, 1, sizeof(BinRecord) };
+        memcpy(binBuffer.data(), &header, sizeof(header));
+        binBufferUsed = sizeof(header);
+    }
+}
+
+/*! Finish the output of a run (JSON: closing bracket of the file array,
+ *  binary format: write remaining records).
+ */
+void EndOutput()
+{
+    if (outputFormat == FORMAT_JSON)
+        fputs("]\n", out);
+    if (outputFormat == FORMAT_BIN)
+        FlushBin();
+    if (outputFormat == FORMAT_VALIDATE)
+        fprintf(out, "%u files, %u voices checked: %u out-of-range values in %u voices\n",
+                validatedFiles, validatedVoices, outOfRangeValues, invalidVoices);
+}
+
+/*! Process the voice dump in the file data buffer and append its voices
+ *  as binary records. Warnings and errors are reported on stderr.
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if ok
+ */
+int processDataBin(const char *filename)
+{
+    const char *type;
+    char message[100];
+    const char *status = CheckData(&type, message);
+    if (message[0] != 0)
+        fprintf(stderr, "%s: %s\n", filename, message);
+    if (strcmp(status, "error") == 0)
+        return 1;
+
+    if (singleVoiceFile)
+    {
+        BinVoice(0, &((const DX7SingleSysex *)buffer)->voice);
+        return 0;
+    }
+
+    const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+    for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+    {
+        if (patch != -1 && patch != (int)voiceNum)
+            continue;
+        VoiceUnpacked uVoice;
+        UnpackVoice(&uVoice, &sysex->voices[voiceNum]);
+        BinVoice(voiceNum, &uVoice);
+    }
+    return 0;
+}
+
+/*! Write and clear the JSON buffer.
+ */
+void FlushJson()
+{
+    fwrite(jsonBuffer.data(), 1, jsonBuffer.size(), out);
+    jsonBuffer.clear();
+}
+
+/*! Append one voice of a file as JSON object.
+ *
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (1..32)
+ *  \param uVoice a pointer to the unpacked voice data
+ */
+void JsonFileVoice(const char *filename, unsigned voiceNum, const VoiceUnpacked *uVoice)
+{
+    jsonBuffer += '{';
+    if (outputFormat == FORMAT_NDJSON)
+    {
+        // each line has to be self-contained
+        JsonText(jsonBuffer, "path", filename);
+        jsonBuffer += ',';
+    }
+    JsonNumber(jsonBuffer, "voice", voiceNum);
+    jsonBuffer += ',';
+    JsonVoice(jsonBuffer, uVoice);
+    jsonBuffer += '}';
+    if (outputFormat == FORMAT_NDJSON)
+        jsonBuffer += '\n';
+    FlushJson();
+}
+
+/*! Process the voice dump in the file data buffer and write it as JSON or NDJSON.
+ *
+ *  Per file one object with path, type (bank, headerless, single), status
+ *  (ok, warning, error), message, and sysex header is written. In JSON
+ *  format the voices are an array of this object, in NDJSON format each
+ *  voice is written as a separate line. Output is streamed voice by voice.
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if ok
+ */
+int processDataJson(const char *filename)
+{
+    const char *type;
+    char message[100];
+    const char *status = CheckData(&type, message);
+    const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+    const DX7SingleSysex *single = (const DX7SingleSysex *)buffer;
+
+    const bool failed = (strcmp(status, "error") == 0);
+    if (errorsOnly && strcmp(status, "ok") == 0)
+        return 0;
+
+    // file object
+    if (outputFormat == FORMAT_JSON && jsonFileCount > 0)
+        jsonBuffer += ",\n";
+    jsonFileCount++;
+    jsonBuffer += '{';
+    JsonText(jsonBuffer, "path", filename);
+    jsonBuffer += ',';
+    JsonText(jsonBuffer, "type", type);
+    jsonBuffer += ',';
+    JsonText(jsonBuffer, "status", status);
+    jsonBuffer += ',';
+    JsonText(jsonBuffer, "message", message);
+    if (!failed && (fsize == sysexSize || fsize == singleSysexSize))
+    {
+        // both sysex formats share the same header layout
+        jsonBuffer += ",\"header\":{";
+        JsonNumber(jsonBuffer, "sysexBeginF0", sysex->sysexBeginF0);
+        jsonBuffer += ',';
+        JsonNumber(jsonBuffer, "yamaha43", sysex->yamaha43);
+        jsonBuffer += ',';
+        JsonNumber(jsonBuffer, "subStatusAndChannel", sysex->subStatusAndChannel);
+        jsonBuffer += ',';
+        JsonNumber(jsonBuffer, "format", sysex->format9);
+        jsonBuffer += ',';
+        JsonNumber(jsonBuffer, "sizeMSB", sysex->sizeMSB);
+        jsonBuffer += ',';
+        JsonNumber(jsonBuffer, "sizeLSB", sysex->sizeLSB);
+        jsonBuffer += ',';
+        if (fsize == sysexSize)
+        {
+            JsonNumber(jsonBuffer, "checksum", sysex->checksum);
+            jsonBuffer += ',';
+            JsonNumber(jsonBuffer, "checksumCalculated", Checksum(sysex));
+            jsonBuffer += ',';
+            JsonNumber(jsonBuffer, "sysexEndF7", sysex->sysexEndF7);
+        }
+        else
+        {
+            JsonNumber(jsonBuffer, "checksum", single->checksum);
+            jsonBuffer += ',';
+            JsonNumber(jsonBuffer, "checksumCalculated",
+                       ChecksumSingle(&single->voice, sizeof(VoiceUnpacked)));
+            jsonBuffer += ',';
+            JsonNumber(jsonBuffer, "sysexEndF7", single->sysexEndF7);
+        }
+        jsonBuffer += '}';
+    }
+
+    if (failed || errorsOnly)
+    {
+        jsonBuffer += (outputFormat == FORMAT_JSON) ? "}" : "}\n";
+        FlushJson();
+        return failed ? 1 : 0;
+    }
+
+    if (outputFormat == FORMAT_JSON)
+        jsonBuffer += ",\"voices\":[";
+    else
+        jsonBuffer += "}\n";
+    FlushJson();
+
+    unsigned written = 0;
+    if (singleVoiceFile)
+    {
+        JsonFileVoice(filename, 1, &single->voice);
+    }
+    else
+    {
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        {
+            if (patch != -1 && patch != (int)voiceNum)
+                continue;
+            VoiceUnpacked uVoice;
+            UnpackVoice(&uVoice, &sysex->voices[voiceNum]);
+            if (outputFormat == FORMAT_JSON && written++ > 0)
+                jsonBuffer += ',';
+            JsonFileVoice(filename, voiceNum + 1, &uVoice);
+        }
+    }
+
+    if (outputFormat == FORMAT_JSON)
+        fputs("]}", out);
+    return 0;
+}
+
+// ***************************************************************************
+
+/*! Process the voice dump in the file data buffer (see LoadFile()).
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if ok
+ */
+int processData (const char* filename)
+{
+    if (outputFormat == FORMAT_BIN)
+        return processDataBin(filename);
+    if (outputFormat == FORMAT_TEMPLATE)
+        return processDataTemplate(filename);
+    if (outputFormat == FORMAT_VALIDATE)
+        return processDataValidate(filename);
+    if (outputFormat != FORMAT_TEXT)
+        return processDataJson(filename);
+
+    if (fsize == sysexSize)
+    {
+        if (!fileReadOk)
+        {
+            PrintFilename(filename);
+            PutLine("File read error\n");
+            return 1;
+        }
+    }
+    else if (fsize == rawDataSize)
+    {
+        // check if file could be a raw file
+        PrintFilename(filename);
+        if (!fileReadOk)
+        {
+            PutLine("File read error");
+            fprintf(out, "File too small (%d Bytes)\n\n", fsize);
+            return 1;
+        }
+        fprintf(out, "WARNING: file seems to be a headerless dump (%d Bytes)\n", fsize);
+        softError = true;
+        sysexFile = false;
+        fixNeeded = true;
+    }
+    else if (fsize == singleSysexSize)
+    {
+        if (!fileReadOk)
+        {
+            PrintFilename(filename);
+            PutLine("File read error\n");
+            return 1;
+        }
+        singleVoiceFile = true;
+    }
+    else if (fsize > sysexSize)
+    {
+        PrintFilename(filename);
+        fprintf(out, "File too big (%d Bytes)\n\n", fsize);
+        return 1;
+    }
+    else
+    {
+        PrintFilename(filename);
+        fprintf(out, "File too small (%d Bytes)\n\n", fsize);
+        return 1;
+    }
+ 
+    if (singleVoiceFile)
+    {
+        const DX7SingleSysex *sysex = (const DX7SingleSysex *)buffer;
+        if (VerifySingle(sysex) != 0)
+        {
+            // unrecoverable file error
+            PrintFilename(filename);
+            fprintf(out, "File too small (%d Bytes)\n\n", fsize);
+            return 1;
+        }
+
+        if (msgBuffer[0] != 0)
+        {
+            // checksum error: the voice data is shown anyway
+            softError = true;
+            PrintFilename(filename);
+            fprintf(out, "%s", msgBuffer);
+        }
+
+        if (!errorsOnly)
+            FormatSingle(sysex, filename);
+        else if (softError)
+            PutLine("");
+        return 0;
+    }
+
+    // voice bank sysex
+    DX7Sysex *sysex = (DX7Sysex *)buffer;
+
+    // Make sure this is a valid DX7 sysex dump.
+    // there is no validation for headerless dumps!
+    if (sysexFile && Verify(sysex) != 0)
+    {
+        // unrecoverable file error
+        PrintFilename(filename);
+        PutLine(msgBuffer);
+        return 1;
+    }
+
+    if (msgBuffer[0] != 0)
+    {
+        // we have a recoverable file error
+        softError = true;
+        PrintFilename(filename);
+        fprintf(out, "%s", msgBuffer);
+    }
+
+    // Format and print the bank
+    if (!errorsOnly)
+    {
+        Format(sysex, filename);
+    }
+    else if (softError)
+    {
+        PutLine("");
+    }
+
+    // Fix file if neccessary
+    if (fixFiles && fixNeeded)
+    {
+        if (askToFix)
+        {
+            char choice[2];
+            fprintf(out, "Fix this file? [Y/n] ");
+            fgets (choice, sizeof(choice), stdin);
+            if (choice[0] == 'N' || choice[0] == 'n')
+                return 0;
+        }
+
+        //printf("FIXING\n");
+        if (undoJournal && sysexFile)
+            FixFileInPlace(sysex, filename);
+        else
+            FixFile(sysex, filename);
+    }
+
+    if (findDupes)
+        FindDupes(sysex);
+
+    return 0;
+};
+
+// ***************************************************************************
+
+/*! Process a complete voice dump sysex file.
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if ok
+ */
+int processFile (const char* filename)
+{
+    ResetFileState();
+
+    // JSON and binary formats report open errors in their own format
+    const bool textOutput = (outputFormat == FORMAT_TEXT);
+    if (LoadFile(filename, !textOutput) && textOutput)
+        return 1;
+
+    return processData(filename);
+}
+
+
+
+// ***************************************************************************
+
+/*! Check if a filename has the extension ".syx" (case insensitive).
+ *
+ *  \param filename a pointer to the filename
+ *  \return true for sysex filenames
+ */
+bool IsSysexFilename(const char *filename)
+{
+    const size_t len = strlen(filename);
+    return len > 4 && strcasecmp(filename + len - 4, ".syx") == 0;
+}
+
+// ***************************************************************************
+
+/*! Collect all sysex files of a directory tree.
+ *
+ *  \param dir path of the directory
+ *  \param files vector the sorted filenames are appended to
+ *  \param dirs optional vector the visited directories are appended to
+ */
+void ScanDirectory(const std::string &dir, std::vector<std::string> &files,
+                   std::vector<std::string> *dirs = NULL)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL)
+        return;
+    if (dirs)
+        dirs->push_back(dir);
+
+    std::vector<std::string> entries;
+    std::vector<std::string> subdirs;
+    while (struct dirent *e = readdir(d))
+    {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        std::string path = dir + "/" + e->d_name;
+        unsigned char type = e->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat(path.c_str(), &st) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+        if (type == DT_DIR)
+            subdirs.push_back(path);
+        else if (type == DT_REG && IsSysexFilename(e->d_name))
+            entries.push_back(path);
+    }
+    closedir(d);
+
+    // same order as "find | sort" in dx7dumpall
+    std::sort(entries.begin(), entries.end());
+    std::sort(subdirs.begin(), subdirs.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+    for (unsigned i = 0; i < subdirs.size(); i++)
+        ScanDirectory(subdirs[i], files, dirs);
+}
+
+// ***************************************************************************
+
+//! catalog lines of all known files (key = filename)
+std::map<std::string, std::string> catalog;
+
+/*! Append the catalog line of one voice.
+ *
+ *  Format: filename TAB voice-# TAB name (7-bit ASCII) TAB voice data (HEX)
+ *
+ *  \param lines string the catalog line is appended to
+ *  \param filename a pointer to the filename
+ *  \param voiceNum voice number (1..32)
+ *  \param uVoice a pointer to the unpacked voice data
+ */
+void CatalogLine(std::string &lines, const char *filename, unsigned voiceNum,
+                 const VoiceUnpacked *uVoice)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char line[16 + 10 + 2 * sizeof(VoiceUnpacked)];
+    int n = sprintf(line, "\t%u\t", voiceNum);
+    for (unsigned i = 0; i < 10; i++)
+        line[n++] = lcdTableAscii[uVoice->name[i] & 0x7F];
+    line[n++] = '\t';
+    const unsigned char *p = (const unsigned char *)uVoice;
+    for (unsigned i = 0; i < sizeof(VoiceUnpacked); i++)
+    {
+        line[n++] = hexDigits[p[i] >> 4];
+        line[n++] = hexDigits[p[i] & 0x0F];
+    }
+    line[n++] = '\n';
+
+    lines += filename;
+    lines.append(line, n);
+}
+
+// ***************************************************************************
+
+/*! Check if a file can be listed in the catalog: tab and newline separate
+ *  the fields and lines of the catalog, they can't be part of the filename.
+ *
+ *  \param filename a pointer to the filename
+ *  \return true if the filename has no tab or newline
+ */
+bool CatalogFilename(const char *filename)
+{
+    return strpbrk(filename, "\t\n") == NULL;
+}
+
+/*! Create the catalog lines of the file just read by processFile(). A file
+ *  whose name can't be listed in the catalog gets no lines.
+ *
+ *  \param filename a pointer to the filename
+ *  \param lines string the catalog lines are written to
+ */
+void CatalogFromBuffer(const char *filename, std::string &lines)
+{
+    lines.clear();
+    if (!CatalogFilename(filename))
+        return;
+    if (singleVoiceFile)
+    {
+        const DX7SingleSysex *sysex = (const DX7SingleSysex *)buffer;
+        CatalogLine(lines, filename, 1, &sysex->voice);
+    }
+    else if (fsize == sysexSize || fsize == rawDataSize)
+    {
+        const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        {
+            VoiceUnpacked uVoice;
+            UnpackVoice(&uVoice, &sysex->voices[voiceNum]);
+            CatalogLine(lines, filename, voiceNum + 1, &uVoice);
+        }
+    }
+}
+
+// ***************************************************************************
+
+/*! Load an existing catalog file.
+ *
+ *  \param catalogName a pointer to the catalog filename
+ *  \return true if the catalog could be loaded
+ */
+bool LoadCatalog(const char *catalogName)
+{
+    FILE *file = fopen(catalogName, "r");
+    if (file == NULL)
+        return false;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, file)) > 0)
+    {
+        const char *tab = strchr(line, '\t');
+        if (tab == NULL)
+            continue;
+        catalog[std::string(line, tab - line)].append(line, len);
+    }
+    free(line);
+    fclose(file);
+    return true;
+}
+
+// ***************************************************************************
+
+/*! Write the catalog file (atomically replaces the old catalog).
+ *
+ *  \param catalogName a pointer to the catalog filename
+ *  \return 0 if ok
+ */
+int WriteCatalog(const char *catalogName)
+{
+    std::string tmpName = catalogName;
+    tmpName += ".tmp";
+    FILE *file = fopen(tmpName.c_str(), "w");
+    if (file == NULL)
+    {
+        fprintf(out, "Can't open the file for writing: %s. %s\n", tmpName.c_str(), strerror(errno));
+        return 1;
+    }
+    std::map<std::string, std::string>::const_iterator it;
+    for (it = catalog.begin(); it != catalog.end(); ++it)
+        fwrite(it->second.data(), 1, it->second.size(), file);
+    if (fclose(file) != 0 || rename(tmpName.c_str(), catalogName) != 0)
+    {
+        fprintf(out, "Error writing to file: %s. %s\n", catalogName, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// ***************************************************************************
+
+/*! Process a new, modified, or removed file in watch mode.
+ *
+ *  \param filename a pointer to the filename
+ */
+void UpdateFile(const char *filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        // file was removed or renamed
+        catalog.erase(filename);
+        return;
+    }
+
+    const bool ok = (processFile(filename) == 0);
+    if (catalogFile)
+    {
+        if (ok && CatalogFilename(filename))
+        {
+            CatalogFromBuffer(filename, catalog[filename]);
+        }
+        else
+        {
+            if (ok)
+                fprintf(out, "WARNING: Tab or newline in the filename, not in the catalog: %s\n", filename);
+            catalog.erase(filename);
+        }
+    }
+}
+
+// ***************************************************************************
+
+/*! Add inotify watches for a directory tree.
+ *
+ *  \param fd inotify file descriptor
+ *  \param dir path of the directory
+ *  \param watches map of watch descriptors to directory paths
+ *  \param files vector the sysex files found in the tree are appended to
+ */
+void AddWatches(int fd, const std::string &dir, std::map<int, std::string> &watches,
+                std::vector<std::string> &files)
+{
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_CREATE | IN_DELETE | IN_ONLYDIR;
+    std::vector<std::string> dirs;
+    ScanDirectory(dir, files, &dirs);
+    for (unsigned i = 0; i < dirs.size(); i++)
+    {
+        int wd = inotify_add_watch(fd, dirs[i].c_str(), mask);
+        if (wd < 0)
+            fprintf(out, "WARNING: Can't watch directory %s. %s\n", dirs[i].c_str(), strerror(errno));
+        else
+            watches[wd] = dirs[i];
+    }
+}
+
+// ***************************************************************************
+
+/*! Forget a directory tree that was deleted or moved out of the watched
+ *  tree: remove the watches of its directories, and queue its files in the
+ *  catalog, so UpdateFile() removes them.
+ *
+ *  \param fd inotify file descriptor
+ *  \param dir path of the directory
+ *  \param watches map of watch descriptors to directory paths
+ *  \param pending set of files to be processed
+ */
+void RemoveWatches(int fd, const std::string &dir, std::map<int, std::string> &watches,
+                   std::set<std::string> &pending)
+{
+    const std::string prefix = dir + "/";
+    std::map<int, std::string>::iterator w = watches.begin();
+    while (w != watches.end())
+    {
+        if (w->second == dir || w->second.compare(0, prefix.size(), prefix) == 0)
+        {
+            inotify_rm_watch(fd, w->first);
+            watches.erase(w++);
+        }
+        else
+        {
+            ++w;
+        }
+    }
+
+    std::map<std::string, std::string>::const_iterator it;
+    for (it = catalog.lower_bound(prefix); it != catalog.end() &&
+         it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+        pending.insert(it->first);
+}
+
+// ***************************************************************************
+
+/*! Watch a directory tree and process all new or modified sysex files.
+ *
+ *  Filesystem events are collected until no event arrived for
+ *  watchDebounceMs milliseconds. Only the files named in these events are
+ *  processed and updated in the catalog; the tree is never rescanned
+ *  (except for new directories and after an inotify queue overflow). An
+ *  existing catalog is brought up to date at the start: files that are new,
+ *  removed, or modified after the catalog was written are processed.
+ *
+ *  \param dir path of the directory
+ *  \return 0 if ok
+ */
+int WatchDirectory(const char *dir)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+    {
+        fprintf(out, "ERROR: Can't initialize inotify: %s\n", strerror(errno));
+        return 1;
+    }
+
+    std::map<int, std::string> watches;
+    std::vector<std::string> files;
+    AddWatches(fd, dir, watches, files);
+    if (watches.empty())
+    {
+        close(fd);
+        return 1;
+    }
+
+    std::set<std::string> pending;
+    struct stat catalogStat;
+    if (catalogFile && LoadCatalog(catalogFile) && stat(catalogFile, &catalogStat) == 0)
+    {
+        // changes made while the tree was not watched
+        const std::unordered_set<std::string> tree(files.begin(), files.end());
+        for (unsigned i = 0; i < files.size(); i++)
+        {
+            struct stat st;
+            if (catalog.count(files[i]) == 0 || stat(files[i].c_str(), &st) != 0 ||
+                st.st_mtim.tv_sec > catalogStat.st_mtim.tv_sec ||
+                (st.st_mtim.tv_sec == catalogStat.st_mtim.tv_sec &&
+                 st.st_mtim.tv_nsec >= catalogStat.st_mtim.tv_nsec))
+                pending.insert(files[i]);
+        }
+        std::map<std::string, std::string>::const_iterator it;
+        for (it = catalog.begin(); it != catalog.end(); ++it)
+        {
+            if (tree.count(it->first) == 0)
+                pending.insert(it->first);
+        }
+    }
+    else if (catalogFile)
+    {
+        // no catalog yet: build it once from the whole tree
+        pending.insert(files.begin(), files.end());
+    }
+
+    // a continuous stream of events must not delay processing forever
+    const std::chrono::milliseconds maxDelay(25 * watchDebounceMs);
+    std::chrono::steady_clock::time_point firstEvent = std::chrono::steady_clock::now();
+    alignas(struct inotify_event) char events[64 * 1024];
+
+    for (;;)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        const int rc = poll(&pfd, 1, pending.empty() ? -1 : watchDebounceMs);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(out, "ERROR: %s\n", strerror(errno));
+            close(fd);
+            return 1;
+        }
+
+        if (rc > 0)
+        {
+            if (pending.empty())
+                firstEvent = std::chrono::steady_clock::now();
+            const ssize_t len = read(fd, events, sizeof(events));
+            for (ssize_t i = 0; i < len; )
+            {
+                const struct inotify_event *ev = (const struct inotify_event *)(events + i);
+                i += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // events are lost: fall back to a rescan of the tree
+                    files.clear();
+                    AddWatches(fd, dir, watches, files);
+                    pending.insert(files.begin(), files.end());
+                    std::map<std::string, std::string>::const_iterator it;
+                    for (it = catalog.begin(); it != catalog.end(); ++it)
+                        pending.insert(it->first);
+                    continue;
+                }
+                if (ev->mask & IN_IGNORED)
+                {
+                    watches.erase(ev->wd);
+                    continue;
+                }
+                if (ev->len == 0 || watches.count(ev->wd) == 0)
+                    continue;
+
+                const std::string path = watches[ev->wd] + "/" + ev->name;
+                if (ev->mask & IN_ISDIR)
+                {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    {
+                        // files may already exist in a new directory
+                        files.clear();
+                        AddWatches(fd, path, watches, files);
+                        pending.insert(files.begin(), files.end());
+                    }
+                    else if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+                    {
+                        RemoveWatches(fd, path, watches, pending);
+                    }
+                }
+                else if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))
+                         && IsSysexFilename(ev->name))
+                {
+                    pending.insert(path);
+                }
+            }
+            if (pending.empty() || std::chrono::steady_clock::now() - firstEvent < maxDelay)
+                continue;
+        }
+
+        // no more events within the debounce time: process collected files
+        std::set<std::string>::const_iterator it;
+        for (it = pending.begin(); it != pending.end(); ++it)
+            UpdateFile(it->c_str());
+        if (catalogFile && !pending.empty())
+            WriteCatalog(catalogFile);
+        fflush(out);
+        pending.clear();
+    }
+}
+
+// ***************************************************************************
+
+//! Values of all command-line options (used to reset options between requests).
+struct OptionState
+{
+    bool showHex;
+    bool errorsOnly;
+    bool voiceDataList;
+    bool tabularListing;
+    bool findDupes;
+    int patch;
+    bool fixFiles;
+    bool plainFilenames;
+    bool askToFix;
+    bool noBackup;
+    const char *repairPlan;
+    bool dryRun;
+    const char *undoFile;
+    const char *undoJournal;
+    FsyncPolicy fsyncPolicy;
+    std::vector<std::string> editSets;
+    const char *editWhere;
+    const char *editJournal;
+    const char *resumeJournal;
+    const char *splitDir;
+    const char *mergeBank;
+    const char *assembleBank;
+    bool uniqueVoices;
+    const char *defragBank;
+    bool diffFiles;
+    bool compareTrees;
+    unsigned provenanceThreshold;
+    bool factoryTable;
+    const char *dedupMode;
+    const char *indexMap;
+    const char *indexMerge;
+    bool useUnicode;
+    bool formfeed;
+    OutputFormat outputFormat;
+    const char *templateText;
+    int tableVariant;
+    const char *watchDir;
+    const char *catalogFile;
+    const char *serveSocket;
+    int httpPort;
+    std::vector<std::string> outputSinks;
+};
+
+/*! Save the current values of all options.
+ *
+ *  \param state a pointer to the saved option values
+ */
+void SaveOptions(OptionState *state)
+{
+    state->showHex = showHex;
+    state->errorsOnly = errorsOnly;
+    state->voiceDataList = voiceDataList;
+    state->tabularListing = tabularListing;
+    state->findDupes = findDupes;
+    state->patch = patch;
+    state->fixFiles = fixFiles;
+    state->plainFilenames = plainFilenames;
+    state->askToFix = askToFix;
+    state->noBackup = noBackup;
+    state->repairPlan = repairPlan;
+    state->dryRun = dryRun;
+    state->undoFile = undoFile;
+    state->undoJournal = undoJournal;
+    state->fsyncPolicy = fsyncPolicy;
+    state->editSets = editSets;
+    state->editWhere = editWhere;
+    state->editJournal = editJournal;
+    state->resumeJournal = resumeJournal;
+    state->splitDir = splitDir;
+    state->mergeBank = mergeBank;
+    state->assembleBank = assembleBank;
+    state->uniqueVoices = uniqueVoices;
+    state->defragBank = defragBank;
+    state->diffFiles = diffFiles;
+    state->compareTrees = compareTrees;
+    state->provenanceThreshold = provenanceThreshold;
+    state->factoryTable = factoryTable;
+    state->dedupMode = dedupMode;
+    state->indexMap = indexMap;
+    state->indexMerge = indexMerge;
+    state->useUnicode = useUnicode;
+    state->formfeed = formfeed;
+    state->outputFormat = outputFormat;
+    state->templateText = templateText;
+    state->tableVariant = tableVariant;
+    state->watchDir = watchDir;
+    state->catalogFile = catalogFile;
+    state->serveSocket = serveSocket;
+    state->httpPort = httpPort;
+    state->outputSinks = outputSinks;
+}
+
+/*! Restore the values of all options.
+ *
+ *  \param state a pointer to the saved option values
+ */
+void RestoreOptions(const OptionState *state)
+{
+    showHex = state->showHex;
+    errorsOnly = state->errorsOnly;
+    voiceDataList = state->voiceDataList;
+    tabularListing = state->tabularListing;
+    findDupes = state->findDupes;
+    patch = state->patch;
+    fixFiles = state->fixFiles;
+    plainFilenames = state->plainFilenames;
+    askToFix = state->askToFix;
+    noBackup = state->noBackup;
+    repairPlan = state->repairPlan;
+    dryRun = state->dryRun;
+    undoFile = state->undoFile;
+    undoJournal = state->undoJournal;
+    fsyncPolicy = state->fsyncPolicy;
+    editSets = state->editSets;
+    editWhere = state->editWhere;
+    editJournal = state->editJournal;
+    resumeJournal = state->resumeJournal;
+    splitDir = state->splitDir;
+    mergeBank = state->mergeBank;
+    assembleBank = state->assembleBank;
+    uniqueVoices = state->uniqueVoices;
+    defragBank = state->defragBank;
+    diffFiles = state->diffFiles;
+    compareTrees = state->compareTrees;
+    provenanceThreshold = state->provenanceThreshold;
+    factoryTable = state->factoryTable;
+    dedupMode = state->dedupMode;
+    indexMap = state->indexMap;
+    indexMerge = state->indexMerge;
+    useUnicode = state->useUnicode;
+    formfeed = state->formfeed;
+    outputFormat = state->outputFormat;
+    templateText = state->templateText;
+    tableVariant = state->tableVariant;
+    watchDir = state->watchDir;
+    catalogFile = state->catalogFile;
+    serveSocket = state->serveSocket;
+    httpPort = state->httpPort;
+    outputSinks = state->outputSinks;
+}
+
+// ***************************************************************************
+
+//! A file in the LRU cache of the server mode.
+struct CachedFile
+{
+    std::string filename;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int fsize;
+    unsigned char data[sysexSize];
+};
+
+//! cached files, most recently used first
+std::list<CachedFile> fileCache;
+
+//! filename index of the cached files
+std::unordered_map<std::string, std::list<CachedFile>::iterator> fileCacheIndex;
+
+//! protects the file cache and the option parser (getopt is not reentrant)
+std::mutex serverMutex;
+
+//! options given on the command line of the server (defaults for each request)
+OptionState serverOptions;
+
+/*! Read a sysex file into the file data buffer, using the LRU cache.
+ *
+ *  A cached file is used as long as inode, size, and modification time
+ *  are unchanged.
+ *
+ *  \param filename a pointer to the filename
+ *  \return 0 if the file could be opened
+ */
+int LoadFileCached(const char *filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+    {
+        loadError = errno;
+        fsize = -1;
+        if (outputFormat == FORMAT_TEXT)
+            fprintf(out, "ERROR: Can't open the file: %s\n", strerror(loadError));
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(serverMutex);
+    std::unordered_map<std::string, std::list<CachedFile>::iterator>::iterator it;
+    it = fileCacheIndex.find(filename);
+    if (it != fileCacheIndex.end())
+    {
+        const CachedFile &cached = *it->second;
+        if (cached.dev == st.st_dev && cached.ino == st.st_ino &&
+            cached.size == st.st_size &&
+            cached.mtime.tv_sec == st.st_mtim.tv_sec &&
+            cached.mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            fileCache.splice(fileCache.begin(), fileCache, it->second);
+            memcpy(buffer, cached.data, sizeof(buffer));
+            fsize = cached.fsize;
+            fileReadOk = true;
+            return 0;
+        }
+        // file has changed
+        fileCache.erase(it->second);
+        fileCacheIndex.erase(it);
+    }
+
+    if (LoadFile(filename, outputFormat != FORMAT_TEXT))
+        return 1;
+    if (!fileReadOk)
+        return 0;
+
+    fileCache.push_front(CachedFile());
+    CachedFile &cached = fileCache.front();
+    cached.filename = filename;
+    cached.dev = st.st_dev;
+    cached.ino = st.st_ino;
+    cached.size = st.st_size;
+    cached.mtime = st.st_mtim;
+    cached.fsize = fsize;
+    memcpy(cached.data, buffer, sizeof(buffer));
+    fileCacheIndex[cached.filename] = fileCache.begin();
+
+    if (fileCache.size() > serverCacheSize)
+    {
+        fileCacheIndex.erase(fileCache.back().filename);
+        fileCache.pop_back();
+    }
+    return 0;
+}
+
+// ***************************************************************************
+
+/*! Process one server request.
+ *
+ *  A request is a line of command-line arguments, separated by blanks.
+ *  Arguments containing blanks can be enclosed in double quotes.
+ *
+ *  \param request a pointer to the request line (modified while parsing)
+ *  \param response string the output of the request is written to
+ */
+void ServeRequest(char *request, std::string &response)
+{
+    // split request into an argument vector
+    std::vector<char *> args;
+    args.push_back((char *)"dx7dumpd");
+    char *p = request;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        if (*p == 0)
+            break;
+        const char delimiter = (*p == '"') ? '"' : ' ';
+        if (delimiter == '"')
+            p++;
+        args.push_back(p);
+        while (*p != 0 && *p != delimiter && (delimiter == '"' || (*p != '\t' && *p != '\r')))
+            p++;
+        if (*p != 0)
+            *p++ = 0;
+    }
+    args.push_back(NULL);
+
+    // capture the output of the request
+    char *output = NULL;
+    size_t outputSize = 0;
+    FILE *memFile = open_memstream(&output, &outputSize);
+    if (memFile == NULL)
+    {
+        response = "ERROR: out of memory\n";
+        response += '\0';
+        return;
+    }
+    out = memFile;
+
+    // options and file buffer are thread local
+    RestoreOptions(&serverOptions);
+    int argc = args.size() - 1;
+    char **argv = args.data();
+    int rc;
+    {
+        std::lock_guard<std::mutex> lock(serverMutex);
+        optind = 0;     // re-initialize getopt
+        opterr = 0;
+        outputSinks.clear();
+        editSets.clear();
+        rc = processOpts(&argc, &argv);
+    }
+    std::string templateError;
+    if (rc < 0)
+    {
+        if (fixFiles || repairPlan || undoFile || undoJournal || watchDir || catalogFile || serveSocket || httpPort ||
+            !outputSinks.empty() || !editSets.empty() || editWhere || editJournal || resumeJournal || splitDir || mergeBank ||
+            assembleBank || defragBank || diffFiles || compareTrees || provenanceThreshold ||
+            factoryTable || dedupMode || indexMap || indexMerge)
+        {
+            PutLine("Option not supported by dx7dumpd");
+        }
+        else if (templateText && CompileTemplate(templateText, compiledTemplate, templateError))
+        {
+            fprintf(out, "Invalid template: %s\n", templateError.c_str());
+        }
+        else if (argc == 0)
+        {
+            PutLine("Expecting a filename.");
+        }
+        else
+        {
+            SelectRenderer();
+            ResetFileState();
+            BeginOutput();
+            if (LoadFileCached(argv[0]) == 0 || outputFormat != FORMAT_TEXT)
+                processData(argv[0]);
+            EndOutput();
+        }
+    }
+
+    fclose(memFile);
+    out = stdout;
+    response.assign(output, outputSize);
+    response += '\0';
+    free(output);
+}
+
+// ***************************************************************************
+
+//! State of one connection of the server.
+struct ServerConnection
+{
+    std::string in;
+    std::string out;
+    std::chrono::steady_clock::time_point lastActive;
+    bool closeAfterWrite;       // the client closed its side
+};
+
+//! connections of the server without a request for this time are closed (ms)
+const int serverIdleMs = 60000;
+
+/*! Worker thread of the server: one epoll loop over the shared listening
+ *  socket and the connections accepted by this worker. A request is answered
+ *  as soon as its line is complete, so idle clients don't block the worker.
+ *
+ *  \param listenFd non-blocking listening socket
+ *  \param stopFd eventfd, readable when the server is shut down
+ *  \param failed set if the worker stopped because of an error
+ */
+void ServerWorker(int listenFd, int stopFd, std::atomic<bool> *failed)
+{
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = listenFd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listenFd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = stopFd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, stopFd, &ev);
+
+    std::unordered_map<int, ServerConnection> conns;
+    struct epoll_event events[64];
+    char chunk[4096];
+    std::string response;
+    bool stop = false;
+
+    while (!stop)
+    {
+        const int n = epoll_wait(ep, events, 64, 1000);
+        if (n < 0 && errno != EINTR)
+        {
+            // stop the other workers too
+            fprintf(out, "ERROR: %s\n", strerror(errno));
+            *failed = true;
+            const uint64_t one = 1;
+            if (write(stopFd, &one, sizeof(one)) != sizeof(one))
+                fprintf(out, "ERROR: %s\n", strerror(errno));
+            break;
+        }
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == stopFd)
+            {
+                stop = true;
+                continue;
+            }
+            if (fd == listenFd)
+            {
+                int client;
+                while ((client = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, client, &ev);
+                    ServerConnection &conn = conns[client];
+                    conn.lastActive = now;
+                    conn.closeAfterWrite = false;
+                }
+                continue;
+            }
+
+            ServerConnection &conn = conns[fd];
+            conn.lastActive = now;
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                ssize_t len;
+                while ((len = read(fd, chunk, sizeof(chunk))) > 0)
+                    conn.in.append(chunk, len);
+                if (len == 0)
+                    conn.closeAfterWrite = true;
+                else if (errno != EAGAIN)
+                    ok = false;
+
+                size_t eol;
+                while ((eol = conn.in.find('\n')) != std::string::npos)
+                {
+                    conn.in[eol] = 0;
+                    ServeRequest(&conn.in[0], response);
+                    conn.out += response;
+                    conn.in.erase(0, eol + 1);
+                }
+            }
+
+            while (ok && !conn.out.empty())
+            {
+                const ssize_t len = write(fd, conn.out.data(), conn.out.size());
+                if (len <= 0)
+                {
+                    if (len < 0 && errno != EAGAIN)
+                        ok = false;
+                    break;
+                }
+                conn.out.erase(0, len);
+            }
+
+            if (!ok || (conn.closeAfterWrite && conn.out.empty()))
+            {
+                close(fd);  // also removes fd from epoll
+                conns.erase(fd);
+                continue;
+            }
+            ev.events = conn.out.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+            ev.data.fd = fd;
+            epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+        }
+
+        // close the idle connections
+        std::unordered_map<int, ServerConnection>::iterator c = conns.begin();
+        while (c != conns.end())
+        {
+            if (now - c->second.lastActive > std::chrono::milliseconds(serverIdleMs))
+            {
+                close(c->first);
+                c = conns.erase(c);
+            }
+            else
+            {
+                ++c;
+            }
+        }
+    }
+
+    for (std::unordered_map<int, ServerConnection>::iterator c = conns.begin(); c != conns.end(); ++c)
+        close(c->first);
+    close(ep);
+}
+
+// ***************************************************************************
+
+/*! Run dx7dump as server on a unix domain socket.
+ *
+ *  The options of the server's command line are the defaults for each
+ *  request. Connections are handled by a pool of worker threads; the
+ *  recently used files are kept in an LRU cache shared by all workers.
+ *  SIGINT and SIGTERM shut the server down and remove the socket.
+ *
+ *  \param socketPath a pointer to the path of the socket
+ *  \return 0 after a shutdown by signal, 1 on errors
+ */
+int RunServer(const char *socketPath)
+{
+    struct sockaddr_un addr;
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        fprintf(out, "ERROR: Socket path too long: %s\n", socketPath);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+    {
+        fprintf(out, "ERROR: Can't create socket: %s\n", strerror(errno));
+        return 1;
+    }
+    unlink(socketPath);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listenFd, SOMAXCONN) != 0)
+    {
+        fprintf(out, "ERROR: Can't listen on socket %s: %s\n", socketPath, strerror(errno));
+        close(listenFd);
+        return 1;
+    }
+
+    // the signals are blocked before the workers start (they inherit the
+    // mask) and read from a signalfd by this thread only
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    const int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+    const int stopFd = eventfd(0, EFD_CLOEXEC);
+    if (signalFd < 0 || stopFd < 0)
+    {
+        fprintf(out, "ERROR: %s\n", strerror(errno));
+        if (signalFd >= 0)
+            close(signalFd);
+        close(listenFd);
+        unlink(socketPath);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    serveSocket = NULL;
+    SaveOptions(&serverOptions);
+
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(ServerWorker, listenFd, stopFd, &failed));
+
+    // wait for a signal or a failed worker, then stop all workers
+    struct pollfd pfds[2] = { { signalFd, POLLIN, 0 }, { stopFd, POLLIN, 0 } };
+    while (poll(pfds, 2, -1) < 0 && errno == EINTR)
+        ;
+    const uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) != sizeof(one))
+        failed = true;
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    close(signalFd);
+    close(stopFd);
+    close(listenFd);
+    unlink(socketPath);
+    return failed ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// HTTP/JSON query server
+
+//! One voice of the memory-mapped catalog: pointers into the mapped file.
+struct CatalogVoice
+{
+    const char *path;       // not terminated
+    unsigned pathLen;
+    unsigned voiceNum;
+    const char *name;       // 10 characters 7-bit ASCII, not terminated
+    const char *hex;        // voice data: 2 HEX digits per byte of VoiceUnpacked
+};
+
+//! A mapped catalog file and the index of its voices, shared read-only by the workers.
+struct Catalog
+{
+    const char *data;
+    size_t size;
+    ino_t inode;
+    struct timespec mtime;
+    std::vector<CatalogVoice> voices;       // in catalog order (sorted by path)
+    std::unordered_map<std::string, std::pair<unsigned, unsigned> > banks;  // path -> first voice, count
+
+    Catalog() : data(NULL), size(0) {}
+    ~Catalog()
+    {
+        if (size > 0)
+            munmap((void *)data, size);
+    }
+};
+
+//! the current catalog: replaced when the catalog file is replaced or modified
+std::shared_ptr<const Catalog> currentCatalog;
+std::mutex currentCatalogMutex;
+
+//! interval of the HTTP server's check for a changed catalog file (ms)
+const int catalogCheckMs = 1000;
+
+/*! Value of an upper case HEX digit.
+ *
+ *  \param c the digit
+ *  \return 0..15, or -1 if c is not an upper case HEX digit
+ */
+inline int HexDigit(char c)
+{
+    return (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+/*! Decode one byte of the voice data of a catalog voice.
+ *
+ *  \param v catalog voice
+ *  \param offset offset of the byte in VoiceUnpacked
+ *  \return the byte
+ */
+inline unsigned char CatalogByte(const CatalogVoice &v, unsigned offset)
+{
+    return HexDigit(v.hex[2 * offset]) << 4 | HexDigit(v.hex[2 * offset + 1]);
+}
+
+/*! Map a catalog file into memory and index its voices. Lines with a wrong
+ *  format or invalid HEX data are skipped.
+ *
+ *  \param catalogName a pointer to the catalog filename
+ *  \param mapped catalog the file is mapped into
+ *  \return 0 if ok
+ */
+int MapCatalog(const char *catalogName, Catalog &mapped)
+{
+    int fd = open(catalogName, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(out, "ERROR: Can't open the catalog: %s. %s\n", catalogName, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    mapped.inode = st.st_ino;
+    mapped.mtime = st.st_mtim;
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    const char *data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(out, "ERROR: Can't map the catalog: %s. %s\n", catalogName, strerror(errno));
+        return 1;
+    }
+    mapped.data = data;
+    mapped.size = st.st_size;
+
+    const char *end = data + st.st_size;
+    for (const char *line = data; line < end; )
+    {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        // path TAB voice-# TAB name TAB hex-data
+        const char *tab1 = (const char *)memchr(line, '\t', eol - line);
+        const char *tab2 = tab1 ? (const char *)memchr(tab1 + 1, '\t', eol - tab1 - 1) : NULL;
+        const char *hex = (tab2 && eol - tab2 > 12) ? tab2 + 12 : NULL;
+        bool valid = hex && hex[-1] == '\t' && eol - hex == 2 * (long)sizeof(VoiceUnpacked);
+        for (const char *h = hex; valid && h < eol; h++)
+            valid = HexDigit(*h) >= 0;
+        if (valid)
+        {
+            CatalogVoice v;
+            v.path = line;
+            v.pathLen = tab1 - line;
+            v.voiceNum = strtoul(tab1 + 1, NULL, 10);
+            v.name = tab2 + 1;
+            v.hex = hex;
+
+            std::pair<unsigned, unsigned> &bank = mapped.banks[std::string(v.path, v.pathLen)];
+            if (bank.second == 0)
+                bank.first = mapped.voices.size();
+            bank.second++;
+            mapped.voices.push_back(v);
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/*! Get the current catalog of the HTTP server.
+ *
+ *  \return a pointer to the catalog, valid as long as it is held
+ */
+std::shared_ptr<const Catalog> GetCatalog()
+{
+    std::lock_guard<std::mutex> lock(currentCatalogMutex);
+    return currentCatalog;
+}
+
+/*! Map the catalog file again if it was replaced (e.g. by watch mode) or
+ *  modified since it was mapped. Requests in progress keep the old catalog.
+ *
+ *  \param catalogName a pointer to the catalog filename
+ */
+void RefreshCatalog(const char *catalogName)
+{
+    const std::shared_ptr<const Catalog> current = GetCatalog();
+    struct stat st;
+    if (stat(catalogName, &st) != 0 || (st.st_ino == current->inode &&
+        st.st_mtim.tv_sec == current->mtime.tv_sec && st.st_mtim.tv_nsec == current->mtime.tv_nsec))
+        return;
+
+    std::shared_ptr<Catalog> mapped(new Catalog());
+    if (MapCatalog(catalogName, *mapped))
+        return;
+    fprintf(out, "Catalog: %zu banks, %zu voices\n", mapped->banks.size(), mapped->voices.size());
+    fflush(out);
+    std::lock_guard<std::mutex> lock(currentCatalogMutex);
+    currentCatalog = mapped;
+}
+
+// ***************************************************************************
+
+/*! Decode a percent-encoded URL query component.
+ *
+ *  \param text a pointer to the encoded text
+ *  \param len length of the encoded text
+ *  \return decoded text
+ */
+std::string UrlDecode(const char *text, size_t len)
+{
+    std::string decoded;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '%' && i + 2 < len && isxdigit(text[i + 1]) && isxdigit(text[i + 2]))
+        {
+            char hex[3] = { text[i + 1], text[i + 2], 0 };
+            decoded += (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        else if (text[i] == '+')
+            decoded += ' ';
+        else
+            decoded += text[i];
+    }
+    return decoded;
+}
+
+/*! Append the short JSON description of a catalog voice: path, voice-#, name.
+ *
+ *  \param json string the JSON text is appended to
+ *  \param v catalog voice
+ */
+void JsonVoiceRef(std::string &json, const CatalogVoice &v)
+{
+    json += "{\"path\":";
+    JsonString(json, v.path, v.pathLen);
+    json += ',';
+    JsonNumber(json, "voice", v.voiceNum);
+    json += ",\"name\":";
+    JsonString(json, v.name, 10);
+    json += '}';
+}
+
+/*! Find a voice of the catalog.
+ *
+ *  \param mapped the catalog
+ *  \param path bank path
+ *  \param voiceNum voice number (1..32)
+ *  \return a pointer to the catalog voice, NULL if not found
+ */
+const CatalogVoice *FindCatalogVoice(const Catalog &mapped, const std::string &path, unsigned voiceNum)
+{
+    std::unordered_map<std::string, std::pair<unsigned, unsigned> >::const_iterator bank;
+    bank = mapped.banks.find(path);
+    if (bank == mapped.banks.end())
+        return NULL;
+    for (unsigned i = 0; i < bank->second.second; i++)
+    {
+        const CatalogVoice &v = mapped.voices[bank->second.first + i];
+        if (v.voiceNum == voiceNum)
+            return &v;
+    }
+    return NULL;
+}
+
+/*! Answer one HTTP GET request.
+ *
+ *  Endpoints:
+ *    /banks                            all banks of the catalog
+ *    /bank?path=P                      voice names of a bank
+ *    /voice?path=P&voice=N             all parameters of a voice
+ *    /search?name=S&FIELD=V&limit=N    voices by name (substring) and raw
+ *                                      parameter values (V or MIN-MAX)
+ *    /similar?path=P&voice=N&limit=N   voices with the nearest parameters
+ *
+ *  \param mapped the catalog
+ *  \param target a pointer to the request target (path and query)
+ *  \param len length of the request target
+ *  \param json string the response body is written to
+ *  \return HTTP status code
+ */
+int HttpRequest(const Catalog &mapped, const char *target, size_t len, std::string &json)
+{
+    const char *query = (const char *)memchr(target, '?', len);
+    const std::string endpoint(target, query ? query - target : len);
+
+    // parse query parameters
+    std::vector<std::pair<std::string, std::string> > params;
+    std::string path;
+    unsigned voiceNum = 0;
+    unsigned limit = 100;
+    if (query)
+    {
+        const char *end = target + len;
+        for (const char *p = query + 1; p < end; )
+        {
+            const char *amp = (const char *)memchr(p, '&', end - p);
+            if (amp == NULL)
+                amp = end;
+            const char *eq = (const char *)memchr(p, '=', amp - p);
+            if (eq == NULL)
+                eq = amp;
+            std::pair<std::string, std::string> param(UrlDecode(p, eq - p),
+                UrlDecode(eq + (eq < amp), amp - eq - (eq < amp)));
+            if (param.first == "path")
+                path = param.second;
+            else if (param.first == "voice")
+                voiceNum = strtoul(param.second.c_str(), NULL, 10);
+            else if (param.first == "limit")
+                limit = strtoul(param.second.c_str(), NULL, 10);
+            else
+                params.push_back(param);
+            p = amp + 1;
+        }
+    }
+
+    json.clear();
+    if (endpoint == "/banks")
+    {
+        json += '[';
+        for (unsigned i = 0; i < mapped.voices.size(); )
+        {
+            const CatalogVoice &v = mapped.voices[i];
+            const unsigned count = mapped.banks.at(std::string(v.path, v.pathLen)).second;
+            if (i > 0)
+                json += ',';
+            json += "{\"path\":";
+            JsonString(json, v.path, v.pathLen);
+            json += ',';
+            JsonNumber(json, "voices", count);
+            json += '}';
+            i += count;
+        }
+        json += ']';
+        return 200;
+    }
+    if (endpoint == "/bank")
+    {
+        std::unordered_map<std::string, std::pair<unsigned, unsigned> >::const_iterator bank;
+        bank = mapped.banks.find(path);
+        if (bank == mapped.banks.end())
+            return 404;
+        json += "{\"path\":";
+        JsonString(json, path.data(), path.size());
+        json += ",\"voices\":[";
+        for (unsigned i = 0; i < bank->second.second; i++)
+        {
+            const CatalogVoice &v = mapped.voices[bank->second.first + i];
+            if (i > 0)
+                json += ',';
+            json += '{';
+            JsonNumber(json, "voice", v.voiceNum);
+            json += ",\"name\":";
+            JsonString(json, v.name, 10);
+            json += '}';
+        }
+        json += "]}";
+        return 200;
+    }
+    if (endpoint == "/voice")
+    {
+        const CatalogVoice *v = FindCatalogVoice(mapped, path, voiceNum);
+        if (v == NULL)
+            return 404;
+        VoiceUnpacked voice;
+        for (unsigned i = 0; i < sizeof(VoiceUnpacked); i++)
+            ((unsigned char *)&voice)[i] = CatalogByte(*v, i);
+        json += "{\"path\":";
+        JsonString(json, v->path, v->pathLen);
+        json += ',';
+        JsonNumber(json, "voice", v->voiceNum);
+        json += ',';
+        JsonVoice(json, &voice);
+        json += '}';
+        return 200;
+    }
+    if (endpoint == "/search")
+    {
+        // compile the criteria: name substring and parameter ranges
+        std::string nameFilter;
+        std::vector<int> offsets;
+        std::vector<std::pair<int, int> > ranges;
+        for (unsigned i = 0; i < params.size(); i++)
+        {
+            if (params[i].first == "name")
+            {
+                nameFilter = params[i].second;
+                continue;
+            }
+            const int offset = FindParamField(params[i].first.data(), params[i].first.size());
+            if (offset < 0)
+                return 400;
+            char *rest;
+            const int min = strtol(params[i].second.c_str(), &rest, 10);
+            const int max = (*rest == '-') ? strtol(rest + 1, NULL, 10) : min;
+            offsets.push_back(offset);
+            ranges.push_back(std::make_pair(min, max));
+        }
+
+        json += '[';
+        unsigned found = 0;
+        for (unsigned i = 0; i < mapped.voices.size() && found < limit; i++)
+        {
+            const CatalogVoice &v = mapped.voices[i];
+            char voiceName[11];
+            memcpy(voiceName, v.name, 10);
+            voiceName[10] = 0;
+            bool match = nameFilter.empty() || strcasestr(voiceName, nameFilter.c_str()) != NULL;
+            for (unsigned j = 0; match && j < offsets.size(); j++)
+            {
+                const int value = CatalogByte(v, offsets[j]);
+                match = value >= ranges[j].first && value <= ranges[j].second;
+            }
+            if (!match)
+                continue;
+            if (found++ > 0)
+                json += ',';
+            JsonVoiceRef(json, v);
+        }
+        json += ']';
+        return 200;
+    }
+    if (endpoint == "/similar")
+    {
+        const CatalogVoice *ref = FindCatalogVoice(mapped, path, voiceNum);
+        if (ref == NULL)
+            return 404;
+
+        // distance = sum of absolute parameter differences (name excluded)
+        const unsigned paramSize = offsetof(VoiceUnpacked, name);
+        unsigned char a[sizeof(VoiceUnpacked)];
+        for (unsigned j = 0; j < paramSize; j++)
+            a[j] = CatalogByte(*ref, j);
+        std::vector<std::pair<unsigned, unsigned> > distances(mapped.voices.size());
+        for (unsigned i = 0; i < mapped.voices.size(); i++)
+        {
+            const CatalogVoice &v = mapped.voices[i];
+            unsigned d = 0;
+            for (unsigned j = 0; j < paramSize; j++)
+                d += abs(a[j] - CatalogByte(v, j));
+            distances[i] = std::make_pair(d, i);
+        }
+        if (limit > distances.size())
+            limit = distances.size();
+        std::partial_sort(distances.begin(), distances.begin() + limit, distances.end());
+
+        json += '[';
+        for (unsigned i = 0; i < limit; i++)
+        {
+            const CatalogVoice &v = mapped.voices[distances[i].second];
+            if (i > 0)
+                json += ',';
+            json += "{\"path\":";
+            JsonString(json, v.path, v.pathLen);
+            json += ',';
+            JsonNumber(json, "voice", v.voiceNum);
+            json += ",\"name\":";
+            JsonString(json, v.name, 10);
+            json += ',';
+            JsonNumber(json, "distance", distances[i].first);
+            json += '}';
+        }
+        json += ']';
+        return 200;
+    }
+    return 404;
+}
+
+// ***************************************************************************
+
+//! State of one HTTP connection.
+struct HttpConnection
+{
+    std::string in;
+    std::string out;
+    bool closeAfterWrite;
+};
+
+//! maximal size of a request (header and body)
+const size_t httpMaxRequest = 16384;
+
+/*! Find a header field of an HTTP request.
+ *
+ *  \param header the header fields, each after a line break
+ *  \param fieldName a pointer to the field name with colon, e.g. "Content-Length:"
+ *  \return a pointer to the value (leading blanks skipped), NULL if not found
+ */
+const char *HttpHeader(const std::string &header, const char *fieldName)
+{
+    const std::string key = std::string("\n") + fieldName;
+    const char *field = strcasestr(header.c_str(), key.c_str());
+    if (field == NULL)
+        return NULL;
+    field += key.size();
+    while (*field == ' ' || *field == '\t')
+        field++;
+    return field;
+}
+
+/*! Parse the complete requests of a connection and queue the responses.
+ *  Request bodies (Content-Length) are skipped, so the next request of the
+ *  connection is found after any response.
+ *
+ *  \param conn HTTP connection
+ *  \return false if the connection is to be closed immediately
+ */
+bool HttpParse(HttpConnection &conn)
+{
+    std::string body;
+    size_t headerEnd;
+    while ((headerEnd = conn.in.find("\r\n\r\n")) != std::string::npos)
+    {
+        // request line: METHOD SP TARGET SP VERSION
+        const char *line = conn.in.c_str();
+        const char *sp1 = strchr(line, ' ');
+        const char *sp2 = sp1 ? strchr(sp1 + 1, ' ') : NULL;
+        const char *eol = strstr(line, "\r\n");
+        const std::string header(eol, headerEnd - (eol - line));
+
+        // body length; chunked bodies are not supported
+        const char *length = HttpHeader(header, "Content-Length:");
+        char *lengthEnd = NULL;
+        const size_t bodySize = length ? strtoul(length, &lengthEnd, 10) : 0;
+        const bool malformed = sp2 == NULL || sp2 > eol ||
+                               HttpHeader(header, "Transfer-Encoding:") != NULL ||
+                               (length && (!isdigit(*length) || (*lengthEnd != '\r' && *lengthEnd != 0))) ||
+                               headerEnd + 4 + bodySize > httpMaxRequest;
+        if (!malformed && conn.in.size() < headerEnd + 4 + bodySize)
+            break;
+
+        int status;
+        if (malformed)
+        {
+            // the rest of the input can't be parsed: answer and close
+            status = 400;
+            body.clear();
+            conn.closeAfterWrite = true;
+        }
+        else if (strncmp(line, "GET ", 4) != 0)
+        {
+            status = 405;
+            body.clear();
+        }
+        else
+            status = HttpRequest(*GetCatalog(), sp1 + 1, sp2 - sp1 - 1, body);
+
+        const char *connection = HttpHeader(header, "Connection:");
+        if (!malformed && (strncmp(sp2 + 1, "HTTP/1.0", 8) == 0 ||
+                           (connection && strncasecmp(connection, "close", 5) == 0)))
+            conn.closeAfterWrite = true;
+
+        const char *reason = (status == 200) ? "OK" : (status == 400) ? "Bad Request" :
+                             (status == 404) ? "Not Found" : "Method Not Allowed";
+        char head[160];
+        conn.out.append(head, sprintf(head, "HTTP/1.1 %d %s\r\n"
+                                            "Content-Type: application/json\r\n"
+                                            "Content-Length: %zu\r\n\r\n",
+                                      status, reason, body.size()));
+        conn.out += body;
+        if (malformed)
+        {
+            conn.in.clear();
+            break;
+        }
+        conn.in.erase(0, headerEnd + 4 + bodySize);
+    }
+    // limit the size of incomplete requests
+    return conn.in.size() < httpMaxRequest;
+}
+
+/*! Worker thread of the HTTP server: one epoll loop per listening socket.
+ *
+ *  \param listenFd non-blocking listening socket
+ *  \param options a pointer to the options of the command line
+ */
+void HttpWorker(int listenFd, const OptionState *options)
+{
+    RestoreOptions(options);
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listenFd, &ev);
+
+    std::unordered_map<int, HttpConnection> conns;
+    struct epoll_event events[256];
+    char chunk[16384];
+
+    for (;;)
+    {
+        const int n = epoll_wait(ep, events, 256, -1);
+        for (int i = 0; i < n; i++)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == listenFd)
+            {
+                int client;
+                while ((client = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    const int one = 1;
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, client, &ev);
+                    conns[client].closeAfterWrite = false;
+                }
+                continue;
+            }
+
+            HttpConnection &conn = conns[fd];
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                ssize_t len;
+                while ((len = read(fd, chunk, sizeof(chunk))) > 0)
+                    conn.in.append(chunk, len);
+                if (len == 0 || (len < 0 && errno != EAGAIN))
+                    ok = false;
+                if (!HttpParse(conn))
+                    ok = false;
+            }
+
+            while (!conn.out.empty())
+            {
+                const ssize_t len = write(fd, conn.out.data(), conn.out.size());
+                if (len <= 0)
+                {
+                    if (len < 0 && errno != EAGAIN)
+                        ok = false;
+                    break;
+                }
+                conn.out.erase(0, len);
+            }
+
+            if (!ok || (conn.closeAfterWrite && conn.out.empty()))
+            {
+                close(fd);  // also removes fd from epoll
+                conns.erase(fd);
+                continue;
+            }
+            ev.events = conn.out.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+            ev.data.fd = fd;
+            epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+        }
+    }
+}
+
+/*! Run the HTTP/JSON query server for a voice catalog on localhost.
+ *
+ *  Each worker thread has its own listening socket (SO_REUSEPORT) and epoll
+ *  loop; the memory-mapped catalog is shared read-only. The catalog file is
+ *  checked every catalogCheckMs and mapped again when it was replaced or
+ *  modified, e.g. by --watch.
+ *
+ *  \param port TCP port
+ *  \param catalogName a pointer to the catalog filename
+ *  \return 1 if the server could not be started, does not return otherwise
+ */
+int RunHttpServer(int port, const char *catalogName)
+{
+    if (catalogName == NULL)
+    {
+        PutLine("The HTTP server requires a catalog (--catalog FILE).");
+        return 1;
+    }
+    std::shared_ptr<Catalog> mapped(new Catalog());
+    if (MapCatalog(catalogName, *mapped))
+        return 1;
+    fprintf(out, "Catalog: %zu banks, %zu voices\n", mapped->banks.size(), mapped->voices.size());
+    currentCatalog = mapped;
+
+    signal(SIGPIPE, SIG_IGN);
+    static OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 1)
+        workers = 1;
+
+    // all sockets are bound before the first worker starts
+    std::vector<int> listenFds;
+    for (unsigned i = 0; i < workers; i++)
+    {
+        int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        const int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listenFd, SOMAXCONN) != 0)
+        {
+            fprintf(out, "ERROR: Can't listen on port %d: %s\n", port, strerror(errno));
+            if (listenFd >= 0)
+                close(listenFd);
+            for (unsigned j = 0; j < listenFds.size(); j++)
+                close(listenFds[j]);
+            return 1;
+        }
+        listenFds.push_back(listenFd);
+    }
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(HttpWorker, listenFds[i], &options));
+    fprintf(out, "Listening on http://127.0.0.1:%d/\n", port);
+    fflush(out);
+
+    // the workers never return: map the catalog again whenever it changes
+    for (;;)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(catalogCheckMs));
+        RefreshCatalog(catalogName);
+    }
+}
+
+// ***************************************************************************
+
+// Several outputs in one run (--output KIND=PATH)
+
+//! A file read once and shared by all outputs.
+struct FileJob
+{
+    std::string filename;
+    unsigned index;
+    int fsize;
+    bool fileReadOk;
+    int loadError;
+    unsigned char data[sysexSize];
+};
+
+//! Bounded queue of files between the reader and one output thread.
+struct JobQueue
+{
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::list<std::shared_ptr<const FileJob> > jobs;
+    bool closed;
+};
+
+//! maximum number of files waiting in the queue of one output
+const unsigned jobQueueSize = 64;
+
+//! One output of a run.
+struct OutputSink
+{
+    std::string kind;
+    FILE *file;
+    JobQueue queue;
+    int errors;
+};
+
+/*! Add a file to the queue of an output (blocks while the queue is full).
+ *
+ *  \param queue queue of the output
+ *  \param job shared file data
+ */
+void PushJob(JobQueue &queue, const std::shared_ptr<const FileJob> &job)
+{
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    while (queue.jobs.size() >= jobQueueSize)
+        queue.notFull.wait(lock);
+    queue.jobs.push_back(job);
+    queue.notEmpty.notify_one();
+}
+
+/*! Take the next file from the queue of an output.
+ *
+ *  \param queue queue of the output
+ *  \param job set to the next file
+ *  \return false if the queue is closed and empty
+ */
+bool PopJob(JobQueue &queue, std::shared_ptr<const FileJob> &job)
+{
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    while (queue.jobs.empty() && !queue.closed)
+        queue.notEmpty.wait(lock);
+    if (queue.jobs.empty())
+        return false;
+    job = queue.jobs.front();
+    queue.jobs.pop_front();
+    queue.notFull.notify_one();
+    return true;
+}
+
+/*! Mark the queue of an output as complete.
+ *
+ *  \param queue queue of the output
+ */
+void CloseJobs(JobQueue &queue)
+{
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.closed = true;
+    queue.notEmpty.notify_all();
+}
+
+/*! Output thread: format all files of the queue as requested by its kind.
+ *
+ *  \param sink a pointer to the output
+ *  \param options a pointer to the options of the command line
+ */
+void SinkWorker(OutputSink *sink, const OptionState *options)
+{
+    RestoreOptions(options);
+    out = sink->file;
+    const bool catalogOutput = (sink->kind == "catalog");
+    if (sink->kind == "names")
+        voiceDataList = false;
+    else if (sink->kind == "data")
+        voiceDataList = true;
+    else if (sink->kind == "errors")
+        errorsOnly = true;
+    else if (sink->kind == "json")
+        outputFormat = FORMAT_JSON;
+    else if (sink->kind == "ndjson")
+        outputFormat = FORMAT_NDJSON;
+    else if (sink->kind == "bin")
+        outputFormat = FORMAT_BIN;
+    else if (sink->kind == "template")
+        outputFormat = FORMAT_TEMPLATE;
+    else if (sink->kind == "validate")
+        outputFormat = FORMAT_VALIDATE;
+    SelectRenderer();
+
+    std::string lines;
+    std::shared_ptr<const FileJob> job;
+    if (!catalogOutput)
+        BeginOutput();
+    while (PopJob(sink->queue, job))
+    {
+        ResetFileState();
+        memcpy(buffer, job->data, sizeof(buffer));
+        fsize = job->fsize;
+        fileReadOk = job->fileReadOk;
+        loadError = job->loadError;
+        fileIndex = job->index;
+        const char *filename = job->filename.c_str();
+
+        if (catalogOutput)
+        {
+            const char *type;
+            char message[100];
+            if (strcmp(CheckData(&type, message), "error") != 0)
+            {
+                CatalogFromBuffer(filename, lines);
+                fwrite(lines.data(), 1, lines.size(), out);
+            }
+        }
+        else if (fsize < 0 && outputFormat == FORMAT_TEXT)
+        {
+            fprintf(out, "ERROR: Can't open the file: %s\n", strerror(loadError));
+            sink->errors++;
+        }
+        else if (processData(filename))
+        {
+            sink->errors++;
+        }
+    }
+    if (!catalogOutput)
+        EndOutput();
+    fflush(out);
+}
+
+/*! Process all files once and write them to several outputs.
+ *
+ *  Every file is read by the calling thread and handed to one thread per
+ *  output through a bounded queue, so a slow output only delays the
+ *  reading when its queue is full.
+ *
+ *  \param argc number of files
+ *  \param argv filenames
+ *  \return 0 if ok
+ */
+int RunSinks(int argc, char **argv)
+{
+    static const char *kinds[] = { "names", "data", "errors", "json", "ndjson", "bin",
+                                   "template", "validate", "catalog" };
+
+    std::vector<OutputSink *> sinks;
+    for (unsigned i = 0; i < outputSinks.size(); i++)
+    {
+        const std::string &spec = outputSinks[i];
+        const size_t eq = spec.find('=');
+        const std::string kind = spec.substr(0, eq);
+        bool known = false;
+        for (unsigned k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+            known = known || (kind == kinds[k]);
+        if (eq == std::string::npos || !known)
+        {
+            fprintf(out, "Invalid output: %s (expecting KIND=PATH)\n", spec.c_str());
+            return 1;
+        }
+        if (kind == "template" && templateText == NULL)
+        {
+            PutLine("Output template needs option --template.");
+            return 1;
+        }
+
+        OutputSink *sink = new OutputSink();
+        sink->kind = kind;
+        sink->errors = 0;
+        sink->queue.closed = false;
+        const std::string path = spec.substr(eq + 1);
+        sink->file = (path == "-") ? stdout : fopen(path.c_str(), "w");
+        if (sink->file == NULL)
+        {
+            fprintf(out, "Can't open the file for writing: %s. %s\n", path.c_str(), strerror(errno));
+            return 1;
+        }
+        sinks.push_back(sink);
+    }
+
+    OptionState options;
+    SaveOptions(&options);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < sinks.size(); i++)
+        threads.push_back(std::thread(SinkWorker, sinks[i], &options));
+
+    for (int i = 0; i < argc; i++)
+    {
+        std::shared_ptr<FileJob> job(new FileJob());
+        job->filename = argv[i];
+        job->index = i;
+        ResetFileState();
+        loadError = 0;
+        LoadFile(argv[i], true);
+        job->fsize = fsize;
+        job->fileReadOk = fileReadOk;
+        job->loadError = loadError;
+        memcpy(job->data, buffer, sizeof(buffer));
+
+        std::shared_ptr<const FileJob> shared = job;
+        for (unsigned j = 0; j < sinks.size(); j++)
+            PushJob(sinks[j]->queue, shared);
+    }
+
+    int errors = 0;
+    for (unsigned i = 0; i < sinks.size(); i++)
+    {
+        CloseJobs(sinks[i]->queue);
+        threads[i].join();
+        if (sinks[i]->file != stdout && fclose(sinks[i]->file) != 0)
+            errors++;
+        errors += sinks[i]->errors;
+        delete sinks[i];
+    }
+    return errors ? 1 : 0;
+}
+
+
+// ***************************************************************************
+
+// Batch repair (--repair)
+
+//! error classes of the batch repair (bit mask)
+enum RepairClass {
+    REPAIR_CHECKSUM = 1,        // bank with wrong checksum
+    REPAIR_HEADER = 2,          // bank with wrong substatus, format, or byte count
+    REPAIR_HEADERLESS = 4,      // headerless bank (4096 bytes)
+    REPAIR_SINGLE = 8,          // single voice with wrong checksum (not fixed)
+    REPAIR_UNFIXABLE = 16       // not a DX7 bank or not readable
+};
+
+//! Repair plan and result of one file.
+struct RepairEntry
+{
+    unsigned classes;
+    int oldChecksum;            // -1 if there was none
+    int newChecksum;
+    std::string changes;        // header bytes to change: "OFFSET:OLD>NEW ..."
+    std::string message;        // reason for unfixable files
+    bool fixed;
+    bool failed;
+};
+
+/*! Check a file and plan its repair. The file data is left in the file
+ *  data buffer, fixed if the file is fixable.
+ *
+ *  \param filename a pointer to the filename
+ *  \param entry repair entry of the file
+ *  \return true if the file can be fixed by FixFile()
+ */
+bool PlanRepair(const char *filename, RepairEntry &entry)
+{
+    entry.classes = 0;
+    entry.oldChecksum = entry.newChecksum = -1;
+    entry.changes.clear();
+    entry.message.clear();
+
+    ResetFileState();
+    if (LoadFile(filename, true) || !fileReadOk)
+    {
+        entry.classes = REPAIR_UNFIXABLE;
+        entry.message = fsize < 0 ? strerror(loadError) : "File read error";
+        return false;
+    }
+
+    if (fsize == singleSysexSize)
+    {
+        const DX7SingleSysex *single = (const DX7SingleSysex *)buffer;
+        if (VerifySingle(single) != 0)
+        {
+            entry.classes = REPAIR_UNFIXABLE;
+            entry.message = "Corrupt single voice dump";
+        }
+        else if (msgBuffer[0] != 0)
+        {
+            entry.classes = REPAIR_SINGLE;
+            entry.oldChecksum = single->checksum;
+            entry.newChecksum = ChecksumSingle(&single->voice, sizeof(VoiceUnpacked));
+        }
+        return false;
+    }
+    if (fsize != sysexSize && fsize != rawDataSize)
+    {
+        char message[40];
+        sprintf(message, "File size %d Bytes", fsize);
+        entry.classes = REPAIR_UNFIXABLE;
+        entry.message = message;
+        return false;
+    }
+
+    DX7Sysex *sysex = (DX7Sysex *)buffer;
+    if (fsize == rawDataSize)
+    {
+        entry.classes = REPAIR_HEADERLESS;
+    }
+    else
+    {
+        if (Verify(sysex) != 0)
+        {
+            entry.classes = REPAIR_UNFIXABLE;
+            entry.message = msgBuffer;
+            entry.message.erase(entry.message.find_last_not_of('\n') + 1);
+            return false;
+        }
+        if (!fixNeeded)
+            return false;
+        entry.oldChecksum = sysex->checksum;
+    }
+
+    // fix the buffer like FixFile() and list the changed header bytes
+    DX7Sysex fixed = *sysex;
+    FixHeader(&fixed);
+    entry.newChecksum = fixed.checksum;
+    if (fsize == sysexSize)
+    {
+        const unsigned char *oldBytes = (const unsigned char *)sysex;
+        const unsigned char *newBytes = (const unsigned char *)&fixed;
+        for (unsigned i = 0; i < 6; i++)
+        {
+            if (oldBytes[i] == newBytes[i])
+                continue;
+            char change[16];
+            sprintf(change, "%s%u:%2.2X>%2.2X", entry.changes.empty() ? "" : " ",
+                    i, oldBytes[i], newBytes[i]);
+            entry.changes += change;
+            entry.classes |= REPAIR_HEADER;
+        }
+        if (fixed.checksum != sysex->checksum)
+            entry.classes |= REPAIR_CHECKSUM;
+    }
+    if (undoJournal == NULL || fsize != sysexSize)
+        *sysex = fixed;
+    return entry.classes != 0;
+}
+
+/*! Repair worker: plan (and fix) the files with the next free index.
+ *
+ *  \param files filenames
+ *  \param entries repair entries of the files
+ *  \param next index of the next file
+ *  \param options a pointer to the options of the command line
+ */
+void RepairWorker(const std::vector<std::string> *files, std::vector<RepairEntry> *entries,
+                  std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < files->size(); i = (*next)++)
+    {
+        RepairEntry &entry = (*entries)[i];
+        entry.fixed = entry.failed = false;
+        const char *filename = (*files)[i].c_str();
+        if (PlanRepair(filename, entry) && !dryRun)
+        {
+            // headerless dumps can't be patched in place, they get a header
+            const bool inPlace = undoJournal && fsize == sysexSize;
+            if ((inPlace ? FixFileInPlace((DX7Sysex *)buffer, filename)
+                         : FixFile((DX7Sysex *)buffer, filename)) == 0)
+                entry.fixed = true;
+            else
+                entry.failed = true;
+        }
+    }
+}
+
+/*! Check and repair files and directory trees with a pool of workers.
+ *
+ *  The plan lists every file with an error: path, error classes, old and new
+ *  checksum, and the header bytes to change. With --dry-run the files are
+ *  left untouched.
+ *
+ *  \param argc argument count
+ *  \param argv files and directories
+ *  \return 0 if all fixable files were fixed
+ */
+int RunRepair(int argc, char **argv)
+{
+    std::vector<std::string> files;
+    for (int i = 0; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], files);
+        else
+            files.push_back(argv[i]);
+    }
+
+    FILE *plan = (strcmp(repairPlan, "-") == 0) ? stdout : fopen(repairPlan, "w");
+    if (plan == NULL)
+    {
+        fprintf(out, "Can't open the file for writing: %s. %s\n", repairPlan, strerror(errno));
+        return 1;
+    }
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    std::vector<RepairEntry> entries(files.size());
+    std::atomic<unsigned> next(0);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(RepairWorker, &files, &entries, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    static const char *classNames[] = { "checksum", "header", "headerless", "single", "unfixable" };
+    unsigned counts[5] = {};
+    unsigned okFiles = 0, fixedFiles = 0, failedFiles = 0;
+    for (unsigned i = 0; i < files.size(); i++)
+    {
+        const RepairEntry &entry = entries[i];
+        if (entry.classes == 0)
+        {
+            okFiles++;
+            continue;
+        }
+        fixedFiles += entry.fixed;
+        failedFiles += entry.failed;
+
+        std::string classes;
+        for (unsigned c = 0; c < 5; c++)
+        {
+            if ((entry.classes & (1u << c)) == 0)
+                continue;
+            counts[c]++;
+            if (!classes.empty())
+                classes += ',';
+            classes += classNames[c];
+        }
+        char oldChecksum[12] = "-", newChecksum[12] = "-";
+        if (entry.oldChecksum >= 0)
+            snprintf(oldChecksum, sizeof(oldChecksum), "%2.2X", entry.oldChecksum);
+        if (entry.newChecksum >= 0)
+            snprintf(newChecksum, sizeof(newChecksum), "%2.2X", entry.newChecksum);
+        fprintf(plan, "%s\t%s\t%s\t%s\t%s\n", files[i].c_str(), classes.c_str(), oldChecksum,
+                newChecksum, entry.message.empty() ? entry.changes.c_str() : entry.message.c_str());
+    }
+    if (plan != stdout && fclose(plan) != 0)
+        fprintf(out, "Error writing to file: %s. %s\n", repairPlan, strerror(errno));
+
+    if (fsyncPolicy == FSYNC_END)
+        failedFiles += SyncWrittenFiles();
+
+    fprintf(out, "%zu files: %u ok, %u checksum errors, %u header errors, %u headerless, "
+            "%u single voice checksum errors (not fixed), %u unfixable\n",
+            files.size(), okFiles, counts[0], counts[1], counts[2], counts[3], counts[4]);
+    if (dryRun)
+        PutLine("Dry run: no files changed.");
+    else
+        fprintf(out, "%u files fixed, %u failed\n", fixedFiles, failedFiles);
+    if (fixCount > 0)
+    {
+        fprintf(out, "Rewritten files: %lu bytes written (full rewrite: %lu bytes), "
+                "%lu bytes shared by reflinks\n",
+                fixWrittenBytes.load(), (unsigned long)fixCount * sysexSize, fixSharedBytes.load());
+        fprintf(out, "Backups: %u reflinks, %u hard links. Time: %lu ms (%lu us per file)\n",
+                clonedBackups.load(), linkedBackups.load(), fixMicroseconds / 1000,
+                fixMicroseconds / fixCount);
+    }
+    return failedFiles ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Bulk edit (--set, --where)
+
+//! A parameter assignment of option "--set".
+struct EditAssignment
+{
+    std::vector<unsigned> offsets;  // offsets in VoiceUnpacked, 6 for "op*."
+    unsigned char value;
+};
+
+//! A condition of option "--where".
+struct EditCondition
+{
+    std::vector<unsigned> offsets;  // offsets in VoiceUnpacked, any of them matches
+    char op;                        // = ! < l (<=) > g (>=), ~ (name contains text)
+    unsigned value;
+    std::string text;
+};
+
+//! compiled options "--set" and "--where"
+std::vector<EditAssignment> editAssignments;
+std::vector<EditCondition> editConditions;
+
+//! Edit plan and result of one file.
+struct EditEntry
+{
+    unsigned matched;               // voices matching --where
+    unsigned changed;               // voices changed
+    std::vector<unsigned> offsets;  // changed bytes of the file (ascending)
+    std::vector<unsigned char> oldBytes;
+    std::vector<unsigned char> newBytes;
+    std::string message;            // reason for skipped files
+    bool failed;
+};
+
+/*! Find the offsets of a parameter. "op*." stands for all 6 operators.
+ *
+ *  \param fieldName parameter name
+ *  \param offsets vector the offsets in VoiceUnpacked are appended to
+ *  \return description of the parameter, NULL if unknown
+ */
+const ParamField *FindEditField(const std::string &fieldName, std::vector<unsigned> &offsets)
+{
+    const ParamField *field = NULL;
+    if (fieldName.compare(0, 4, "op*.") == 0)
+    {
+        std::string opName = fieldName;
+        for (char n = '1'; n <= '6'; n++)
+        {
+            opName[2] = n;
+            const int offset = FindParamField(opName.c_str(), opName.size(), &field);
+            if (offset < 0)
+                return NULL;
+            offsets.push_back(offset);
+        }
+        return field;
+    }
+    const int offset = FindParamField(fieldName.c_str(), fieldName.size(), &field);
+    if (offset < 0)
+        return NULL;
+    offsets.push_back(offset);
+    return field;
+}
+
+/*! Convert the text of a parameter value. Values are numbers as stored in
+ *  the voice, transpose and breakpoint also take note names (C3, A-1).
+ *
+ *  \param field description of the parameter
+ *  \param text value text
+ *  \param value set to the value
+ *  \param error set to the error message
+ *  \return 0 if ok
+ */
+int ParseEditValue(const ParamField *field, const std::string &text, unsigned &value, std::string &error)
+{
+    char *end;
+    value = strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end != 0)
+    {
+        const ValueText *notes = NULL;
+        unsigned count = 0;
+        if (strcmp(field->name, "transpose") == 0)
+        {
+            notes = transposeTable.values;
+            count = 49;
+        }
+        else if (strcmp(field->name, "levelScalingBreakPoint") == 0)
+        {
+            notes = breakpointTable.values;
+            count = 100;
+        }
+        for (value = 0; value < count && strcasecmp(notes[value].text, text.c_str()) != 0; value++)
+            ;
+        if (value == count)
+        {
+            error = "invalid value for " + std::string(field->name) + ": " + text;
+            return 1;
+        }
+    }
+    if (value > field->max)
+    {
+        error = "value out of range for " + std::string(field->name) + ": " + text +
+                " (max. " + std::to_string(field->max) + ")";
+        return 1;
+    }
+    return 0;
+}
+
+/*! Compile the options "--set" and "--where".
+ *
+ *  \param error set to the error message
+ *  \return 0 if ok
+ */
+int CompileEdit(std::string &error)
+{
+    for (unsigned i = 0; i < editSets.size(); i++)
+    {
+        const std::string &set = editSets[i];
+        const size_t eq = set.find('=');
+        EditAssignment assignment;
+        const ParamField *field = FindEditField(set.substr(0, eq), assignment.offsets);
+        if (eq == std::string::npos || field == NULL)
+        {
+            error = "unknown parameter: " + set.substr(0, eq);
+            return 1;
+        }
+        unsigned value;
+        if (ParseEditValue(field, set.substr(eq + 1), value, error))
+            return 1;
+        assignment.value = value;
+        editAssignments.push_back(assignment);
+    }
+
+    // comma separated conditions: FIELD op VALUE, or name~TEXT
+    const std::string where = editWhere ? editWhere : "";
+    for (size_t begin = 0; begin < where.size(); )
+    {
+        size_t end = where.find(',', begin);
+        if (end == std::string::npos)
+            end = where.size();
+        const std::string condition = where.substr(begin, end - begin);
+        begin = end + 1;
+
+        const size_t pos = condition.find_first_of("=!<>~");
+        if (pos == std::string::npos || pos == 0)
+        {
+            error = "invalid condition: " + condition;
+            return 1;
+        }
+        EditCondition c;
+        const std::string fieldName = condition.substr(0, pos);
+        const bool equal = pos + 1 < condition.size() && condition[pos + 1] == '=';
+        c.op = condition[pos];
+        if (c.op == '<' && equal)
+            c.op = 'l';
+        else if (c.op == '>' && equal)
+            c.op = 'g';
+        else if (c.op == '!' && !equal)
+            c.op = 0;
+        const std::string value = condition.substr(pos + ((c.op == 'l' || c.op == 'g' || c.op == '!') ? 2 : 1));
+        if (c.op == '~')
+        {
+            if (fieldName != "name")
+            {
+                error = "~ is only supported for name: " + condition;
+                return 1;
+            }
+            c.text = value;
+            editConditions.push_back(c);
+            continue;
+        }
+        const ParamField *field = FindEditField(fieldName, c.offsets);
+        if (c.op == 0 || field == NULL)
+        {
+            error = "invalid condition: " + condition;
+            return 1;
+        }
+        if (ParseEditValue(field, value, c.value, error))
+            return 1;
+        editConditions.push_back(c);
+    }
+    return 0;
+}
+
+/*! Check a voice against the conditions of option "--where".
+ *
+ *  \param voice a pointer to the unpacked voice data
+ *  \return true if all conditions match
+ */
+bool EditMatches(const VoiceUnpacked *voice)
+{
+    const unsigned char *data = (const unsigned char *)voice;
+    for (unsigned i = 0; i < editConditions.size(); i++)
+    {
+        const EditCondition &c = editConditions[i];
+        if (c.op == '~')
+        {
+            char nameAscii[11];
+            for (unsigned n = 0; n < 10; n++)
+                nameAscii[n] = lcdTableAscii[voice->name[n] & 0x7F];
+            nameAscii[10] = 0;
+            if (strcasestr(nameAscii, c.text.c_str()) == NULL)
+                return false;
+            continue;
+        }
+        bool match = false;
+        for (unsigned o = 0; o < c.offsets.size() && !match; o++)
+        {
+            const unsigned x = data[c.offsets[o]];
+            switch (c.op)
+            {
+            case '=': match = x == c.value; break;
+            case '!': match = x != c.value; break;
+            case '<': match = x < c.value; break;
+            case 'l': match = x <= c.value; break;
+            case '>': match = x > c.value; break;
+            case 'g': match = x >= c.value; break;
+            }
+        }
+        if (!match)
+            return false;
+    }
+    return true;
+}
+
+/*! Apply the assignments of option "--set" to a voice.
+ *
+ *  \param voice a pointer to the unpacked voice data
+ */
+void EditVoice(VoiceUnpacked *voice)
+{
+    unsigned char *data = (unsigned char *)voice;
+    for (unsigned i = 0; i < editAssignments.size(); i++)
+    {
+        for (unsigned o = 0; o < editAssignments[i].offsets.size(); o++)
+            data[editAssignments[i].offsets[o]] = editAssignments[i].value;
+    }
+}
+
+/*! Load a file, edit its voices in the file data buffer, and list the
+ *  changed bytes. Banks must be ok (no --fix needed) to be edited.
+ *
+ *  \param filename a pointer to the filename
+ *  \param entry edit entry of the file
+ *  \return true if the file has changed
+ */
+bool PlanEdit(const char *filename, EditEntry &entry)
+{
+    entry.matched = entry.changed = 0;
+    entry.offsets.clear();
+    entry.oldBytes.clear();
+    entry.newBytes.clear();
+    entry.message.clear();
+
+    ResetFileState();
+    if (LoadFile(filename, true) || !fileReadOk)
+    {
+        entry.message = fsize < 0 ? strerror(loadError) : "File read error";
+        return false;
+    }
+    unsigned char original[sysexSize];
+    memcpy(original, buffer, sizeof(original));
+
+    if (fsize == sysexSize)
+    {
+        DX7Sysex *sysex = (DX7Sysex *)buffer;
+        if (Verify(sysex) != 0 || fixNeeded)
+        {
+            entry.message = fixNeeded ? "needs --fix or --repair" : msgBuffer;
+            entry.message.erase(entry.message.find_last_not_of('\n') + 1);
+            return false;
+        }
+        for (unsigned voiceNum = 0; voiceNum < 32; voiceNum++)
+        {
+            if (patch >= 0 && (unsigned)patch != voiceNum)
+                continue;
+            VoiceUnpacked voice;
+            UnpackVoice(&voice, &sysex->voices[voiceNum]);
+            if (!EditMatches(&voice))
+                continue;
+            entry.matched++;
+            EditVoice(&voice);
+            VoicePacked packed = sysex->voices[voiceNum];
+            PackVoice(&packed, &voice);
+            if (memcmp(&packed, &sysex->voices[voiceNum], sizeof(packed)) != 0)
+            {
+                sysex->voices[voiceNum] = packed;
+                entry.changed++;
+            }
+        }
+        sysex->checksum = Checksum(sysex);
+    }
+    else if (fsize == singleSysexSize)
+    {
+        DX7SingleSysex *single = (DX7SingleSysex *)buffer;
+        if (VerifySingle(single) != 0 || msgBuffer[0] != 0)
+        {
+            entry.message = msgBuffer[0] ? "Single voice checksum error" : "Corrupt single voice dump";
+            return false;
+        }
+        if (EditMatches(&single->voice))
+        {
+            entry.matched++;
+            const VoiceUnpacked voice = single->voice;
+            EditVoice(&single->voice);
+            if (memcmp(&voice, &single->voice, sizeof(voice)) != 0)
+                entry.changed++;
+            single->checksum = ChecksumSingle(&single->voice, sizeof(VoiceUnpacked));
+        }
+    }
+    else
+    {
+        char message[40];
+        sprintf(message, "File size %d Bytes", fsize);
+        entry.message = (fsize == rawDataSize) ? "headerless bank, needs --fix or --repair" : message;
+        return false;
+    }
+
+    for (int i = 0; i < fsize; i++)
+    {
+        if (original[i] == buffer[i])
+            continue;
+        entry.offsets.push_back(i);
+        entry.oldBytes.push_back(original[i]);
+        entry.newBytes.push_back(buffer[i]);
+    }
+    return !entry.offsets.empty();
+}
+
+/*! Write bytes into a file, adjacent bytes with one pwrite.
+ *
+ *  \param fd file descriptor
+ *  \param values the bytes to write, one per offset
+ *  \param offsets offsets of the bytes (ascending)
+ *  \param count number of offsets
+ *  \return 0 if ok
+ */
+int PatchValues(int fd, const unsigned char *values, const unsigned *offsets, unsigned count)
+{
+    for (unsigned i = 0; i < count; )
+    {
+        unsigned n = 1;
+        while (i + n < count && offsets[i + n] == offsets[i] + n)
+            n++;
+        if (pwrite(fd, values + i, n, offsets[i]) != (ssize_t)n)
+            return 1;
+        i += n;
+    }
+    return 0;
+}
+
+/*! Edit worker, first pass: plan the edits of the files with the next free
+ *  index.
+ *
+ *  \param files filenames
+ *  \param entries edit entries of the files
+ *  \param next index of the next file
+ *  \param options a pointer to the options of the command line
+ */
+void EditWorker(const std::vector<std::string> *files, std::vector<EditEntry> *entries,
+                std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < files->size(); i = (*next)++)
+    {
+        (*entries)[i].failed = false;
+        PlanEdit((*files)[i].c_str(), (*entries)[i]);
+    }
+}
+
+/*! Edit worker, second pass (after the journal is committed): write the
+ *  changed bytes of the files with the next free index.
+ *
+ *  \param files filenames
+ *  \param entries edit entries of the files
+ *  \param next index of the next file
+ *  \param options a pointer to the options of the command line
+ */
+void CommitWorker(const std::vector<std::string> *files, std::vector<EditEntry> *entries,
+                  std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < files->size(); i = (*next)++)
+    {
+        EditEntry &entry = (*entries)[i];
+        if (entry.offsets.empty())
+            continue;
+        const char *filename = (*files)[i].c_str();
+        const int fd = open(filename, O_WRONLY);
+        if (fd < 0 || PatchValues(fd, entry.newBytes.data(), entry.offsets.data(), entry.offsets.size()) ||
+            (fsyncPolicy == FSYNC_ALWAYS && fdatasync(fd) != 0))
+        {
+            entry.failed = true;
+            entry.message = strerror(errno);
+        }
+        if (fd >= 0 && close(fd) != 0 && !entry.failed)
+        {
+            entry.failed = true;
+            entry.message = strerror(errno);
+        }
+        if (!entry.failed)
+            FileWritten(filename, false);
+    }
+}
+
+/*! Append text to the journal and sync it unless the fsync policy is never.
+ *
+ *  \param fd file descriptor of the journal
+ *  \param text text to append
+ *  \return 0 if ok
+ */
+int WriteJournal(int fd, const std::string &text)
+{
+    if (write(fd, text.data(), text.size()) != (ssize_t)text.size())
+        return 1;
+    return (fsyncPolicy != FSYNC_NEVER && fdatasync(fd) != 0) ? 1 : 0;
+}
+
+/*! Change voice parameters of files and directory trees with a pool of
+ *  workers.
+ *
+ *  The changes are planned for all files first. The changed bytes of all
+ *  files are written to the journal, followed by COMMIT. Then the files are
+ *  patched in parallel and END is appended to the journal. A run interrupted
+ *  after COMMIT is completed by --resume or rolled back by --undo.
+ *
+ *  Journal: BEGIN, one line per file (like --in-place), COMMIT, END
+ *
+ *  \param argc argument count
+ *  \param argv files and directories
+ *  \return 0 if all files were edited
+ */
+int RunEdit(int argc, char **argv)
+{
+    std::string error;
+    if (CompileEdit(error))
+    {
+        fprintf(out, "Invalid --set or --where: %s\n", error.c_str());
+        return 1;
+    }
+    if (editJournal == NULL && !dryRun)
+    {
+        PutLine("Option --set needs --journal (or --dry-run).");
+        return 1;
+    }
+
+    int journal = -1;
+    if (!dryRun)
+    {
+        // the journal of an interrupted run must not be overwritten
+        std::vector<std::string> entries;
+        JournalState state;
+        if (ReadJournal(editJournal, entries, state) == 0 && state == JOURNAL_COMMITTED)
+        {
+            fprintf(out, "The journal %s belongs to an interrupted run. Use --resume or --undo first.\n",
+                    editJournal);
+            return 1;
+        }
+        journal = open(editJournal, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (journal < 0)
+        {
+            fprintf(out, "Can't open the journal: %s. %s\n", editJournal, strerror(errno));
+            return 1;
+        }
+    }
+
+    std::vector<std::string> files;
+    for (int i = 0; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], files);
+        else
+            files.push_back(argv[i]);
+    }
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::vector<EditEntry> entries(files.size());
+    std::vector<std::thread> pool;
+    std::atomic<unsigned> next(0);
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(EditWorker, &files, &entries, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    unsigned changedFiles = 0, skippedFiles = 0, matchedVoices = 0, changedVoices = 0;
+    unsigned long changedBytes = 0;
+    std::string text = "BEGIN\n";
+    bool ok = true;
+    for (unsigned i = 0; i < files.size(); i++)
+    {
+        const EditEntry &entry = entries[i];
+        matchedVoices += entry.matched;
+        changedVoices += entry.changed;
+        if (!entry.message.empty())
+        {
+            fprintf(out, "%s: skipped (%s)\n", files[i].c_str(), entry.message.c_str());
+            skippedFiles++;
+            continue;
+        }
+        if (entry.offsets.empty())
+            continue;
+        fprintf(out, "%s: %u voice%s changed\n", files[i].c_str(), entry.changed,
+                entry.changed == 1 ? "" : "s");
+        changedFiles++;
+        changedBytes += entry.offsets.size();
+
+        text += files[i];
+        text += '\t';
+        for (unsigned b = 0; b < entry.offsets.size(); b++)
+        {
+            char change[16];
+            sprintf(change, "%s%u:%2.2X>%2.2X", b ? " " : "", entry.offsets[b],
+                    entry.oldBytes[b], entry.newBytes[b]);
+            text += change;
+        }
+        text += '\n';
+        if (journal >= 0 && text.size() > 1 << 20)
+        {
+            ok = ok && write(journal, text.data(), text.size()) == (ssize_t)text.size();
+            text.clear();
+        }
+    }
+    fprintf(out, "%zu files: %u changed, %u skipped. %u voices matching, %u changed (%lu bytes)\n",
+            files.size(), changedFiles, skippedFiles, matchedVoices, changedVoices, changedBytes);
+    if (dryRun)
+    {
+        PutLine("Dry run: no files changed.");
+        return skippedFiles ? 1 : 0;
+    }
+
+    // all entries must be on disk before COMMIT, and COMMIT before any file is changed
+    if (!ok || WriteJournal(journal, text) || WriteJournal(journal, "COMMIT\n"))
+    {
+        fprintf(out, "Error writing to the journal: %s. %s\n", editJournal, strerror(errno));
+        close(journal);
+        return 1;
+    }
+
+    next = 0;
+    pool.clear();
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(CommitWorker, &files, &entries, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    unsigned failedFiles = 0;
+    for (unsigned i = 0; i < files.size(); i++)
+    {
+        if (!entries[i].failed)
+            continue;
+        fprintf(out, "Error writing to file: %s. %s\n", files[i].c_str(), entries[i].message.c_str());
+        failedFiles++;
+    }
+    if (fsyncPolicy == FSYNC_END)
+        failedFiles += SyncWrittenFiles();
+
+    // a failed file is left to --resume
+    if (failedFiles == 0 && WriteJournal(journal, "END\n"))
+        fprintf(out, "Error writing to the journal: %s. %s\n", editJournal, strerror(errno));
+    close(journal);
+    fprintf(out, "%u files written, %u failed. Journal: %s\n", changedFiles - failedFiles, failedFiles,
+            editJournal);
+    return (failedFiles || skippedFiles) ? 1 : 0;
+}
+
+/*! Complete an interrupted bulk edit: write the new bytes of all files of
+ *  the committed transaction in the journal. A byte is only written if the
+ *  file holds the old or the new value.
+ *
+ *  \param journal a pointer to the filename of the journal
+ *  \return 0 if ok
+ */
+int ResumeJournal(const char *journal)
+{
+    std::vector<std::string> lines;
+    JournalState state;
+    if (ReadJournal(journal, lines, state))
+    {
+        fprintf(out, "Can't open the journal: %s. %s\n", journal, strerror(errno));
+        return 1;
+    }
+    if (state != JOURNAL_COMMITTED)
+    {
+        fprintf(out, "Nothing to resume: %s\n", state == JOURNAL_CLOSED ? "the run is complete or rolled back"
+                : (state == JOURNAL_OPEN ? "the run was not committed, no file was changed"
+                                         : "not the journal of a --set run"));
+        return 0;
+    }
+
+    unsigned written = 0, complete = 0, conflicts = 0, errors = 0;
+    for (size_t l = 0; l < lines.size(); l++)
+    {
+        const std::string &entry = lines[l];
+        const size_t tab = entry.rfind('\t');
+        const std::string path = entry.substr(0, tab);
+        const int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0)
+        {
+            fprintf(out, "Can't open the file: %s. %s\n", path.c_str(), strerror(errno));
+            errors++;
+            continue;
+        }
+        const char *p = entry.c_str() + tab + 1;
+        unsigned offset, oldByte, newByte;
+        int n;
+        bool changed = false, conflict = false, failed = false;
+        while (!failed && sscanf(p, "%u:%2X>%2X%n", &offset, &oldByte, &newByte, &n) == 3)
+        {
+            p += n;
+            unsigned char current;
+            errno = 0;
+            if (pread(fd, &current, 1, offset) != 1)
+            {
+                // e.g. a truncated file
+                fprintf(out, "Can't read the file: %s. %s\n", path.c_str(),
+                        errno ? strerror(errno) : "File too short");
+                failed = true;
+                break;
+            }
+            if (current == newByte)
+                continue;
+            if (current != oldByte)
+            {
+                conflict = true;
+                continue;
+            }
+            const unsigned char value = newByte;
+            if (pwrite(fd, &value, 1, offset) != 1)
+            {
+                fprintf(out, "Error writing to file: %s. %s\n", path.c_str(), strerror(errno));
+                failed = true;
+                break;
+            }
+            changed = true;
+        }
+        const bool synced = fsyncPolicy != FSYNC_ALWAYS || !changed || fdatasync(fd) == 0;
+        if ((close(fd) != 0 || !synced) && !failed)
+        {
+            fprintf(out, "Error writing to file: %s. %s\n", path.c_str(), strerror(errno));
+            failed = true;
+        }
+        if (changed && !failed)
+            FileWritten(path, false);
+        if (conflict)
+        {
+            fprintf(out, "%s: changed by someone else, not completed\n", path.c_str());
+            conflicts++;
+        }
+        if (failed)
+            errors++;
+        else if (changed)
+            written++;
+        else if (!conflict)
+            complete++;
+    }
+    if (fsyncPolicy == FSYNC_END)
+        errors += SyncWrittenFiles();
+
+    if (errors == 0 && conflicts == 0)
+    {
+        const int fd = open(journal, O_WRONLY | O_APPEND);
+        if (fd < 0 || WriteJournal(fd, "END\n"))
+            fprintf(out, "Error writing to the journal: %s. %s\n", journal, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+    }
+    fprintf(out, "%u files written, %u already complete, %u conflicts, %u errors\n", written, complete,
+            conflicts, errors);
+    return (errors || conflicts) ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Split banks and merge single voices (--split, --merge)
+
+/*! Set a voice to the initial voice of the DX7 (INIT VOICE).
+ *
+ *  \param voice a pointer to the unpacked voice data
+ */
+void InitVoice(VoiceUnpacked *voice)
+{
+    memset(voice, 0, sizeof(VoiceUnpacked));
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        OperatorUnpacked &op = voice->op[i];
+        op.EG_R1 = op.EG_R2 = op.EG_R3 = op.EG_R4 = 99;
+        op.EG_L1 = op.EG_L2 = op.EG_L3 = 99;
+        op.levelScalingBreakPoint = 39;     // C3
+        op.frequencyCoarse = 1;
+        op.detune = 7;
+    }
+    voice->op[5].outputLevel = 99;          // only OP1 is audible
+    voice->pitchEGR1 = voice->pitchEGR2 = voice->pitchEGR3 = voice->pitchEGR4 = 99;
+    voice->pitchEGL1 = voice->pitchEGL2 = voice->pitchEGL3 = voice->pitchEGL4 = 50;
+    voice->oscKeySync = 1;
+    voice->lfoSpeed = 35;
+    voice->lfoSync = 1;
+    voice->lfoPitchModSensitivity = 3;
+    voice->transpose = 24;                  // C3
+    memcpy(voice->name, "INIT VOICE", 10);
+}
+
+/*! Create a directory and its missing parents.
+ *
+ *  \param dir path of the directory
+ *  \return 0 if the directory exists
+ */
+int MakeDirectories(const std::string &dir)
+{
+    if (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST)
+        return 0;
+    const size_t slash = dir.find_last_of('/');
+    if (errno != ENOENT || slash == std::string::npos || slash == 0)
+        return 1;
+    if (MakeDirectories(dir.substr(0, slash)))
+        return 1;
+    return (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST) ? 0 : 1;
+}
+
+/*! Write a file into a directory. The file is created unnamed (O_TMPFILE)
+ *  and linked into the directory when it is complete, so a half-written
+ *  file is never visible. An existing file is replaced. On filesystems
+ *  without O_TMPFILE the file is written directly.
+ *
+ *  \param dirFd file descriptor of the directory
+ *  \param filename filename in the directory
+ *  \param data a pointer to the file data
+ *  \param size size of the file
+ *  \return 0 if ok
+ */
+int WriteFileAt(int dirFd, const char *filename, const void *data, size_t size)
+{
+    int fd = openat(dirFd, ".", O_TMPFILE | O_WRONLY, 0644);
+    if (fd >= 0)
+    {
+        char path[32];
+        sprintf(path, "/proc/self/fd/%d", fd);
+        bool ok = write(fd, data, size) == (ssize_t)size &&
+                  (fsyncPolicy != FSYNC_ALWAYS || fdatasync(fd) == 0);
+        if (ok && linkat(AT_FDCWD, path, dirFd, filename, AT_SYMLINK_FOLLOW) != 0)
+        {
+            // linkat doesn't replace: link under a temporary name and rename
+            const std::string temp = std::string(".") + filename + ".tmp";
+            ok = errno == EEXIST && (unlinkat(dirFd, temp.c_str(), 0) == 0 || errno == ENOENT) &&
+                 linkat(AT_FDCWD, path, dirFd, temp.c_str(), AT_SYMLINK_FOLLOW) == 0 &&
+                 renameat(dirFd, temp.c_str(), dirFd, filename) == 0;
+        }
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return ok ? 0 : 1;
+    }
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+        return 1;
+
+    fd = openat(dirFd, filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 1;
+    bool ok = write(fd, data, size) == (ssize_t)size &&
+              (fsyncPolicy != FSYNC_ALWAYS || fdatasync(fd) == 0);
+    ok = (close(fd) == 0) && ok;
+    return ok ? 0 : 1;
+}
+
+/*! Build the filename of a single voice: voice number and name, characters
+ *  that are unsafe in filenames are replaced by '_'.
+ *
+ *  \param filename buffer (20 characters) the filename is written to
+ *  \param voiceNum voice number (0..31)
+ *  \param voice a pointer to the unpacked voice data
+ */
+void SingleVoiceFilename(char *filename, unsigned voiceNum, const VoiceUnpacked *voice)
+{
+    char nameAscii[11];
+    for (unsigned i = 0; i < 10; i++)
+    {
+        const char c = lcdTableAscii[voice->name[i] & 0x7F];
+        nameAscii[i] = (isalnum(c) || c == '-' || c == '+' || c == '#' || c == '.') ? c : '_';
+    }
+    unsigned len = 10;
+    while (len > 0 && nameAscii[len - 1] == '_')
+        len--;
+    nameAscii[len] = 0;
+    sprintf(filename, "%02u-%s.syx", voiceNum + 1, len ? nameAscii : "voice");
+}
+
+/*! Build a single voice dump.
+ *
+ *  \param single a pointer to the DX7SingleSysex data block to fill
+ *  \param voice a pointer to the unpacked voice data
+ */
+void MakeSingleSysex(DX7SingleSysex *single, const VoiceUnpacked *voice)
+{
+    single->sysexBeginF0 = 0xF0;
+    single->yamaha43 = 0x43;
+    single->subStatusAndChannel = 0;
+    single->format0 = 0;
+    single->sizeMSB = 0x01;
+    single->sizeLSB = 0x1B;
+    single->voice = *voice;
+    single->checksum = ChecksumSingle(voice, sizeof(VoiceUnpacked));
+    single->sysexEndF7 = 0xF7;
+}
+
+//! A bank to split: input file and output directory.
+struct SplitJob
+{
+    std::string path;
+    std::string dir;
+    unsigned written;
+    std::string message;        // reason for skipped or failed banks
+};
+
+//! number of voice files written by --split
+std::atomic<unsigned> splitVoices(0);
+
+/*! Split a bank into single voice dumps in the output directory of the job.
+ *
+ *  \param job bank and output directory
+ *  \return 0 if ok
+ */
+int SplitBank(SplitJob &job)
+{
+    job.written = 0;
+    job.message.clear();
+    ResetFileState();
+    if (LoadFile(job.path.c_str(), true) || !fileReadOk)
+    {
+        job.message = fsize < 0 ? strerror(loadError) : "File read error";
+        return 1;
+    }
+    if (fsize != sysexSize && fsize != rawDataSize)
+    {
+        job.message = (fsize == singleSysexSize) ? "not a bank" : "File size " + std::to_string(fsize) + " Bytes";
+        return 1;
+    }
+    const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+    if (fsize == sysexSize && (Verify(sysex) != 0 || Checksum(sysex) != sysex->checksum))
+    {
+        job.message = msgBuffer;
+        job.message.erase(job.message.find_last_not_of('\n') + 1);
+        return 1;
+    }
+    if (dryRun)
+    {
+        job.written = (patch == -1) ? 32 : 1;
+        return 0;
+    }
+
+    // one directory descriptor for all voices of the bank
+    if (MakeDirectories(job.dir))
+    {
+        job.message = std::string("Can't create the directory: ") + strerror(errno);
+        return 1;
+    }
+    const int dirFd = open(job.dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0)
+    {
+        job.message = std::string("Can't open the directory: ") + strerror(errno);
+        return 1;
+    }
+    for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+    {
+        if (patch != -1 && patch != (int)voiceNum)
+            continue;
+        VoiceUnpacked voice;
+        UnpackVoice(&voice, &sysex->voices[voiceNum]);
+        DX7SingleSysex single;
+        MakeSingleSysex(&single, &voice);
+        char filename[20];
+        SingleVoiceFilename(filename, voiceNum, &voice);
+        if (WriteFileAt(dirFd, filename, &single, sizeof(single)))
+        {
+            job.message = std::string("Error writing to file: ") + filename + ". " + strerror(errno);
+            break;
+        }
+        FileWritten(job.dir + "/" + filename, true);
+        job.written++;
+    }
+    close(dirFd);
+    splitVoices += job.written;
+    return job.message.empty() ? 0 : 1;
+}
+
+/*! Split worker: split the banks with the next free index.
+ *
+ *  \param jobs banks and output directories
+ *  \param next index of the next bank
+ *  \param options a pointer to the options of the command line
+ */
+void SplitWorker(std::vector<SplitJob> *jobs, std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < jobs->size(); i = (*next)++)
+        SplitBank((*jobs)[i]);
+}
+
+/*! Split banks and directory trees of banks into single voice dumps with a
+ *  pool of workers. The voices of a bank are written to a directory named
+ *  like the bank (relative to the given directory): DIR/BANK/NN-NAME.syx
+ *
+ *  \param argc argument count
+ *  \param argv files and directories
+ *  \param dir output directory
+ *  \return 0 if all banks were split
+ */
+int RunSplit(int argc, char **argv, const char *dir)
+{
+    std::vector<SplitJob> jobs;
+    for (int i = 0; i < argc; i++)
+    {
+        std::vector<std::string> files;
+        size_t base;
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            ScanDirectory(argv[i], files);
+            base = strlen(argv[i]) + 1;
+        }
+        else
+        {
+            files.push_back(argv[i]);
+            const char *slash = strrchr(argv[i], '/');
+            base = slash ? slash - argv[i] + 1 : 0;
+        }
+        for (unsigned f = 0; f < files.size(); f++)
+        {
+            SplitJob job;
+            job.path = files[f];
+            job.dir = std::string(dir) + "/" + files[f].substr(base);
+            if (IsSysexFilename(job.dir.c_str()))
+                job.dir.resize(job.dir.size() - 4);
+            jobs.push_back(job);
+        }
+    }
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    std::atomic<unsigned> next(0);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(SplitWorker, &jobs, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+    unsigned syncErrors = 0;
+    if (fsyncPolicy == FSYNC_END && !dryRun)
+        syncErrors = SyncWrittenFiles();
+
+    unsigned banks = 0, voices = 0, skipped = 0;
+    for (unsigned i = 0; i < jobs.size(); i++)
+    {
+        voices += jobs[i].written;
+        if (jobs[i].message.empty())
+        {
+            banks++;
+            continue;
+        }
+        fprintf(out, "%s: skipped (%s)\n", jobs[i].path.c_str(), jobs[i].message.c_str());
+        skipped++;
+    }
+    fprintf(out, "%u banks split into %u voice files, %u files skipped\n", banks, voices, skipped);
+    if (dryRun)
+        PutLine("Dry run: no files written.");
+    return (skipped || syncErrors) ? 1 : 0;
+}
+
+//! A single voice to merge, loaded and packed by a worker.
+struct MergeVoice
+{
+    VoicePacked voice;
+    std::string message;        // reason for skipped files
+};
+
+//! number of files loaded by the workers at once (bounds the memory use)
+const unsigned mergeChunkSize = 4096;
+
+/*! Merge worker: load and pack the single voice dumps with the next free
+ *  index.
+ *
+ *  \param files filenames
+ *  \param first index of the first file of the chunk
+ *  \param voices packed voices of the chunk
+ *  \param next index of the next voice in the chunk
+ *  \param options a pointer to the options of the command line
+ */
+void MergeWorker(const std::vector<std::string> *files, unsigned first, std::vector<MergeVoice> *voices,
+                 std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < voices->size(); i = (*next)++)
+    {
+        MergeVoice &v = (*voices)[i];
+        v.message.clear();
+        ResetFileState();
+        if (LoadFile((*files)[first + i].c_str(), true) || !fileReadOk)
+        {
+            v.message = fsize < 0 ? strerror(loadError) : "File read error";
+            continue;
+        }
+        const DX7SingleSysex *single = (const DX7SingleSysex *)buffer;
+        if (fsize != singleSysexSize)
+            v.message = "not a single voice dump";
+        else if (VerifySingle(single) != 0)
+            v.message = "Corrupt single voice dump";
+        else if (msgBuffer[0] != 0)
+            v.message = "Single voice checksum error";
+        else
+        {
+            memset(&v.voice, 0, sizeof(v.voice));
+            PackVoice(&v.voice, &single->voice);
+        }
+    }
+}
+
+/*! Build the filename of a merged bank: BANK for the first bank, then
+ *  BANK-2, BANK-3, ... (before the extension .syx).
+ *
+ *  \param bank filename given by --merge
+ *  \param index index of the bank
+ *  \return filename
+ */
+std::string MergeFilename(const std::string &bank, unsigned index)
+{
+    if (index == 0)
+        return bank;
+    const bool syx = IsSysexFilename(bank.c_str());
+    const std::string base = syx ? bank.substr(0, bank.size() - 4) : bank;
+    return base + "-" + std::to_string(index + 1) + (syx ? bank.substr(bank.size() - 4) : "");
+}
+
+/*! Write a merged bank. Unused voices are INIT VOICE.
+ *
+ *  \param sysex a pointer to the DX7Sysex data block with the voices
+ *  \param count number of voices in the bank
+ *  \param filename a pointer to the filename
+ *  \return 0 if ok
+ */
+int WriteMergedBank(DX7Sysex *sysex, unsigned count, const std::string &filename)
+{
+    VoiceUnpacked init;
+    InitVoice(&init);
+    for (unsigned voiceNum = count; voiceNum < 32; voiceNum++)
+    {
+        memset(&sysex->voices[voiceNum], 0, sizeof(VoicePacked));
+        PackVoice(&sysex->voices[voiceNum], &init);
+    }
+    FixHeader(sysex);
+
+    const size_t slash = filename.find_last_of('/');
+    const std::string dir = (slash == std::string::npos) ? "." : filename.substr(0, slash + 1);
+    const int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0 || WriteFileAt(dirFd, filename.c_str() + (slash == std::string::npos ? 0 : slash + 1),
+                                 sysex, sysexSize))
+    {
+        fprintf(out, "Error writing to file: %s. %s\n", filename.c_str(), strerror(errno));
+        if (dirFd >= 0)
+            close(dirFd);
+        return 1;
+    }
+    close(dirFd);
+    FileWritten(filename, true);
+    return 0;
+}
+
+/*! Merge single voice dumps (files and directory trees) into banks of 32
+ *  voices. The files are loaded in chunks by a pool of workers; the banks
+ *  are written in the order of the voices.
+ *
+ *  \param argc argument count
+ *  \param argv files and directories
+ *  \param bank filename of the first bank
+ *  \return 0 if all files were merged
+ */
+int RunMerge(int argc, char **argv, const char *bank)
+{
+    std::vector<std::string> files;
+    for (int i = 0; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], files);
+        else
+            files.push_back(argv[i]);
+    }
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    DX7Sysex sysex;
+    unsigned count = 0, banks = 0, voices = 0, skipped = 0, errors = 0;
+    std::vector<MergeVoice> chunk;
+    for (unsigned first = 0; first < files.size(); first += mergeChunkSize)
+    {
+        chunk.resize(std::min<size_t>(mergeChunkSize, files.size() - first));
+        std::atomic<unsigned> next(0);
+        std::vector<std::thread> pool;
+        for (unsigned i = 0; i < workers; i++)
+            pool.push_back(std::thread(MergeWorker, &files, first, &chunk, &next, &options));
+        for (unsigned i = 0; i < workers; i++)
+            pool[i].join();
+
+        for (unsigned i = 0; i < chunk.size(); i++)
+        {
+            if (!chunk[i].message.empty())
+            {
+                fprintf(out, "%s: skipped (%s)\n", files[first + i].c_str(), chunk[i].message.c_str());
+                skipped++;
+                continue;
+            }
+            sysex.voices[count++] = chunk[i].voice;
+            voices++;
+            if (count == 32)
+            {
+                if (!dryRun)
+                    errors += WriteMergedBank(&sysex, count, MergeFilename(bank, banks));
+                banks++;
+                count = 0;
+            }
+        }
+    }
+    if (count > 0)
+    {
+        if (!dryRun)
+            errors += WriteMergedBank(&sysex, count, MergeFilename(bank, banks));
+        banks++;
+    }
+    if (fsyncPolicy == FSYNC_END && !dryRun)
+        errors += SyncWrittenFiles();
+
+    fprintf(out, "%u voices merged into %u banks (%s", voices, banks, MergeFilename(bank, 0).c_str());
+    if (banks > 1)
+        fprintf(out, " .. %s", MergeFilename(bank, banks - 1).c_str());
+    fprintf(out, "), %u files skipped\n", skipped);
+    if (dryRun)
+        PutLine("Dry run: no files written.");
+    return (skipped || errors) ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Bank assembly (--assemble)
+
+//! Voices of one file matching --where, found by a worker.
+struct AssembleFile
+{
+    std::vector<VoicePacked> voices;
+    std::vector<uint64_t> hashes;
+    std::vector<unsigned char> slots;   // voice-# (1..32)
+    std::string message;        // reason for skipped files
+};
+
+/*! Assemble worker: find the matching voices of the files with the next
+ *  free index.
+ *
+ *  \param files filenames
+ *  \param first index of the first file of the chunk
+ *  \param results matching voices of the files of the chunk
+ *  \param next index of the next file in the chunk
+ *  \param options a pointer to the options of the command line
+ */
+void AssembleWorker(const std::vector<std::string> *files, unsigned first, std::vector<AssembleFile> *results,
+                    std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < results->size(); i = (*next)++)
+    {
+        AssembleFile &result = (*results)[i];
+        result.voices.clear();
+        result.hashes.clear();
+        result.slots.clear();
+        result.message.clear();
+        ResetFileState();
+        if (LoadFile((*files)[first + i].c_str(), true) || !fileReadOk)
+        {
+            result.message = fsize < 0 ? strerror(loadError) : "File read error";
+            continue;
+        }
+
+        if (fsize == singleSysexSize)
+        {
+            const DX7SingleSysex *single = (const DX7SingleSysex *)buffer;
+            unsigned mask[10];
+            if (VerifySingle(single) != 0 || msgBuffer[0] != 0)
+                result.message = msgBuffer[0] ? "Single voice checksum error" : "Corrupt single voice dump";
+            else if (FindOutOfRange(&single->voice, mask))
+                result.message = "parameters out of range (see --validate)";
+            else if (EditMatches(&single->voice))
+            {
+                VoicePacked packed;
+                memset(&packed, 0, sizeof(packed));
+                PackVoice(&packed, &single->voice);
+                result.voices.push_back(packed);
+                result.hashes.push_back(VoiceHash(&single->voice));
+                result.slots.push_back(1);
+            }
+            continue;
+        }
+        if (fsize != sysexSize && fsize != rawDataSize)
+        {
+            result.message = "File size " + std::to_string(fsize) + " Bytes";
+            continue;
+        }
+        const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+        if (fsize == sysexSize && (Verify(sysex) != 0 || Checksum(sysex) != sysex->checksum))
+        {
+            result.message = msgBuffer;
+            result.message.erase(result.message.find_last_not_of('\n') + 1);
+            continue;
+        }
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+        {
+            VoiceUnpacked voice;
+            UnpackVoice(&voice, &sysex->voices[voiceNum]);
+            if (!EditMatches(&voice))
+                continue;
+            result.voices.push_back(sysex->voices[voiceNum]);
+            result.hashes.push_back(VoiceHash(&voice));
+            result.slots.push_back(voiceNum + 1);
+        }
+    }
+}
+
+/*! Assemble banks from the voices matching --where in files and directory
+ *  trees (banks and single voice dumps). The files are searched in chunks
+ *  by a pool of workers, and each bank is written as soon as it has 32
+ *  voices, so the memory use doesn't depend on the number of matching
+ *  voices. With --unique, voices with the same sound as an earlier voice
+ *  (names are ignored) are dropped; only their hashes are kept.
+ *
+ *  \param argc argument count
+ *  \param argv files and directories
+ *  \param bank filename of the first bank
+ *  \return 0 if all banks were written
+ */
+int RunAssemble(int argc, char **argv, const char *bank)
+{
+    std::string error;
+    if (CompileEdit(error))
+    {
+        fprintf(out, "Invalid --where: %s\n", error.c_str());
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    for (int i = 0; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], files);
+        else
+            files.push_back(argv[i]);
+    }
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::unordered_set<uint64_t> seen;
+    DX7Sysex sysex;
+    unsigned count = 0, banks = 0, matched = 0, duplicates = 0, skipped = 0, errors = 0;
+    std::vector<AssembleFile> chunk;
+    for (unsigned first = 0; first < files.size(); first += mergeChunkSize)
+    {
+        chunk.resize(std::min<size_t>(mergeChunkSize, files.size() - first));
+        std::atomic<unsigned> next(0);
+        std::vector<std::thread> pool;
+        for (unsigned i = 0; i < workers; i++)
+            pool.push_back(std::thread(AssembleWorker, &files, first, &chunk, &next, &options));
+        for (unsigned i = 0; i < workers; i++)
+            pool[i].join();
+
+        for (unsigned i = 0; i < chunk.size(); i++)
+        {
+            const AssembleFile &result = chunk[i];
+            if (!result.message.empty())
+            {
+                fprintf(out, "%s: skipped (%s)\n", files[first + i].c_str(), result.message.c_str());
+                skipped++;
+                continue;
+            }
+            for (unsigned v = 0; v < result.voices.size(); v++)
+            {
+                matched++;
+                if (uniqueVoices && !seen.insert(result.hashes[v]).second)
+                {
+                    duplicates++;
+                    continue;
+                }
+                sysex.voices[count++] = result.voices[v];
+                if (count == 32)
+                {
+                    if (!dryRun)
+                        errors += WriteMergedBank(&sysex, count, MergeFilename(bank, banks));
+                    banks++;
+                    count = 0;
+                }
+            }
+        }
+    }
+    if (count > 0)
+    {
+        if (!dryRun)
+            errors += WriteMergedBank(&sysex, count, MergeFilename(bank, banks));
+        banks++;
+    }
+    if (fsyncPolicy == FSYNC_END && !dryRun)
+        errors += SyncWrittenFiles();
+
+    fprintf(out, "%zu files searched, %u files skipped. %u voices matching, %u duplicates dropped\n",
+            files.size(), skipped, matched, duplicates);
+    if (banks == 0)
+        PutLine("No voices found, no bank written.");
+    else
+    {
+        fprintf(out, "%u voices in %u banks (%s", matched - duplicates, banks, MergeFilename(bank, 0).c_str());
+        if (banks > 1)
+            fprintf(out, " .. %s", MergeFilename(bank, banks - 1).c_str());
+        PutLine(")");
+    }
+    if (dryRun)
+        PutLine("Dry run: no files written.");
+    return errors ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Defragmenter (--defrag)
+
+/*! Scale a parameter to 0..255 for the locality key.
+ *
+ *  \param sum sum of the parameter values of the operators
+ *  \param max maximum of the sum
+ *  \return scaled value
+ */
+inline unsigned ScaleKey(unsigned sum, unsigned max)
+{
+    return sum >= max ? 255 : sum * 255 / max;
+}
+
+/*! Build the locality key of a voice: the algorithm, followed by a Z-order
+ *  (Morton) interleaving of 7 characteristics of the sound, so that voices
+ *  with similar values end up next to each other when sorted.
+ *
+ *  \param voice a pointer to the packed voice data
+ *  \return sort key
+ */
+uint64_t LocalityKey(const VoicePacked *voice)
+{
+    unsigned level = 0, coarse = 0, attack = 0, release = 0, sustain = 0;
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        level += voice->op[i].outputLevel;
+        coarse += voice->op[i].frequencyCoarse;
+        attack += voice->op[i].EG_R1;
+        release += voice->op[i].EG_R4;
+        sustain += voice->op[i].EG_L3;
+    }
+    const unsigned modulation = std::max(voice->lfoPitchModDepth, voice->lfoAMDepth);
+    const unsigned dims[7] = {
+        ScaleKey(level, 6 * 99), ScaleKey(coarse, 6 * 31), ScaleKey(sustain, 6 * 99),
+        ScaleKey(attack, 6 * 99), ScaleKey(release, 6 * 99), ScaleKey(voice->feedback, 7),
+        ScaleKey(modulation, 99)
+    };
+    uint64_t key = voice->algorithm;
+    for (int bit = 7; bit >= 0; bit--)
+    {
+        for (unsigned d = 0; d < 7; d++)
+            key = (key << 1) | ((dims[d] >> bit) & 1);
+    }
+    return key;
+}
+
+//! A unique voice of the defragmenter.
+struct DefragVoice
+{
+    uint64_t key;
+    uint32_t index;             // index of first appearance
+    VoicePacked voice;
+};
+
+/*! Compare two voices by locality key, then by first appearance.
+ *
+ *  \return true if a is sorted before b
+ */
+bool DefragBefore(const DefragVoice &a, const DefragVoice &b)
+{
+    return a.key != b.key ? a.key < b.key : a.index < b.index;
+}
+
+/*! Repack the unique voices of files and directory trees (banks and single
+ *  voice dumps) into the minimal number of banks: BANK, BANK-2, ...
+ *
+ *  Voices are unique by their parameters without name (the first name is
+ *  kept) and sorted by LocalityKey(). The mapping BANK.map has one line per
+ *  voice: old path, old voice-#, new bank, new voice-#.
+ *
+ *  \param argc argument count
+ *  \param argv files and directories
+ *  \param bank filename of the first bank
+ *  \return 0 if ok
+ */
+int RunDefrag(int argc, char **argv, const char *bank)
+{
+    std::vector<std::string> files;
+    for (int i = 0; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], files);
+        else
+            files.push_back(argv[i]);
+    }
+
+    // unique voices, and the unique voice of every voice of every file
+    std::vector<DefragVoice> voices;
+    std::unordered_map<uint64_t, uint32_t> uniqueIndex;
+    std::vector<uint32_t> fileFirst(files.size() + 1, 0);
+    std::vector<uint32_t> voiceUnique;
+    std::vector<unsigned char> voiceSlot;
+    std::vector<bool> skippedFiles(files.size(), false);
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    unsigned skipped = 0;
+    std::vector<AssembleFile> chunk;
+    for (unsigned first = 0; first < files.size(); first += mergeChunkSize)
+    {
+        chunk.resize(std::min<size_t>(mergeChunkSize, files.size() - first));
+        std::atomic<unsigned> next(0);
+        std::vector<std::thread> pool;
+        for (unsigned i = 0; i < workers; i++)
+            pool.push_back(std::thread(AssembleWorker, &files, first, &chunk, &next, &options));
+        for (unsigned i = 0; i < workers; i++)
+            pool[i].join();
+
+        for (unsigned i = 0; i < chunk.size(); i++)
+        {
+            const AssembleFile &result = chunk[i];
+            fileFirst[first + i] = voiceUnique.size();
+            if (!result.message.empty())
+            {
+                fprintf(out, "%s: skipped (%s)\n", files[first + i].c_str(), result.message.c_str());
+                skippedFiles[first + i] = true;
+                skipped++;
+                continue;
+            }
+            for (unsigned v = 0; v < result.voices.size(); v++)
+            {
+                const std::pair<std::unordered_map<uint64_t, uint32_t>::iterator, bool> found =
+                    uniqueIndex.insert(std::make_pair(result.hashes[v], (uint32_t)voices.size()));
+                if (found.second)
+                {
+                    DefragVoice unique;
+                    unique.key = LocalityKey(&result.voices[v]);
+                    unique.index = voices.size();
+                    unique.voice = result.voices[v];
+                    voices.push_back(unique);
+                }
+                voiceUnique.push_back(found.first->second);
+                voiceSlot.push_back(result.slots[v]);
+            }
+        }
+    }
+    fileFirst[files.size()] = voiceUnique.size();
+
+    std::sort(voices.begin(), voices.end(), DefragBefore);
+    std::vector<uint32_t> position(voices.size());
+    for (unsigned i = 0; i < voices.size(); i++)
+        position[voices[i].index] = i;
+
+    const unsigned banks = (voices.size() + 31) / 32;
+    unsigned errors = 0;
+    if (!dryRun)
+    {
+        DX7Sysex sysex;
+        for (unsigned b = 0; b < banks; b++)
+        {
+            const unsigned count = std::min<size_t>(32, voices.size() - b * 32);
+            for (unsigned v = 0; v < count; v++)
+                sysex.voices[v] = voices[b * 32 + v].voice;
+            errors += WriteMergedBank(&sysex, count, MergeFilename(bank, b));
+        }
+
+        // mapping: old path, old voice-#, new bank, new voice-#
+        const std::string base = IsSysexFilename(bank) ? std::string(bank, strlen(bank) - 4) : bank;
+        const std::string mapName = base + ".map";
+        FILE *map = fopen(mapName.c_str(), "w");
+        if (map == NULL)
+        {
+            fprintf(out, "Can't open the file for writing: %s. %s\n", mapName.c_str(), strerror(errno));
+            return 1;
+        }
+        std::vector<std::string> bankNames(banks);
+        for (unsigned b = 0; b < banks; b++)
+            bankNames[b] = MergeFilename(bank, b);
+        for (unsigned f = 0; f < files.size(); f++)
+        {
+            for (unsigned v = fileFirst[f]; v < fileFirst[f + 1]; v++)
+            {
+                const uint32_t p = position[voiceUnique[v]];
+                fprintf(map, "%s\t%u\t%s\t%u\n", files[f].c_str(), voiceSlot[v],
+                        bankNames[p / 32].c_str(), p % 32 + 1);
+            }
+        }
+        if (fclose(map) != 0)
+        {
+            fprintf(out, "Error writing to file: %s. %s\n", mapName.c_str(), strerror(errno));
+            errors++;
+        }
+        FileWritten(mapName, true);
+        if (fsyncPolicy == FSYNC_END)
+            errors += SyncWrittenFiles();
+    }
+
+    fprintf(out, "%zu files, %u skipped. %zu voices: %zu unique, %zu duplicates\n", files.size(), skipped,
+            voiceUnique.size(), voices.size(), voiceUnique.size() - voices.size());
+    if (banks > 0)
+    {
+        fprintf(out, "%u banks (%s", banks, MergeFilename(bank, 0).c_str());
+        if (banks > 1)
+            fprintf(out, " .. %s", MergeFilename(bank, banks - 1).c_str());
+        PutLine(")");
+    }
+    if (dryRun)
+        PutLine("Dry run: no files written.");
+    return errors ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Structural diff (--diff)
+
+//! Voices of a file for --diff.
+struct FileVoices
+{
+    unsigned count;             // 32 for banks, 1 for single voice dumps
+    VoiceUnpacked voices[32];
+    uint64_t hashes[32];        // VoiceHash() of the voices
+    std::string message;        // reason why the file can't be compared
+};
+
+/*! Load the voices of a bank or single voice dump.
+ *
+ *  \param filename a pointer to the filename
+ *  \param file voices of the file
+ *  \return 0 if ok
+ */
+int LoadVoices(const char *filename, FileVoices &file)
+{
+    file.count = 0;
+    file.message.clear();
+    ResetFileState();
+    if (LoadFile(filename, true) || !fileReadOk)
+    {
+        file.message = fsize < 0 ? strerror(loadError) : "File read error";
+        return 1;
+    }
+    if (fsize == singleSysexSize)
+    {
+        const DX7SingleSysex *single = (const DX7SingleSysex *)buffer;
+        if (VerifySingle(single) != 0)
+        {
+            file.message = "Corrupt single voice dump";
+            return 1;
+        }
+        file.count = 1;
+        file.voices[0] = single->voice;
+    }
+    else if (fsize == sysexSize || fsize == rawDataSize)
+    {
+        // banks with a checksum error are compared anyway
+        const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+        if (fsize == sysexSize && Verify(sysex) != 0)
+        {
+            file.message = msgBuffer;
+            file.message.erase(file.message.find_last_not_of('\n') + 1);
+            return 1;
+        }
+        file.count = 32;
+        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+            UnpackVoice(&file.voices[voiceNum], &sysex->voices[voiceNum]);
+    }
+    else
+    {
+        file.message = "File size " + std::to_string(fsize) + " Bytes";
+        return 1;
+    }
+    for (unsigned i = 0; i < file.count; i++)
+        file.hashes[i] = VoiceHash(&file.voices[i]);
+    return 0;
+}
+
+/*! Decode a parameter value for the diff output.
+ *
+ *  \param text buffer (24 characters) for the decoded value
+ *  \param voice a pointer to the unpacked voice data
+ *  \param offset offset of the parameter in VoiceUnpacked
+ *  \return text, or NULL if there is nothing to decode
+ */
+const char *DecodeParam(char *text, const VoiceUnpacked *voice, unsigned offset)
+{
+    const unsigned x = ((const unsigned char *)voice)[offset];
+    const char *value = NULL;
+    if (offset < 6 * sizeof(OperatorUnpacked))
+    {
+        const OperatorUnpacked &op = voice->op[offset / sizeof(OperatorUnpacked)];
+        switch (offset % sizeof(OperatorUnpacked))
+        {
+        case offsetof(OperatorUnpacked, levelScalingBreakPoint):
+            value = Breakpoint(x);
+            break;
+        case offsetof(OperatorUnpacked, scaleLeftCurve):
+        case offsetof(OperatorUnpacked, scaleRightCurve):
+            value = Curve(x);
+            break;
+        case offsetof(OperatorUnpacked, oscillatorMode):
+        case offsetof(OperatorUnpacked, frequencyCoarse):
+        case offsetof(OperatorUnpacked, frequencyFine):
+            value = Frequency(op);
+            break;
+        case offsetof(OperatorUnpacked, detune):
+            sprintf(text, "%+d", (int)x - 7);
+            return text;
+        }
+    }
+    else
+    {
+        switch (offset)
+        {
+        case offsetof(VoiceUnpacked, algorithm):
+            sprintf(text, "%u", x + 1);
+            return text;
+        case offsetof(VoiceUnpacked, oscKeySync):
+        case offsetof(VoiceUnpacked, lfoSync):
+            value = OnOff(x);
+            break;
+        case offsetof(VoiceUnpacked, lfoWave):
+            value = LFOWave(x);
+            break;
+        case offsetof(VoiceUnpacked, transpose):
+            value = Transpose(x);
+            break;
+        }
+    }
+    if (value == NULL)
+        return NULL;
+    snprintf(text, 24, "%s", value + strspn(value, " "));
+    return text;
+}
+
+/*! Print the parameters that differ between two voices, operators first.
+ *
+ *  \param a a pointer to the old voice
+ *  \param b a pointer to the new voice
+ */
+void DiffParams(const VoiceUnpacked *a, const VoiceUnpacked *b)
+{
+    const unsigned char *oldBytes = (const unsigned char *)a;
+    const unsigned char *newBytes = (const unsigned char *)b;
+    for (unsigned opNum = 1; opNum <= 7; opNum++)
+    {
+        // operators are stored in backward order, opNum 7 = voice parameters
+        const unsigned base = (opNum <= 6) ? (6 - opNum) * sizeof(OperatorUnpacked) : 0;
+        const ParamField *fields = (opNum <= 6) ? operatorFields : voiceFields;
+        const unsigned count = (opNum <= 6) ? operatorFieldCount : voiceFieldCount;
+        for (unsigned i = 0; i < count; i++)
+        {
+            const unsigned offset = base + fields[i].offset;
+            if (oldBytes[offset] == newBytes[offset])
+                continue;
+            char fieldName[40], oldText[24], newText[24];
+            ParamFieldName(fieldName, offset);
+            fprintf(out, "    %s: %u > %u", fieldName, oldBytes[offset], newBytes[offset]);
+            if (DecodeParam(oldText, a, offset) && DecodeParam(newText, b, offset))
+                fprintf(out, " (%s > %s)", oldText, newText);
+            PutLine("");
+        }
+    }
+}
+
+/*! Compare the voices of two files and print the differences: moved,
+ *  renamed, changed (with the differing parameters), removed, and added
+ *  voices.
+ *
+ *  \param a voices of the old file
+ *  \param b voices of the new file
+ *  \return number of differences
+ */
+unsigned DiffVoices(const FileVoices &a, const FileVoices &b)
+{
+    const size_t soundSize = offsetof(VoiceUnpacked, name);
+    int matchA[32], matchB[32];
+    std::fill(matchA, matchA + 32, -1);
+    std::fill(matchB, matchB + 32, -1);
+
+    // pass 1: same slot, pass 2: moved, pass 3: renamed (same sound), pass 4: changed
+    for (unsigned pass = 1; pass <= 4; pass++)
+    {
+        for (unsigned i = 0; i < a.count; i++)
+        {
+            if (matchA[i] >= 0)
+                continue;
+            for (unsigned j = 0; j < b.count; j++)
+            {
+                // renamed voices in the same slot first
+                const unsigned k = (pass == 3) ? (j + i) % b.count : j;
+                if (matchB[k] >= 0 || ((pass == 1 || pass == 4) && k != i))
+                    continue;
+                const bool sound = a.hashes[i] == b.hashes[k] &&
+                                   memcmp(&a.voices[i], &b.voices[k], soundSize) == 0;
+                const bool named = memcmp(a.voices[i].name, b.voices[k].name, 10) == 0;
+                if (pass == 4 || (sound && (named || pass == 3)))
+                {
+                    matchA[i] = k;
+                    matchB[k] = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    unsigned unchanged = 0, moved = 0, renamed = 0, changed = 0, removed = 0, added = 0;
+    char oldName[41], newName[41];
+    for (unsigned i = 0; i < a.count; i++)
+    {
+        Name2Ascii(oldName, a.voices[i].name);
+        const int k = matchA[i];
+        if (k < 0)
+        {
+            fprintf(out, "voice %u \"%s\" removed\n", i + 1, oldName);
+            removed++;
+            continue;
+        }
+        Name2Ascii(newName, b.voices[k].name);
+        const VoiceUnpacked &newVoice = b.voices[k];
+        const bool sound = memcmp(&a.voices[i], &newVoice, soundSize) == 0;
+        const bool named = memcmp(a.voices[i].name, newVoice.name, 10) == 0;
+        if (!sound)
+        {
+            fprintf(out, "voice %u \"%s\" changed", i + 1, oldName);
+            if (!named)
+                fprintf(out, " (now \"%s\")", newName);
+            PutLine(":");
+            DiffParams(&a.voices[i], &newVoice);
+            changed++;
+            continue;
+        }
+        if (sound && named && k == (int)i)
+        {
+            unchanged++;
+            continue;
+        }
+        fprintf(out, "voice %u \"%s\"", i + 1, oldName);
+        if (!named)
+        {
+            fprintf(out, " renamed to \"%s\"", newName);
+            renamed++;
+        }
+        if (k != (int)i)
+        {
+            fprintf(out, "%s moved to %d", named ? "" : " and", k + 1);
+            moved++;
+        }
+        PutLine("");
+    }
+    for (unsigned j = 0; j < b.count; j++)
+    {
+        if (matchB[j] >= 0)
+            continue;
+        Name2Ascii(newName, b.voices[j].name);
+        fprintf(out, "voice %u \"%s\" added\n", j + 1, newName);
+        added++;
+    }
+
+    const unsigned differences = moved + renamed + changed + removed + added;
+    if (differences)
+        fprintf(out, "%u unchanged, %u moved, %u renamed, %u changed, %u removed, %u added\n",
+                unchanged, moved, renamed, changed, removed, added);
+    return differences;
+}
+
+//! A pair of files compared by a diff worker.
+struct DiffJob
+{
+    std::string a;              // empty if only in B
+    std::string b;              // empty if only in A
+    std::string output;         // printed differences
+    int result;                 // 0 identical, 1 different, 2 error
+};
+
+/*! Compare two files and write the differences to the output of the job.
+ *
+ *  \param job pair of files
+ */
+void DiffFiles(DiffJob &job)
+{
+    char *output = NULL;
+    size_t outputSize = 0;
+    FILE *memFile = open_memstream(&output, &outputSize);
+    if (memFile == NULL)
+    {
+        job.output = "ERROR: out of memory\n";
+        job.result = 2;
+        return;
+    }
+    out = memFile;
+
+    std::unique_ptr<FileVoices> a(new FileVoices), b(new FileVoices);
+    job.result = 0;
+    if (LoadVoices(job.a.c_str(), *a) || LoadVoices(job.b.c_str(), *b))
+    {
+        const std::string &message = a->message.empty() ? b->message : a->message;
+        fprintf(out, "%s: %s\n", (a->message.empty() ? job.b : job.a).c_str(), message.c_str());
+        job.result = 2;
+    }
+    else if (DiffVoices(*a, *b))
+    {
+        job.result = 1;
+    }
+
+    fclose(memFile);
+    out = stdout;
+    if (job.result)
+        job.output = "--- " + job.a + "\n+++ " + job.b + "\n" + std::string(output, outputSize);
+    free(output);
+}
+
+/*! Diff worker: compare the pairs of files with the next free index.
+ *
+ *  \param jobs pairs of files
+ *  \param next index of the next pair
+ *  \param options a pointer to the options of the command line
+ */
+void DiffWorker(std::vector<DiffJob> *jobs, std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < jobs->size(); i = (*next)++)
+    {
+        DiffJob &job = (*jobs)[i];
+        if (!job.a.empty() && !job.b.empty())
+            DiffFiles(job);
+    }
+}
+
+/*! Compare two banks (or single voice dumps), or two directory trees file by
+ *  file (same relative path) with a pool of workers.
+ *
+ *  \param a old file or directory
+ *  \param b new file or directory
+ *  \return 0 if there are no differences
+ */
+int RunDiff(const char *a, const char *b)
+{
+    std::vector<DiffJob> jobs;
+    struct stat stA, stB;
+    const bool dirA = stat(a, &stA) == 0 && S_ISDIR(stA.st_mode);
+    const bool dirB = stat(b, &stB) == 0 && S_ISDIR(stB.st_mode);
+    if (dirA != dirB)
+    {
+        PutLine("Option --diff needs two files or two directories.");
+        return 1;
+    }
+    if (!dirA)
+    {
+        DiffJob job;
+        job.a = a;
+        job.b = b;
+        jobs.push_back(job);
+    }
+    else
+    {
+        // pair the files by their path relative to the directories
+        std::vector<std::string> filesA, filesB;
+        ScanDirectory(a, filesA);
+        ScanDirectory(b, filesB);
+        const size_t baseA = strlen(a) + 1, baseB = strlen(b) + 1;
+        std::map<std::string, DiffJob> pairs;
+        for (unsigned i = 0; i < filesA.size(); i++)
+            pairs[filesA[i].substr(baseA)].a = filesA[i];
+        for (unsigned i = 0; i < filesB.size(); i++)
+            pairs[filesB[i].substr(baseB)].b = filesB[i];
+        for (std::map<std::string, DiffJob>::iterator p = pairs.begin(); p != pairs.end(); ++p)
+            jobs.push_back(p->second);
+    }
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    std::atomic<unsigned> next(0);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(DiffWorker, &jobs, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    unsigned identical = 0, different = 0, errors = 0, onlyA = 0, onlyB = 0;
+    for (unsigned i = 0; i < jobs.size(); i++)
+    {
+        const DiffJob &job = jobs[i];
+        if (job.b.empty())
+        {
+            fprintf(out, "Only in %s: %s\n", a, job.a.c_str() + strlen(a) + 1);
+            onlyA++;
+        }
+        else if (job.a.empty())
+        {
+            fprintf(out, "Only in %s: %s\n", b, job.b.c_str() + strlen(b) + 1);
+            onlyB++;
+        }
+        else
+        {
+            fputs(job.output.c_str(), out);
+            identical += job.result == 0;
+            different += job.result == 1;
+            errors += job.result == 2;
+        }
+    }
+    if (dirA)
+        fprintf(out, "%u files compared: %u with the same voices, %u different, %u errors. "
+                "Only in %s: %u, only in %s: %u\n", identical + different + errors, identical,
+                different, errors, a, onlyA, b, onlyB);
+    return (different || errors || onlyA || onlyB) ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Tree comparison (--compare)
+
+//! Voice hashes of one file of a tree compared with --compare.
+struct CompareFile
+{
+    std::string path;
+    uint64_t fileHash;          // hash of the file content
+    uint64_t setHash;           // hash of the sorted voice hashes
+    std::vector<uint64_t> hashes;
+    std::string names;          // 10 characters per voice
+    bool ok;
+};
+
+/*! Read a whole file.
+ *
+ *  \param filename a pointer to the filename
+ *  \param data the content of the file
+ *  \return 0 if ok
+ */
+int ReadWholeFile(const char *filename, std::string &data)
+{
+    const int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    data.resize(st.st_size);
+    const bool ok = read(fd, &data[0], st.st_size) == st.st_size;
+    close(fd);
+    return ok ? 0 : 1;
+}
+
+/*! Compare worker: hash the files with the next free index.
+ *
+ *  \param files files of both trees
+ *  \param next index of the next file
+ *  \param options a pointer to the options of the command line
+ */
+void CompareWorker(std::vector<CompareFile> *files, std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    std::unique_ptr<FileVoices> voices(new FileVoices);
+    for (unsigned i = (*next)++; i < files->size(); i = (*next)++)
+    {
+        CompareFile &file = (*files)[i];
+        file.ok = LoadVoices(file.path.c_str(), *voices) == 0;
+        if (!file.ok)
+            continue;
+        // the data of headerless files is loaded behind the (missing) header
+        file.fileHash = HashBytes(fsize == rawDataSize ? buffer + 6 : buffer, fsize);
+        file.hashes.assign(voices->hashes, voices->hashes + voices->count);
+        for (unsigned v = 0; v < voices->count; v++)
+            file.names.append((const char *)voices->voices[v].name, 10);
+        std::vector<uint64_t> sorted(file.hashes);
+        std::sort(sorted.begin(), sorted.end());
+        file.setHash = HashBytes(sorted.data(), sorted.size() * sizeof(uint64_t));
+    }
+}
+
+//! Voice hash set and file indexes of one tree, built by CompareIndex().
+struct CompareSide
+{
+    std::unordered_set<uint64_t> voices;
+    std::unordered_multimap<uint64_t, unsigned> byFile;     // file hash -> file
+    std::unordered_multimap<uint64_t, unsigned> bySet;      // voice set hash -> file
+};
+
+/*! Build the voice hash set and the file indexes of one tree.
+ *
+ *  \param files files of both trees
+ *  \param begin index of the first file of the tree
+ *  \param end index after the last file of the tree
+ *  \param side the sets to fill
+ */
+void CompareIndex(const std::vector<CompareFile> *files, unsigned begin, unsigned end,
+                  CompareSide *side)
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        const CompareFile &file = (*files)[i];
+        if (!file.ok)
+            continue;
+        side->voices.insert(file.hashes.begin(), file.hashes.end());
+        side->byFile.insert(std::make_pair(file.fileHash, i));
+        side->bySet.insert(std::make_pair(file.setHash, i));
+    }
+}
+
+/*! Find a file of the other tree in an index, preferring the same relative path.
+ *
+ *  \param index file index of the other tree
+ *  \param key file hash or voice set hash
+ *  \param files files of both trees
+ *  \param relative relative path of the file
+ *  \param base length of the directory of the other tree including '/'
+ *  \return index of the file, or -1
+ */
+int CompareFind(const std::unordered_multimap<uint64_t, unsigned> &index, uint64_t key,
+                const std::vector<CompareFile> &files, const char *relative, size_t base)
+{
+    int found = -1;
+    auto range = index.equal_range(key);
+    for (auto p = range.first; p != range.second; ++p)
+    {
+        if (strcmp(files[p->second].path.c_str() + base, relative) == 0)
+            return p->second;
+        if (found < 0 || p->second < (unsigned)found)
+            found = p->second;
+    }
+    return found;
+}
+
+/*! Print the voices of one tree that are not in the other tree (once per sound).
+ *
+ *  \param files files of both trees
+ *  \param begin index of the first file of the tree
+ *  \param end index after the last file of the tree
+ *  \param other voice hash set of the other tree
+ *  \param mark '<' for the first tree, '>' for the second
+ *  \return number of voices printed
+ */
+unsigned CompareUnique(const std::vector<CompareFile> &files, unsigned begin, unsigned end,
+                       const std::unordered_set<uint64_t> &other, char mark)
+{
+    std::unordered_set<uint64_t> printed;
+    unsigned count = 0;
+    char voiceName[41];
+    for (unsigned i = begin; i < end; i++)
+    {
+        const CompareFile &file = files[i];
+        for (unsigned v = 0; v < file.hashes.size(); v++)
+        {
+            if (other.count(file.hashes[v]) || !printed.insert(file.hashes[v]).second)
+                continue;
+            Name2Ascii(voiceName, (const unsigned char *)file.names.data() + 10 * v);
+            fprintf(out, "%c %s %u \"%s\"\n", mark, file.path.c_str(), v + 1, voiceName);
+            count++;
+        }
+    }
+    return count;
+}
+
+/*! Compare two directory trees by their voices: identical files, banks with
+ *  the same voices in another order or with other names, and the voices found
+ *  in one tree only (name ignored).
+ *
+ *  \param a first directory
+ *  \param b second directory
+ *  \return 0 if both trees have the same voices
+ */
+int RunCompare(const char *a, const char *b)
+{
+    std::vector<std::string> filesA, filesB;
+    ScanDirectory(a, filesA);
+    ScanDirectory(b, filesB);
+    std::vector<CompareFile> files(filesA.size() + filesB.size());
+    const unsigned countA = filesA.size();
+    for (unsigned i = 0; i < countA; i++)
+        files[i].path = filesA[i];
+    for (unsigned i = 0; i < filesB.size(); i++)
+        files[countA + i].path = filesB[i];
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    std::atomic<unsigned> next(0);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(CompareWorker, &files, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    // both trees are indexed at the same time
+    CompareSide sideA, sideB;
+    sideA.voices.reserve(countA * 32);
+    sideB.voices.reserve((files.size() - countA) * 32);
+    std::thread indexA(CompareIndex, &files, 0, countA, &sideA);
+    CompareIndex(&files, countA, files.size(), &sideB);
+    indexA.join();
+
+    const size_t baseA = strlen(a) + 1, baseB = strlen(b) + 1;
+    unsigned identical = 0, reordered = 0, errors = 0;
+    for (unsigned i = 0; i < files.size(); i++)
+    {
+        if (!files[i].ok)
         {
-            for (unsigned column = 0; column < columns; ++column)
+            fprintf(out, "! %s: File error\n", files[i].path.c_str());
+            errors++;
+        }
+    }
+    for (unsigned i = 0; i < countA; i++)
+    {
+        const CompareFile &file = files[i];
+        if (!file.ok)
+            continue;
+        const char *relative = file.path.c_str() + baseA;
+        int match = CompareFind(sideB.byFile, file.fileHash, files, relative, baseB);
+        std::string dataA, dataB;
+        if (match >= 0 && ReadWholeFile(file.path.c_str(), dataA) == 0 &&
+            ReadWholeFile(files[match].path.c_str(), dataB) == 0 && dataA == dataB)
+        {
+            fprintf(out, "= %s %s\n", file.path.c_str(), files[match].path.c_str());
+            identical++;
+            continue;
+        }
+        match = CompareFind(sideB.bySet, file.setHash, files, relative, baseB);
+        if (match >= 0)
+        {
+            fprintf(out, "~ %s %s\n", file.path.c_str(), files[match].path.c_str());
+            reordered++;
+        }
+    }
+    const unsigned onlyA = CompareUnique(files, 0, countA, sideB.voices, '<');
+    const unsigned onlyB = CompareUnique(files, countA, files.size(), sideA.voices, '>');
+
+    fprintf(out, "%u + %u files, %u errors. %u identical, %u with the same voices in another "
+            "order or with other names. Voices: %zu in %s (%u only there), %zu in %s "
+            "(%u only there)\n", countA, (unsigned)filesB.size(), errors, identical, reordered,
+            sideA.voices.size(), a, onlyA, sideB.voices.size(), b, onlyB);
+    return (onlyA || onlyB || errors) ? 1 : 0;
+}
+
+// ***************************************************************************
+
+// Bank provenance (--provenance)
+
+//! number of MinHash values per bank
+const unsigned minHashCount = 128;
+
+//! number of banks of a cluster the origin candidates are compared with
+const unsigned originSampleSize = 64;
+
+//! maximal number of candidate pairs of a band worker (8 bytes each)
+const size_t maxCandidatePairs = 1 << 23;
+
+//! A bank for --provenance: its voice hash set and MinHash signature.
+struct ProvenanceBank
+{
+    std::string path;
+    std::vector<uint64_t> hashes;           // sorted, unique VoiceHash() values
+    uint32_t signature[minHashCount];
+    int set;                                // bank with the same voice set, or -1
+    bool ok;
+};
+
+/*! Mix a voice hash with a seed (splitmix64 finalizer).
+ *
+ *  \param hash voice hash
+ *  \param seed number of the MinHash function
+ *  \return 32-bit value
+ */
+inline uint32_t MinHashMix(uint64_t hash, unsigned seed)
+{
+    hash ^= (seed + 1) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBULL;
+    return (uint32_t)(hash ^ (hash >> 31));
+}
+
+/*! Provenance worker: load the banks with the next free index and compute
+ *  their signatures.
+ *
+ *  \param banks the banks
+ *  \param next index of the next bank
+ *  \param options a pointer to the options of the command line
+ */
+void ProvenanceWorker(std::vector<ProvenanceBank> *banks, std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    std::unique_ptr<FileVoices> voices(new FileVoices);
+    for (unsigned i = (*next)++; i < banks->size(); i = (*next)++)
+    {
+        ProvenanceBank &bank = (*banks)[i];
+        bank.ok = LoadVoices(bank.path.c_str(), *voices) == 0 && voices->count == 32;
+        if (!bank.ok)
+            continue;
+        bank.hashes.assign(voices->hashes, voices->hashes + 32);
+        std::sort(bank.hashes.begin(), bank.hashes.end());
+        bank.hashes.erase(std::unique(bank.hashes.begin(), bank.hashes.end()), bank.hashes.end());
+        for (unsigned k = 0; k < minHashCount; k++)
+        {
+            uint32_t min = UINT32_MAX;
+            for (unsigned v = 0; v < bank.hashes.size(); v++)
+                min = std::min(min, MinHashMix(bank.hashes[v], k));
+            bank.signature[k] = min;
+        }
+    }
+}
+
+/*! Jaccard similarity of the voice sets of two banks.
+ *
+ *  \param a sorted voice hashes of the first bank
+ *  \param b sorted voice hashes of the second bank
+ *  \param shared number of voices in both banks
+ *  \return similarity 0..1
+ */
+double Jaccard(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b, unsigned &shared)
+{
+    shared = 0;
+    for (unsigned i = 0, j = 0; i < a.size() && j < b.size(); )
+    {
+        if (a[i] < b[j])
+            i++;
+        else if (b[j] < a[i])
+            j++;
+        else
+            shared++, i++, j++;
+    }
+    return (double)shared / (a.size() + b.size() - shared);
+}
+
+/*! LSH worker: put the distinct banks into buckets by the bands with the next
+ *  free index; all pairs of banks sharing a bucket of any band are candidates.
+ *  A pair is taken in the first band it shares a bucket in only, so no pair is
+ *  found twice. The pairs of a bucket that would exceed maxCandidatePairs are
+ *  counted as dropped instead.
+ *
+ *  \param bandHashes hash of every band of every distinct bank (bank * bands + band)
+ *  \param count number of distinct banks
+ *  \param bands number of bands
+ *  \param next index of the next band
+ *  \param pairs candidate pairs (index into distinct, lower index in the high half)
+ *  \param dropped number of pairs not taken
+ *  \param lock lock for pairs
+ */
+void BandWorker(const std::vector<uint64_t> *bandHashes, unsigned count, unsigned bands,
+                std::atomic<unsigned> *next, std::vector<uint64_t> *pairs,
+                std::atomic<unsigned long> *dropped, std::mutex *lock)
+{
+    const uint64_t *hashes = bandHashes->data();
+    std::vector<std::pair<uint64_t, unsigned> > buckets(count);
+    std::vector<uint64_t> found;
+    for (unsigned band = (*next)++; band < bands; band = (*next)++)
+    {
+        for (unsigned i = 0; i < count; i++)
+            buckets[i] = std::make_pair(hashes[(size_t)i * bands + band], i);
+        std::sort(buckets.begin(), buckets.end());
+        for (unsigned first = 0, last; first < buckets.size(); first = last)
+        {
+            for (last = first + 1; last < buckets.size() && buckets[last].first == buckets[first].first; last++)
+                ;
+            const bool take = found.size() + (size_t)(last - first) * (last - first - 1) / 2 <= maxCandidatePairs;
+            for (unsigned i = first; i < last; i++)
             {
-                const unsigned voiceNum = column * rows + row;
-                const VoicePacked *voice = &(sysex->voices[voiceNum]);
-                Name2Ascii(name, voice->name);
-                printf("%2d %c%10s%c ", voiceNum + 1, voiceDelimiter, name, voiceDelimiter);
-                if (showHex)
+                const uint64_t *a = hashes + (size_t)buckets[i].second * bands;
+                for (unsigned j = i + 1; j < last; j++)
                 {
-                    for (unsigned i = 0; i < 10; i++)
-                    {
-                        printf(" %2.2X", voice->name[i]);          
-                    }
+                    const uint64_t *b = hashes + (size_t)buckets[j].second * bands;
+                    unsigned earlier = 0;
+                    while (earlier < band && a[earlier] != b[earlier])
+                        earlier++;
+                    if (earlier < band)
+                        continue;
+                    if (take)
+                        found.push_back((uint64_t)buckets[i].second << 32 | buckets[j].second);
+                    else
+                        (*dropped)++;
                 }
-                if (column < columns - 1)
-                    printf("         ");
             }
-            puts("");          
         }
-        puts("");          
     }
-    else    // voice data listing
+
+    std::lock_guard<std::mutex> guard(*lock);
+    pairs->insert(pairs->end(), found.begin(), found.end());
+}
+
+/*! Find union-find root.
+ *
+ *  \param parent parent of every node
+ *  \param node the node
+ *  \return root of the node
+ */
+unsigned FindRoot(std::vector<unsigned> &parent, unsigned node)
+{
+    while (parent[node] != node)
+        node = parent[node] = parent[parent[node]];
+    return node;
+}
+
+/*! Find banks that are edited copies of other banks: MinHash signatures of the
+ *  voice sets, LSH banding for candidate pairs, exact Jaccard similarity of the
+ *  candidates, and clusters of the similar pairs. The bank most similar to the
+ *  others of its cluster is shown as the likely origin.
+ *
+ *  \param argc number of FILEs and directories
+ *  \param argv FILEs and directories
+ *  \param threshold minimal Jaccard similarity in percent
+ *  \return 0 if ok
+ */
+int RunProvenance(int argc, char *argv[], unsigned threshold)
+{
+    std::vector<std::string> filenames;
+    for (int i = 0; i < argc; i++)
     {
-        if (softError)
-            VoiceSeparator();
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], filenames);
+        else
+            filenames.push_back(argv[i]);
+    }
+    std::vector<ProvenanceBank> banks(filenames.size());
+    for (unsigned i = 0; i < banks.size(); i++)
+        banks[i].path = filenames[i];
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::atomic<unsigned> next(0);
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(ProvenanceWorker, &banks, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    // banks with the same voice set are handled as one
+    std::vector<unsigned> distinct;
+    std::unordered_map<uint64_t, unsigned> sets;
+    unsigned skipped = 0;
+    for (unsigned i = 0; i < banks.size(); i++)
+    {
+        ProvenanceBank &bank = banks[i];
+        bank.set = -1;
+        if (!bank.ok)
+        {
+            skipped++;
+            continue;
+        }
+        const uint64_t key = HashBytes(bank.hashes.data(), bank.hashes.size() * sizeof(uint64_t));
+        auto found = sets.find(key);
+        if (found != sets.end() && banks[found->second].hashes == bank.hashes)
+        {
+            bank.set = found->second;
+            continue;
+        }
+        sets[key] = i;
+        distinct.push_back(i);
+    }
+
+    // rows per band: the LSH threshold (1/bands)^(1/rows) a bit below the
+    // requested one, missed pairs are rare and false ones are sorted out
+    const double similarity = threshold / 100.0;
+    unsigned rows = 1;
+    while (rows < minHashCount &&
+           pow(1.0 / (minHashCount / (rows + 1)), 1.0 / (rows + 1)) <= similarity * 0.8)
+        rows++;
+    const unsigned bands = minHashCount / rows;
+
+    std::vector<uint64_t> bandHashes((size_t)distinct.size() * bands);
+    for (unsigned i = 0; i < distinct.size(); i++)
+    {
+        for (unsigned band = 0; band < bands; band++)
+            bandHashes[(size_t)i * bands + band] =
+                HashBytes(banks[distinct[i]].signature + band * rows, rows * sizeof(uint32_t));
+    }
 
-        const char** algorithmDiagram;
-        if (useUnicode)
+    std::vector<uint64_t> candidates;
+    std::atomic<unsigned long> dropped(0);
+    std::mutex lock;
+    next = 0;
+    pool.clear();
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(BandWorker, &bandHashes, (unsigned)distinct.size(), bands, &next,
+                                   &candidates, &dropped, &lock));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+    if (dropped > 0)
+        fprintf(out, "Warning: %lu candidate pairs of large buckets not compared (limit: %zu pairs "
+                "per worker)\n", dropped.load(), maxCandidatePairs);
+    std::sort(candidates.begin(), candidates.end());
+
+    std::vector<unsigned> parent(distinct.size());
+    for (unsigned i = 0; i < parent.size(); i++)
+        parent[i] = i;
+    unsigned similar = 0;
+    for (unsigned i = 0; i < candidates.size(); i++)
+    {
+        const unsigned a = candidates[i] >> 32, b = candidates[i] & 0xFFFFFFFF;
+        unsigned shared;
+        const double jaccard = Jaccard(banks[distinct[a]].hashes, banks[distinct[b]].hashes, shared);
+        if (jaccard < similarity)
+            continue;
+        similar++;
+        parent[FindRoot(parent, a)] = FindRoot(parent, b);
+    }
+
+    // members of every cluster: distinct banks and their identical copies
+    std::map<unsigned, std::vector<unsigned> > clusters;
+    std::vector<int> distinctIndex(banks.size(), -1);
+    for (unsigned i = 0; i < distinct.size(); i++)
+        distinctIndex[distinct[i]] = i;
+    for (unsigned i = 0; i < banks.size(); i++)
+    {
+        if (!banks[i].ok)
+            continue;
+        const unsigned d = distinctIndex[banks[i].set < 0 ? i : banks[i].set];
+        clusters[FindRoot(parent, d)].push_back(i);
+    }
+
+    unsigned clusterCount = 0;
+    for (auto c = clusters.begin(); c != clusters.end(); ++c)
+    {
+        const std::vector<unsigned> &members = c->second;
+        if (members.size() < 2)
+            continue;
+        clusterCount++;
+
+        // origin: the distinct bank most similar to a sample of the other distinct banks
+        std::vector<unsigned> origins;
+        for (unsigned i = 0; i < members.size(); i++)
+        {
+            if (banks[members[i]].set < 0)
+                origins.push_back(members[i]);
+        }
+        const unsigned step = (origins.size() + originSampleSize - 1) / originSampleSize;
+        unsigned origin = members[0];
+        double originScore = -1;
+        for (unsigned i = 0; i < origins.size(); i++)
+        {
+            double score = 0;
+            for (unsigned j = 0; j < origins.size(); j += step)
+            {
+                unsigned shared;
+                if (j != i)
+                    score += Jaccard(banks[origins[i]].hashes, banks[origins[j]].hashes, shared);
+            }
+            if (score > originScore)
+            {
+                origin = origins[i];
+                originScore = score;
+            }
+        }
+        fprintf(out, "Cluster %u: %zu banks\n", clusterCount, members.size());
+        fprintf(out, "  %s\n", banks[origin].path.c_str());
+        for (unsigned i = 0; i < members.size(); i++)
         {
-            algorithmDiagram = algorithmDiagramUnicode;
+            const ProvenanceBank &bank = banks[members[i]];
+            if (members[i] == origin)
+                continue;
+            unsigned shared;
+            const double jaccard = Jaccard(banks[origin].hashes, bank.hashes, shared);
+            if (shared == bank.hashes.size() && shared == banks[origin].hashes.size())
+                fprintf(out, "  = %s\n", bank.path.c_str());
+            else
+                fprintf(out, "  ~ %s (%.0f%%, %u voices shared, %zu other)\n", bank.path.c_str(),
+                        jaccard * 100, shared, bank.hashes.size() - shared);
         }
+    }
+    fprintf(out, "%zu files, %u skipped. %zu distinct banks, %u bands of %u rows: %zu candidate "
+            "pairs, %u similar (>= %u%%). %u clusters\n", banks.size(), skipped, distinct.size(),
+            bands, rows, candidates.size(), similar, threshold, clusterCount);
+    return 0;
+}
+
+// ***************************************************************************
+
+// Factory voice table (--factory-table)
+
+/*! Label of the voices of a file in the factory voice table: the filename
+ *  without directory and extension in upper case, e.g. "ROM1A".
+ *
+ *  \param filename a pointer to the filename
+ *  \return label
+ */
+std::string FactoryFileLabel(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    std::string label(base ? base + 1 : filename);
+    const size_t dot = label.rfind('.');
+    if (dot != std::string::npos && dot > 0)
+        label.erase(dot);
+    for (unsigned i = 0; i < label.size(); i++)
+    {
+        const unsigned char c = label[i];
+        label[i] = (c < ' ' || c > '~' || c == '"' || c == '\\') ? '_' : toupper(c);
+    }
+    return label;
+}
+
+/*! Print the header dx7factory.h for the voices of the banks and single
+ *  voice dumps of FILEs and directory trees: INIT VOICE and "LABEL #N" for
+ *  every other sound (first label wins), placed by a perfect hash (hash and
+ *  displace: buckets sorted by size, every bucket gets the first displacement
+ *  that moves all of its voices to free slots).
+ *
+ *  \param argc number of FILEs and directories
+ *  \param argv FILEs and directories
+ *  \return 0 if ok
+ */
+int RunFactoryTable(int argc, char *argv[])
+{
+    std::vector<std::string> filenames;
+    for (int i = 0; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], filenames);
         else
+            filenames.push_back(argv[i]);
+    }
+
+    std::vector<std::pair<uint64_t, std::string> > voices;
+    std::unordered_set<uint64_t> known;
+    VoiceUnpacked init;
+    InitVoice(&init);
+    voices.push_back(std::make_pair(VoiceHash(&init), std::string("INIT VOICE")));
+    known.insert(voices[0].first);
+    std::unique_ptr<FileVoices> file(new FileVoices);
+    for (unsigned i = 0; i < filenames.size(); i++)
+    {
+        if (LoadVoices(filenames[i].c_str(), *file))
+        {
+            fprintf(stderr, "%s: %s\n", filenames[i].c_str(), file->message.c_str());
+            continue;
+        }
+        const std::string label = FactoryFileLabel(filenames[i].c_str());
+        for (unsigned v = 0; v < file->count; v++)
         {
-            algorithmDiagram = algorithmDiagramAscii;
+            if (known.insert(file->hashes[v]).second)
+                voices.push_back(std::make_pair(file->hashes[v], file->count == 1 ? label :
+                                                label + " #" + std::to_string(v + 1)));
         }
+    }
 
-        // For each voice.
-        for (unsigned voiceNum = 0; voiceNum < 32; ++voiceNum)
+    const unsigned slots = voices.size() + voices.size() / 4 + 1;
+    const unsigned buckets = voices.size() / 2 + 1;
+    std::vector<std::vector<unsigned> > bucketVoices(buckets);
+    for (unsigned i = 0; i < voices.size(); i++)
+        bucketVoices[FactoryBucket(voices[i].first, buckets)].push_back(i);
+    std::vector<unsigned> order(buckets);
+    for (unsigned b = 0; b < buckets; b++)
+        order[b] = b;
+    std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b)
+        { return bucketVoices[a].size() > bucketVoices[b].size(); });
+
+    std::vector<int> slotVoice(slots, -1);
+    std::vector<unsigned> displacements(buckets, 0);
+    std::vector<unsigned> taken;
+    for (unsigned b = 0; b < buckets && !bucketVoices[order[b]].empty(); b++)
+    {
+        const std::vector<unsigned> &members = bucketVoices[order[b]];
+        unsigned d = 0;
+        for (; d <= UINT16_MAX; d++)
         {
-            if (patch == -1 or patch == voiceNum)
+            taken.clear();
+            for (unsigned i = 0; i < members.size(); i++)
             {
-                const VoicePacked *voice = &(sysex->voices[voiceNum]);
-          
-                // Voice Data List
-          
-                PrintFilename(filename);
-                printf("Voice-#: %d\n", voiceNum + 1);
-                Name2Ascii(name, voice->name);
-                printf("Name: \"%s\"", name);
-                if (showHex)
-                {
-                    // voice name: show name in hex
-                    printf(" | ");
-                    for (unsigned i = 0; i < 10; i++)
-                    {
-                        printf(" %2.2X", voice->name[i]);          
-                    }
+                const unsigned slot = FactorySlot(voices[members[i]].first, d, slots);
+                if (slotVoice[slot] >= 0 || std::find(taken.begin(), taken.end(), slot) != taken.end())
+                    break;
+                taken.push_back(slot);
+            }
+            if (taken.size() == members.size())
+                break;
+        }
+        if (d > UINT16_MAX)
+        {
+            fprintf(stderr, "No perfect hash found for %zu voices\n", voices.size());
+            return 1;
+        }
+        displacements[order[b]] = d;
+        for (unsigned i = 0; i < members.size(); i++)
+            slotVoice[taken[i]] = members[i];
+    }
 
-                    // print single voice raw data
-                    VoiceUnpacked unpackedVoice;
-                    VoiceUnpacked *uVoice = &unpackedVoice;
-                    UnpackVoice(uVoice, voice);
-                    printf("\n\nVoice Data:"); 
-                    //char* uVoiceChar = reinterpret_cast<char*>(&unpackedVoice);
-                    unsigned char* uVoiceChar = (unsigned char*)(&unpackedVoice);
-                    for (unsigned i = 0; i < sizeof(unpackedVoice); i++)
-                    {
-                        printf(" %2.2X", uVoiceChar[i]);    
-                    }
-                    //printf(" [ChkSum:%2.2X]", ChecksumSingle(uVoice, sizeof(unpackedVoice)));    
-                    printf(" %2.2X [last byte = checksum]", ChecksumSingle(uVoice, sizeof(unpackedVoice)));    
-                }
+    PutLine("/*! \\file dx7factory.h\n"
+            " *  \\brief Known factory voices of the Yamaha DX7\n"
+            " *\n"
+            " *  Generated by \"dx7dump --factory-table FILEs > dx7factory.h\": the sound\n"
+            " *  hashes (VoiceHash()) of the voices, placed by a perfect hash. Regenerate\n"
+            " *  it after changes of VoiceHash().\n"
+            " *\n"
+            " *  License: GPLv3+\n"
+            " */\n"
+            "\n"
+            "#ifndef _dx7factory_h\n"
+            "#define _dx7factory_h\n"
+            "\n"
+            "//! A known voice: hash of the sound and label, e.g. \"ROM1A #12\"\n"
+            "struct FactoryVoice\n"
+            "{\n"
+            "    uint64_t hash;\n"
+            "    const char *label;\n"
+            "};\n"
+            "\n"
+            "//! known voices in the slots of the perfect hash (empty slots: NULL label)\n"
+            "constexpr FactoryVoice factoryVoices[] = {");
+    for (unsigned s = 0; s < slots; s++)
+    {
+        if (slotVoice[s] < 0)
+            PutLine("    { 0, NULL },");
+        else
+            fprintf(out, "    { 0x%016llXULL, \"%s\" },\n", (unsigned long long)voices[slotVoice[s]].first,
+                    voices[slotVoice[s]].second.c_str());
+    }
+    PutLine("};\n"
+            "\n"
+            "//! displacements of the buckets of the perfect hash\n"
+            "constexpr uint16_t factoryDisplacements[] = {");
+    for (unsigned b = 0; b < buckets; b++)
+        fprintf(out, "%s%u,%s", (b % 16 == 0) ? "    " : " ", displacements[b],
+                (b % 16 == 15 || b == buckets - 1) ? "\n" : "");
+    PutLine("};\n"
+            "\n"
+            "#endif");
+    return 0;
+}
 
-                puts("\n");
+// ***************************************************************************
 
-                if (tabularListing)
-                {
-                    printf("Algorithm: %u\n", voice->algorithm + 1);
-                    // print algorithm diagram as ASCII-art
-                    printf("\n%s\n", algorithmDiagram[voice->algorithm]);
+// File deduplication (--dedup)
 
-                    //puts("");
+//! One file for --dedup: identity of its content and of its inode.
+struct DedupFile
+{
+    std::string path;
+    uint64_t key;               // hash of the (normalised) content
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    nlink_t links;
+    blkcnt_t blocks;            // 512 byte blocks
+    bool normalised;            // the file is its own normalised content
+    bool ok;
+};
 
-#if TABLE_VARIANT == 2
-                    // TABLE_VARIANT 2
+/*! Normalise the content of a bank like FixFile() does: header, checksum,
+ *  and end are set, headerless banks get a header. Other files are left as
+ *  they are.
+ *
+ *  \param data the content of the file
+ */
+void NormaliseBank(std::string &data)
+{
+    if (data.size() != sysexSize && data.size() != rawDataSize)
+        return;
+    DX7Sysex sysex;
+    memcpy(sysex.voices, data.data() + (data.size() == sysexSize ? 6 : 0), rawDataSize);
+    FixHeader(&sysex);
+    data.assign((const char *)&sysex, sysexSize);
+}
 
-                    // +------------+-------+-------+------------+--------+
-                    // |            | Algo- | Feed- | Oscillator | Trans- |
-                    // | Voice Name | rithm | back  | Key Sync   | pose   |
-                    // +------------+-------+-------+------------+--------+
-                    if (useUnicode)
-                        printf("┌────────────┬───────┬───────┬────────────┬────────┐\n");
-                    else
-                        printf("+------------+-------+-------+------------+--------+\n");
-                    printf("%1$s            %1$s Algo- %1$s Feed- %1$s Oscillator "
-                           "%1$s Trans- %1$s\n", vl);
-                    
-                    printf("%1$s Voice Name %1$s rithm %1$s back  %1$s Key Sync   "
-                           "%1$s pose   %1$s\n", vl);
-                    if (useUnicode)
-                        printf("├────────────┼───────┼───────┼────────────┼────────┤\n");
-                    else
-                        printf("+------------+-------+-------+------------+--------+\n");
-                    printf("%s %-10s %s %5u %s %5u %s %10s %s %6d %s\n",
-                        vl, name, vl,
-                        voice->algorithm + 1, vl,
-                        voice->feedback, vl,
-                        OnOff(voice->oscKeySync), vl,
-                        voice->transpose - 24, vl);
-                    if (useUnicode)
-                        printf("└────────────┴───────┴───────┴────────────┴────────┘\n");
-                    else
-                        printf("+------------+-------+-------+------------+--------+\n");
-                    puts("");
-                    if (!useUnicode)
-                        puts("");
-
-                    // +--------------------------------------------------+-----------------------+
-                    // |                       LFO                        | Pitch Env. Generator  |
-                    // +----+-----+-----+---------+---------+----+--------+-----+-----+-----+-----+
-                    // |    |     |     |Pitch    |Amplitude|Key |Pitch   |     |     |     |     |
-                    // |Wave|Speed|Delay|Mod Depth|Mod Depth|Sync|Mod Sens|R1:L1|R2:L2|R3:L3|R4:L4|
-                    // +----+-----+-----+---------+---------+----+--------+-----+-----+-----+-----+
-                    if (useUnicode)
-                        printf("┌─────────────────────────────────────────────────────────────────────"
-                               "┬───────────────────────────────┐\n");
-                    else
-                        printf("+---------------------------------------------------------------------"
-                               "+-------------------------------+\n");
-                    printf("%1$s                                  LFO                                "
-                           "%1$s   Pitch Envelope Generator    %1$s\n", vl);
-                    if (useUnicode)
-                        printf("├──────────┬───────┬───────┬───────────┬───────────┬───────┬──────────"
-                               "┼───────┬───────┬───────┬───────┤\n");
-                    else
-                        printf("+----------+-------+-------+-----------+-----------+-------+----------"
-                               "+-------+-------+-------+-------+\n");
-                    printf("%1$s          %1$s       %1$s       %1$s Pitch     "
-                           "%1$s Amplitude %1$s Key   %1$s Pitch    "
-                           "%1$s       %1$s       %1$s       %1$s       %1$s\n", vl);
-                    printf("%1$s Wave     %1$s Speed %1$s Delay %1$s Mod Depth "
-                           "%1$s Mod Depth %1$s Sync  %1$s Mod Sens "
-                           "%1$s R1:L1 %1$s R2:L2 %1$s R3:L3 %1$s R4:L4 %1$s\n", vl);
-                    if (useUnicode)
-                        printf("├──────────┼───────┼───────┼───────────┼───────────┼───────┼──────────"
-                               "┼───────┼───────┼───────┼───────┤\n");
-                    else
-                        printf("+----------+-------+-------+-----------+-----------+-------+----------"
-                               "+-------+-------+-------+-------+\n");
-                    printf("%s %8s %s %5u %s %5u %s %9u %s %9u %s %5s %s %8u "
-                           "%s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s\n",
-                        vl, LFOWave(voice->lfoWave), vl,
-                        voice->lfoSpeed, vl,
-                        voice->lfoDelay, vl,
-                        voice->lfoPitchModDepth, vl,
-                        voice->lfoAMDepth, vl,
-                        OnOff(voice->lfoSync), vl,
-                        voice->lfoPitchModSensitivity, vl,
-                        voice->pitchEGR1, voice->pitchEGL1, vl,
-                        voice->pitchEGR2, voice->pitchEGL2, vl,
-                        voice->pitchEGR3, voice->pitchEGL3, vl,
-                        voice->pitchEGR4, voice->pitchEGL4, vl);
-                    if (useUnicode)
-                        printf("└──────────┴───────┴───────┴───────────┴───────────┴───────┴──────────"
-                               "┴───────┴───────┴───────┴───────┘\n");
-                    else
-                        printf("+----------+-------+-------+-----------+-----------+-------+----------"
-                               "+-------+-------+-------+-------+\n");
-                    if (!useUnicode)
-                        puts("");
-
-#else   
-                    // TABLE_VARIANT 1
-
-                    // +------------+-------+-------+------------+-------------------------------+--------+
-                    // |            | Algo- | Feed- | Oscillator |   Pitch Envelope Generator    | Trans- |
-                    // | Voice Name | rithm | back  | Key Sync   | R1:L1 | R2:L2 | R3:L3 | R4:L4 | pose   |
-                    // +------------+-------+-------+------------+-------+-------+-------+-------+--------+
-                    if (useUnicode)
-                        printf("┌────────────┬───────┬───────┬────────────┬───────────────────────────────┬────────┐\n");
-                    else
-                        printf("+------------+-------+-------+------------+-------------------------------+--------+\n");
-                    if (useUnicode)
-                    {
-                        printf("│            │       │       │            │   Pitch Envelope Generator    │        │\n");
-                        printf("│            │ Algo- │ Feed- │ Oscillator ├───────┬───────┬───────┬───────┤ Trans- │\n");
-                    }
-                    else
-                    {
-                        printf("%1$s            %1$s Algo- %1$s Feed- %1$s Oscillator "
-                               "%1$s   Pitch Envelope Generator    %1$s Trans- %1$s\n", vl);
-                    }
-                    printf("%1$s Voice Name %1$s rithm %1$s back  %1$s Key Sync   "
-                           "%1$s R1:L1 %1$s R2:L2 %1$s R3:L3 %1$s R4:L4 %1$s pose   %1$s\n", vl);
-                    if (useUnicode)
-                        printf("├────────────┼───────┼───────┼────────────┼───────┼───────┼───────┼───────┼────────┤\n");
-                    else
-                        printf("+------------+-------+-------+------------+-------+-------+-------+-------+--------+\n");
-                    printf("%s %-10s %s %5u %s %5u %s %10s %s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s %2u:%-2u %s %6d %s\n",
-                        vl, name, vl,
-                        voice->algorithm + 1, vl,
-                        voice->feedback, vl,
-                        OnOff(voice->oscKeySync), vl,
-                        voice->pitchEGR1, voice->pitchEGL1, vl,
-                        voice->pitchEGR2, voice->pitchEGL2, vl,
-                        voice->pitchEGR3, voice->pitchEGL3, vl,
-                        voice->pitchEGR4, voice->pitchEGL4, vl,
-                        voice->transpose - 24, vl);
-                    if (useUnicode)
-                        printf("└────────────┴───────┴───────┴────────────┴───────┴───────┴───────┴───────┴────────┘\n");
-                    else
-                        printf("+------------+-------+-------+------------+-------+-------+-------+-------+--------+\n");
-                    puts("");
-                    if (!useUnicode)
-                        puts("");
-
-                    // +---------------------------------------------------------------------+
-                    // |                                  LFO                                |
-                    // |          |       |       | Pitch     | Amplitude | Key   | Pitch    |
-                    // | Wave     | Speed | Delay | Mod Depth | Mod Depth | Sync  | Mod Sens |
-                    // +----------+-------+-------+-----------+-----------+-------+----------+
-                    // | Triangle |    30 |     0 |         8 |         0 |   Off |        2 |
-                    // +----------+-------+-------+-----------+-----------+-------+----------+
-                    if (useUnicode)
-                        printf("┌─────────────────────────────────────────────────────────────────────┐\n");
-                    else
-                        printf("+---------------------------------------------------------------------+\n");
-                    printf("%1$s                                  LFO                                %1$s\n", vl);
-                    if (useUnicode)
-                        printf("├──────────┬───────┬───────┬───────────┬───────────┬───────┬──────────┤\n");
-                    printf("%1$s          %1$s       %1$s       %1$s Pitch     "
-                           "%1$s Amplitude %1$s Key   %1$s Pitch    %1$s\n", vl);
-                    printf("%1$s Wave     %1$s Speed %1$s Delay %1$s Mod Depth "
-                           "%1$s Mod Depth %1$s Sync  %1$s Mod Sens %1$s\n", vl);
-                    if (useUnicode)
-                        printf("├──────────┼───────┼───────┼───────────┼───────────┼───────┼──────────┤\n");
-                    else
-                        printf("+----------+-------+-------+-----------+-----------+-------+----------+\n");
-                    printf("%s %8s %s %5u %s %5u %s %9u %s %9u %s %5s %s %8u %s\n",
-                        vl, LFOWave(voice->lfoWave), vl,
-                        voice->lfoSpeed, vl,
-                        voice->lfoDelay, vl,
-                        voice->lfoPitchModDepth, vl,
-                        voice->lfoAMDepth, vl,
-                        OnOff(voice->lfoSync), vl,
-                        voice->lfoPitchModSensitivity, vl);
-                    if (useUnicode)
-                        printf("└──────────┴───────┴───────┴───────────┴───────────┴───────┴──────────┘\n");
-                    else
-                        printf("+----------+-------+-------+-----------+-----------+-------+----------+\n");
-                    if (!useUnicode)
-                        puts("");
-#endif // TABLE_VARIANT
-                    // buffers for operator table row data
-                    char tableHeader[120] = "";
-                    char ampModSens[120] = "";
-                    char oscMode[120] = "";
-                    char frequency[120] = "";
-                    char detune[120] = "";
-                    char egR1L1[120] = "";
-                    char egR2L2[120] = "";
-                    char egR3L3[120] = "";
-                    char egR4L4[120] = "";
-                    char breakpoint[120] = "";
-                    char leftCurve[120] = "";
-                    char rightCurve[120] = "";
-                    char leftDepth[120] = "";
-                    char rightDepth[120] = "";
-                    char rateScale[120] = "";
-                    char outputLevel[120] = "";
-                    char keyVelSens[120] = "";
-                    
-                    // prepare table row data for each operator
-                    for (unsigned i = 0; i < 6; ++i)
-                    {
-                        char buffer[25];
-                        const unsigned j = 5 - i;
-                        const OperatorPacked &op = voice->op[j];
-
-                        sprintf(tableHeader + strlen(tableHeader), 
-                            " Operator %u %s", i + 1, vl);
-                        sprintf(ampModSens + strlen(ampModSens), 
-                            " %10u %s", op.amplitudeModulationSensitivity, vl);
-                        sprintf(oscMode + strlen(oscMode), 
-                            " %10s %s", Mode(op.oscillatorMode), vl);
-                        sprintf(frequency + strlen(frequency), 
-                            " %10s %s", Frequency(op).c_str(), vl);
-                        sprintf(detune + strlen(detune), 
-                            " %+10d %s", op.detune - 7, vl);
-                        sprintf(egR1L1 + strlen(egR1L1), 
-                            " %4u : %-3u %s", op.EG_R1, voice->op[j].EG_L1, vl);
-                        sprintf(egR2L2 + strlen(egR2L2), 
-                            " %4u : %-3u %s", op.EG_R2, voice->op[j].EG_L2, vl);
-                        sprintf(egR3L3 + strlen(egR3L3), 
-                            " %4u : %-3u %s", op.EG_R3, voice->op[j].EG_L3, vl);
-                        sprintf(egR4L4 + strlen(egR4L4), 
-                            " %4u : %-3u %s", op.EG_R4, voice->op[j].EG_L4, vl);
-                        sprintf(breakpoint + strlen(breakpoint), 
-                            " %10s %s", Breakpoint(op.levelScalingBreakPoint).c_str(), vl);
-                        sprintf(leftCurve + strlen(leftCurve), 
-                            " %10s %s", Curve(op.scaleLeftCurve), vl);
-                        sprintf(rightCurve + strlen(rightCurve), 
-                            " %10s %s", Curve(op.scaleRightCurve), vl);
-                        sprintf(leftDepth + strlen(leftDepth), 
-                            " %10u %s", op.scaleLeftDepth, vl);
-                        sprintf(rightDepth + strlen(rightDepth), 
-                            " %10u %s", op.scaleRightDepth, vl);
-                        sprintf(rateScale + strlen(rateScale), 
-                            " %10u %s", op.rateScale, vl);
-                        sprintf(outputLevel + strlen(outputLevel), 
-                            " %10u %s", op.outputLevel, vl);
-                        sprintf(keyVelSens + strlen(keyVelSens), 
-                            " %10u %s", op.keyVelocitySensitivity, vl);
-                    }
-    
-                    // print operator table
-                    // operator table head
-                    OpTableSeparator(TOP);
-                    OpTableRow("", tableHeader);
-                    OpTableSeparator(MIDDLE);
-                    OpTableRow("Oscillator Freq. Mode", oscMode);
-                    OpTableRow("Frequency", frequency);
-                    OpTableRow("Detune", detune);
-                    OpTableSeparator(MIDDLE);
-                    OpTableRow("Envelope Generator");
-                    OpTableRow("  Rate 1 : Level 1", egR1L1);
-                    OpTableRow("  Rate 2 : Level 2", egR2L2);
-                    OpTableRow("  Rate 3 : Level 3", egR3L3);
-                    OpTableRow("  Rate 4 : Level 4", egR4L4);
-                    OpTableSeparator(MIDDLE);
-                    OpTableRow("Keybd. Level Scaling");
-                    OpTableRow("  Breakpoint", breakpoint);
-                    OpTableRow("  Left Curve", leftCurve);
-                    OpTableRow("  Right Curve", rightCurve);
-                    OpTableRow("  Left Depth", leftDepth);
-                    OpTableRow("  Right Depth", rightDepth);
-                    OpTableSeparator(MIDDLE);
-                    OpTableRow("Keyboard Rate Scaling", rateScale);
-                    OpTableRow("Amplitude Mod. Sens.", ampModSens);
-                    OpTableRow("Key Velocity Sens.", keyVelSens);
-                    OpTableRow("Output Level", outputLevel);
-                    OpTableSeparator(BOTTOM);
-    
-                    puts("");
+/*! Dedup worker: hash the files with the next free index.
+ *
+ *  \param files the files
+ *  \param next index of the next file
+ *  \param options a pointer to the options of the command line
+ */
+void DedupWorker(std::vector<DedupFile> *files, std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    std::string data, normalised;
+    for (unsigned i = (*next)++; i < files->size(); i = (*next)++)
+    {
+        DedupFile &file = (*files)[i];
+        struct stat st;
+        file.ok = lstat(file.path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+                  ReadWholeFile(file.path.c_str(), data) == 0;
+        if (!file.ok)
+            continue;
+        file.device = st.st_dev;
+        file.inode = st.st_ino;
+        file.size = st.st_size;
+        file.links = st.st_nlink;
+        file.blocks = st.st_blocks;
+        normalised = data;
+        if (fixFiles)
+            NormaliseBank(normalised);
+        file.normalised = normalised == data;
+        file.key = HashBytes(normalised.data(), normalised.size());
+    }
+}
 
-                    // don't print voice separator on last entry
-                    //if (patch == -1 and voiceNum < 31)
+/*! Replace a file by a hard link or a reflink copy of another file. The link
+ *  is created under a temporary name and renamed over the duplicate, after
+ *  the (normalised) contents of both files were compared once more.
+ *
+ *  \param original file that is kept
+ *  \param duplicate file that is replaced
+ *  \param reflink reflink copy instead of hard link
+ *  \return 0 if ok
+ */
+int ReplaceByLink(const DedupFile &original, const DedupFile &duplicate, bool reflink)
+{
+    std::string a, b;
+    if (ReadWholeFile(original.path.c_str(), a) || ReadWholeFile(duplicate.path.c_str(), b))
+    {
+        fprintf(out, "Can't read the file: %s. %s\n", duplicate.path.c_str(), strerror(errno));
+        return 1;
+    }
+    if (fixFiles)
+        NormaliseBank(b);
+    if (a != b)
+    {
+        fprintf(out, "File changed, skipped: %s\n", duplicate.path.c_str());
+        return 1;
+    }
 
-                    // don't print voice separator for a single patch 
-                    if (patch == -1)
-                        VoiceSeparator();
-                }
-                else    // line by line listing
-                {
-                    printf("Algorithm: %u\n", voice->algorithm + 1);
-                    printf("Feedback: %u\n", voice->feedback);
-              
-                    printf("LFO\n");
-                    printf("  Wave: %s\n", LFOWave(voice->lfoWave));
-                    printf("  Speed: %u\n", voice->lfoSpeed);
-                    printf("  Delay: %u\n", voice->lfoDelay);
-                    printf("  Pitch Mod. Depth: %u\n", voice->lfoPitchModDepth);
-                    printf("  Amplitude Mod. Depth: %u\n", voice->lfoAMDepth);
-                    printf("  Key Sync: %s\n", OnOff(voice->lfoSync));  
-                    printf("  Pitch Mod. Sensitivity: %u\n", 
-                           voice->lfoPitchModSensitivity);
-              
-                    printf("Oscillator Key Sync: %s\n", OnOff(voice->oscKeySync));
-              
-                    printf("Pitch Envelope Generator\n");
-                    printf("  Rate 1: %u\n", voice->pitchEGR1);
-                    printf("  Rate 2: %u\n", voice->pitchEGR2);
-                    printf("  Rate 3: %u\n", voice->pitchEGR3);
-                    printf("  Rate 4: %u\n", voice->pitchEGR4);
-                    printf("  Level 1: %u\n", voice->pitchEGL1);
-                    printf("  Level 2: %u\n", voice->pitchEGL2);
-                    printf("  Level 3: %u\n", voice->pitchEGL3);
-                    printf("  Level 4: %u\n", voice->pitchEGL4);
-   
-                    //printf("Transpose: %s\n", Transpose(voice->transpose).c_str());
-                    printf("Transpose: %d\n", voice->transpose - 24);
- 
-                    // For each operator
-                    for (unsigned i = 0; i < 6; ++i)
-                    {
-                        puts("");
-                        printf("Operator: %u\n", i + 1);
-                        
-                        // They're stored in backward order.
-                        const unsigned j = 5 - i;
-                        const OperatorPacked &op = voice->op[j];
-                        
-                        printf("  Oscillator Mode: %s\n", Mode(op.oscillatorMode));
-                        printf("  Frequency: %s\n", Frequency(op).c_str());
-                        printf("  Detune: %+d\n", op.detune - 7);
-                        printf("  Envelope Generator\n");
-                        printf("    Rate 1: %u\n", op.EG_R1);
-                        printf("    Rate 2: %u\n", op.EG_R2);
-                        printf("    Rate 3: %u\n", op.EG_R3);
-                        printf("    Rate 4: %u\n", op.EG_R4);
-                        printf("    Level 1: %u\n", op.EG_L1);
-                        printf("    Level 2: %u\n", op.EG_L2);
-                        printf("    Level 3: %u\n", op.EG_L3);
-                        printf("    Level 4: %u\n", op.EG_L4);
-                        printf("  Keyboard Level Scaling\n");
-                        printf("    Breakpoint: %s\n", 
-                               Breakpoint(op.levelScalingBreakPoint).c_str());
-                        printf("    Left Curve: %s\n", Curve(op.scaleLeftCurve));
-                        printf("    Right Curve: %s\n", Curve(op.scaleRightCurve));
-                        printf("    Left Depth: %u\n", op.scaleLeftDepth);
-                        printf("    Right Depth: %u\n", op.scaleRightDepth);
-                        printf("  Keyboard Rate Scaling: %u\n", op.rateScale);
-                        printf("  Amp Mod Sensitivity: %u\n", 
-                               op.amplitudeModulationSensitivity);
-                        printf("  Key Velocity Sensitivity: %u\n", 
-                               op.keyVelocitySensitivity);
-                        printf("  Output Level: %u\n", op.outputLevel);
-                    }
-    
-                    // don't print any voice separator for a single patch
-                    if (patch == -1)
-                    {
-                        // print big separator at EOF
-                        if (voiceNum == 31)
-                            VoiceSeparator();
-                        else
-                            puts("-------------------------------------------------\n");
-                    }
-                }
-            }
-        }
+    std::string tempFile = duplicate.path + ".XXXXXX";
+    const int fd = mkstemp(&tempFile[0]);
+    if (fd < 0)
+    {
+        fprintf(out, "Can't create a file: %s. %s\n", tempFile.c_str(), strerror(errno));
+        return 1;
+    }
+    bool ok;
+    if (reflink)
+    {
+        struct stat st;
+        const int source = open(original.path.c_str(), O_RDONLY);
+        ok = source >= 0 && stat(duplicate.path.c_str(), &st) == 0 &&
+             fchmod(fd, st.st_mode & 07777) == 0 && cloneFile(source, fd);
+        if (source >= 0)
+            close(source);
+        ok = (close(fd) == 0) && ok;
+    }
+    else
+    {
+        close(fd);
+        ok = unlink(tempFile.c_str()) == 0 && link(original.path.c_str(), tempFile.c_str()) == 0;
+    }
+    if (ok && fixFiles && !duplicate.normalised && !noBackup)
+        ok = rename(duplicate.path.c_str(), (duplicate.path + ".ORIG").c_str()) == 0;
+    if (!ok || rename(tempFile.c_str(), duplicate.path.c_str()))
+    {
+        fprintf(out, "Can't replace the file: %s. %s\n", duplicate.path.c_str(), strerror(errno));
+        unlink(tempFile.c_str());
+        return 1;
     }
+    return 0;
 }
 
-// ***************************************************************************
-
-/*! Find and print duplicates within a voice bank dump.
+/*! Find byte-identical files (with --fix: identical after normalising the
+ *  header and checksum) and replace the duplicates by hard links or reflink
+ *  copies of one of them. The plan is printed first; with --dry-run nothing
+ *  is changed.
  *
- *  \param sysex a pointer to a DX7Sysex data block
+ *  \param argc number of FILEs and directories
+ *  \param argv FILEs and directories
+ *  \param mode "hardlink" or "reflink"
+ *  \return 0 if ok
  */
-void FindDupes(const DX7Sysex *sysex)
+int RunDedup(int argc, char *argv[], const char *mode)
 {
-    bool dupeFound = false;
+    const bool reflink = strcmp(mode, "reflink") == 0;
+    if (!reflink && strcmp(mode, "hardlink") != 0)
+    {
+        fprintf(out, "Invalid dedup mode: %s (expecting hardlink or reflink)\n", mode);
+        return 1;
+    }
 
-    // For each patch
-    for (int i = 0; i < 31; ++i)
+    std::vector<std::string> filenames;
+    for (int i = 0; i < argc; i++)
     {
-        // For each patch after that patch
-        for (int j = i + 1; j < 32; ++j)
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], filenames);
+        else
+            filenames.push_back(argv[i]);
+    }
+    std::vector<DedupFile> files(filenames.size());
+    for (unsigned i = 0; i < files.size(); i++)
+        files[i].path = filenames[i];
+
+    // options are thread local
+    OptionState options;
+    SaveOptions(&options);
+    std::atomic<unsigned> next(0);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; i++)
+        pool.push_back(std::thread(DedupWorker, &files, &next, &options));
+    for (unsigned i = 0; i < workers; i++)
+        pool[i].join();
+
+    // groups: same content on the same filesystem, in the order of the files
+    std::map<std::pair<dev_t, uint64_t>, std::vector<unsigned> > groups;
+    std::vector<std::vector<unsigned> *> order;
+    unsigned skipped = 0;
+    for (unsigned i = 0; i < files.size(); i++)
+    {
+        if (!files[i].ok)
         {
-            // memcmp the patches
-            // Subtract 10 to remove the name from the diff.
-            int rc = memcmp(&(sysex->voices[i]), &(sysex->voices[j]), 
-                            sizeof(VoicePacked) - 10);
-            if (rc == 0)
+            skipped++;
+            continue;
+        }
+        std::vector<unsigned> &group = groups[std::make_pair(files[i].device, files[i].key)];
+        if (group.empty())
+            order.push_back(&group);
+        group.push_back(i);
+    }
+
+    // the original is the first normalised file, with --fix the others are fixed by the link
+    unsigned groupCount = 0, duplicates = 0, linked = 0, failed = 0;
+    unsigned long reclaimable = 0, reclaimed = 0;
+    std::vector<std::pair<unsigned, unsigned> > plan;
+    for (unsigned g = 0; g < order.size(); g++)
+    {
+        const std::vector<unsigned> &group = *order[g];
+        if (group.size() < 2)
+            continue;
+        unsigned original = group[0];
+        for (unsigned i = 0; i < group.size(); i++)
+        {
+            if (files[group[i]].normalised)
             {
-                printf("Found duplicate: %d = %d\n", i+1, j+1);
-                dupeFound = true;
+                original = group[i];
+                break;
+            }
+        }
+        if (!files[original].normalised)
+        {
+            fprintf(out, "No fixed copy, run --fix first: %s\n", files[original].path.c_str());
+            continue;
+        }
+        // paths of every inode: its blocks are free when all of its links are replaced
+        std::map<ino_t, nlink_t> paths;
+        for (unsigned i = 0; i < group.size(); i++)
+            paths[files[group[i]].inode]++;
+        bool printed = false;
+        for (unsigned i = 0; i < group.size(); i++)
+        {
+            const DedupFile &file = files[group[i]];
+            if (file.inode == files[original].inode)
+                continue;
+            if (!printed)
+            {
+                fprintf(out, "%s\n", files[original].path.c_str());
+                groupCount++;
+                printed = true;
+            }
+            fprintf(out, "  %c %s\n", file.normalised ? '=' : '~', file.path.c_str());
+            plan.push_back(std::make_pair(original, group[i]));
+            duplicates++;
+            if (paths[file.inode] >= file.links && !(fixFiles && !file.normalised && !noBackup))
+            {
+                reclaimable += file.blocks * 512;
+                paths[file.inode] = 0;
             }
         }
     }
+    fprintf(out, "%zu files, %u skipped. %u duplicates of %u files: %lu bytes reclaimable\n",
+            files.size(), skipped, duplicates, groupCount, reclaimable);
+    if (dryRun || plan.empty())
+        return 0;
 
-    if (dupeFound)
+    std::map<ino_t, nlink_t> replacedLinks;
+    for (unsigned i = 0; i < plan.size(); i++)
     {
-        puts("");
+        const DedupFile &duplicate = files[plan[i].second];
+        if (ReplaceByLink(files[plan[i].first], duplicate, reflink))
+        {
+            failed++;
+            continue;
+        }
+        linked++;
+        // the blocks are free when the last link of the inode is replaced (and not kept as backup)
+        if (++replacedLinks[duplicate.inode] == duplicate.links &&
+            !(fixFiles && !duplicate.normalised && !noBackup))
+            reclaimed += duplicate.blocks * 512;
     }
+    fprintf(out, "%u files replaced by %s, %u failed. %lu bytes reclaimed\n", linked,
+            reflink ? "reflinks" : "hard links", failed, reclaimed);
+    return failed ? 1 : 0;
 }
 
 // ***************************************************************************
 
-/*! Process a complete voice dump sysex file.
+// Sharded index build (--index-map, --index-merge)
+
+//! files of an index: catalog, name index, and voice hash index
+const char *const indexKinds[3] = { ".catalog", ".names", ".hashes" };
+
+//! field of the voice-# in the lines of an index kind (compared as number)
+const unsigned indexVoiceField[3] = { 1, 2, 2 };
+
+//! One entry of the name or voice hash index of a shard.
+struct IndexEntry
+{
+    uint64_t key;               // voice hash, or the first 8 characters of the name
+    uint16_t rest;              // characters 9 and 10 of the name
+    uint8_t voiceNum;
+    uint32_t file;              // index into the sorted filenames
+};
+
+/*! Order of index entries: key, then path (the files are sorted), then voice-#.
  *
- *  \param filename a pointer to the filename
- *  \return 0 if ok
+ *  \param a first entry
+ *  \param b second entry
+ *  \return true if a comes first
  */
-int processFile (char* filename)
+bool IndexEntryBefore(const IndexEntry &a, const IndexEntry &b)
 {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL)
-    {
-        printf("ERROR: Can't open the file: %s\n", strerror(errno));
-        return 1;
-    }
+    if (a.key != b.key)
+        return a.key < b.key;
+    if (a.rest != b.rest)
+        return a.rest < b.rest;
+    if (a.file != b.file)
+        return a.file < b.file;
+    return a.voiceNum < b.voiceNum;
+}
 
-    fseek(file, 0, SEEK_END);
-    fsize = ftell(file);
-    rewind(file);
+//! Index data of one file, made by an index worker.
+struct IndexFile
+{
+    std::string catalog;        // catalog lines (see CatalogLine())
+    std::vector<IndexEntry> names;
+    std::vector<IndexEntry> hashes;
+    std::string message;        // reason for skipped files
+};
 
-    if (fsize == sysexSize)
+/*! Index worker: read the files with the next free index of a block.
+ *
+ *  \param filenames sorted filenames
+ *  \param first index of the first file of the block
+ *  \param results index data of the files of the block
+ *  \param next index of the next file in the block
+ *  \param options a pointer to the options of the command line
+ */
+void IndexWorker(const std::vector<std::string> *filenames, unsigned first,
+                 std::vector<IndexFile> *results, std::atomic<unsigned> *next, const OptionState *options)
+{
+    RestoreOptions(options);
+    for (unsigned i = (*next)++; i < results->size(); i = (*next)++)
     {
-        size_t objCnt = fread(buffer, sysexSize, 1, file);
-        fclose(file);
-        if (objCnt != 1)
+        IndexFile &result = (*results)[i];
+        const char *filename = (*filenames)[first + i].c_str();
+        ResetFileState();
+        LoadFile(filename, true);
+
+        // only files that load ok are indexed (like --catalog)
+        const char *type;
+        char message[100];
+        if (strcmp(CheckData(&type, message), "error") == 0)
         {
-            PrintFilename(filename);
-            puts("File read error\n");
-            return 1;
+            result.message = message;
+            continue;
         }
-    }
-    else if (fsize == rawDataSize)
-    {
-        // check if file could be a raw file
-        size_t objCnt = fread(buffer + 6, rawDataSize, 1, file);
-        fclose(file);
-        PrintFilename(filename);
-        if (objCnt != 1)
+        if (!CatalogFilename(filename))
         {
-            puts("File read error");
-            printf("File too small (%d Bytes)\n\n", fsize);
-            return 1;
+            result.message = "Tab or newline in the filename";
+            continue;
         }
-        printf("WARNING: file seems to be a headerless dump (%d Bytes)\n", fsize);
-        softError = true;
-        sysexFile = false;
-        fixNeeded = true;
-    }
-    else if (fsize == singleSysexSize)
-    {
-        size_t objCnt = fread(buffer, singleSysexSize, 1, file);
-        fclose(file);
-        if (objCnt != 1)
+        VoiceUnpacked voices[32];
+        unsigned count = 0;
+        if (fsize == singleSysexSize)
         {
-            PrintFilename(filename);
-            puts("File read error\n");
-            return 1;
+            voices[0] = ((const DX7SingleSysex *)buffer)->voice;
+            count = 1;
         }
-        singleVoiceFile = true;
-    }
-    else if (fsize > sysexSize)
-    {
-        PrintFilename(filename);
-        printf("File too big (%d Bytes)\n\n", fsize);
-        return 1;
-    }
-    else
-    {
-        PrintFilename(filename);
-        printf("File too small (%d Bytes)\n\n", fsize);
-        return 1;
-    }
- 
-    if (singleVoiceFile)
-    {
-        // check only if it is a single voice sysex
-        // (for now, no data analyzing for Single Voice Dumps supported)
-        DX7SingleSysex *sysex = (DX7SingleSysex *)buffer;
-        PrintFilename(filename);
-        if (VerifySingle(sysex) == 0)
+        else if (fsize == sysexSize || fsize == rawDataSize)
         {
-            Name2Ascii(name, sysex->voice.name);
-            printf("File is a Single Voice Dump: \"%10s\"\n\n", name);
-        }   
-        else
+            const DX7Sysex *sysex = (const DX7Sysex *)buffer;
+            for (count = 0; count < 32; count++)
+                UnpackVoice(&voices[count], &sysex->voices[count]);
+        }
+        for (unsigned v = 0; v < count; v++)
         {
-            printf("File too small (%d Bytes)\n\n", fsize);
+            CatalogLine(result.catalog, filename, v + 1, &voices[v]);
+            IndexEntry entry;
+            entry.key = 0;
+            entry.rest = 0;
+            for (unsigned c = 0; c < 10; c++)
+            {
+                const unsigned char ascii = lcdTableAscii[voices[v].name[c] & 0x7F];
+                if (c < 8)
+                    entry.key = entry.key << 8 | ascii;
+                else
+                    entry.rest = entry.rest << 8 | ascii;
+            }
+            entry.voiceNum = v + 1;
+            entry.file = first + i;
+            result.names.push_back(entry);
+            entry.key = VoiceHash(&voices[v]);
+            entry.rest = 0;
+            result.hashes.push_back(entry);
         }
-            
-        return 1;
     }
+}
 
-    // voice bank sysex
-    DX7Sysex *sysex = (DX7Sysex *)buffer;
+/*! Open the temporary file of an index file.
+ *
+ *  \param prefix path prefix of the index
+ *  \param kind index kind (0..2)
+ *  \return file, or NULL (error printed)
+ */
+FILE *OpenIndexFile(const char *prefix, unsigned kind)
+{
+    const std::string tmpName = std::string(prefix) + indexKinds[kind] + ".tmp";
+    FILE *file = fopen(tmpName.c_str(), "w");
+    if (file == NULL)
+        fprintf(out, "Can't open the file for writing: %s. %s\n", tmpName.c_str(), strerror(errno));
+    return file;
+}
 
-    // Make sure this is a valid DX7 sysex dump.
-    // there is no validation for headerless dumps!
-    if (sysexFile && Verify(sysex) != 0)
+/*! Close the temporary file of an index file and rename it.
+ *
+ *  \param file temporary file
+ *  \param prefix path prefix of the index
+ *  \param kind index kind (0..2)
+ *  \return 0 if ok
+ */
+int CloseIndexFile(FILE *file, const char *prefix, unsigned kind)
+{
+    const std::string filename = std::string(prefix) + indexKinds[kind];
+    bool ok = fflush(file) == 0 && (fsyncPolicy == FSYNC_NEVER || fsync(fileno(file)) == 0);
+    ok = (fclose(file) == 0) && ok && rename((filename + ".tmp").c_str(), filename.c_str()) == 0;
+    if (!ok)
+        fprintf(out, "Error writing to file: %s. %s\n", filename.c_str(), strerror(errno));
+    return ok ? 0 : 1;
+}
+
+/*! Map phase of the index build: index the banks and single voices of FILEs
+ *  and directory trees of one shard. Writes PREFIX.catalog (catalog format,
+ *  see --catalog), PREFIX.names (NAME TAB path TAB voice-#), and
+ *  PREFIX.hashes (voice hash TAB path TAB voice-#), all sorted, so the same
+ *  files always give the same index.
+ *
+ *  \param argc number of FILEs and directories
+ *  \param argv FILEs and directories
+ *  \param prefix path prefix of the index files
+ *  \return 0 if ok
+ */
+int RunIndexMap(int argc, char *argv[], const char *prefix)
+{
+    std::vector<std::string> filenames;
+    for (int i = 0; i < argc; i++)
     {
-        // unrecoverable file error
-        PrintFilename(filename);
-        puts(msgBuffer);
-        return 1;
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDirectory(argv[i], filenames);
+        else
+            filenames.push_back(argv[i]);
     }
+    std::sort(filenames.begin(), filenames.end());
+    filenames.erase(std::unique(filenames.begin(), filenames.end()), filenames.end());
 
-    if (msgBuffer[0] != 0)
+    FILE *catalogOut = OpenIndexFile(prefix, 0);
+    if (catalogOut == NULL)
+        return 1;
+
+    // blocks of files: the catalog is written in file order while reading
+    const unsigned blockSize = 4096;
+    std::vector<IndexEntry> names, hashes;
+    unsigned skipped = 0;
+    OptionState options;
+    SaveOptions(&options);
+    unsigned workers = std::thread::hardware_concurrency();
+    if (workers < 4)
+        workers = 4;
+    for (unsigned first = 0; first < filenames.size(); first += blockSize)
     {
-        // we have a recoverable file error
-        softError = true;
-        PrintFilename(filename);
-        printf("%s", msgBuffer);
+        std::vector<IndexFile> results(std::min<size_t>(blockSize, filenames.size() - first));
+        std::atomic<unsigned> next(0);
+        std::vector<std::thread> pool;
+        for (unsigned i = 0; i < workers; i++)
+            pool.push_back(std::thread(IndexWorker, &filenames, first, &results, &next, &options));
+        for (unsigned i = 0; i < workers; i++)
+            pool[i].join();
+        for (unsigned i = 0; i < results.size(); i++)
+        {
+            if (!results[i].message.empty())
+            {
+                fprintf(out, "%s: skipped (%s)\n", filenames[first + i].c_str(), results[i].message.c_str());
+                skipped++;
+                continue;
+            }
+            fwrite(results[i].catalog.data(), 1, results[i].catalog.size(), catalogOut);
+            names.insert(names.end(), results[i].names.begin(), results[i].names.end());
+            hashes.insert(hashes.end(), results[i].hashes.begin(), results[i].hashes.end());
+        }
     }
+    if (CloseIndexFile(catalogOut, prefix, 0))
+        return 1;
 
-    // Format and print the bank
-    if (!errorsOnly)
+    std::sort(names.begin(), names.end(), IndexEntryBefore);
+    std::sort(hashes.begin(), hashes.end(), IndexEntryBefore);
+    for (unsigned kind = 1; kind <= 2; kind++)
     {
-        Format(sysex, filename);
+        FILE *file = OpenIndexFile(prefix, kind);
+        if (file == NULL)
+            return 1;
+        const std::vector<IndexEntry> &entries = (kind == 1) ? names : hashes;
+        for (unsigned i = 0; i < entries.size(); i++)
+        {
+            const IndexEntry &entry = entries[i];
+            if (kind == 1)
+            {
+                char voiceName[11];
+                for (unsigned c = 0; c < 8; c++)
+                    voiceName[c] = entry.key >> (56 - 8 * c);
+                voiceName[8] = entry.rest >> 8;
+                voiceName[9] = entry.rest;
+                voiceName[10] = 0;
+                fprintf(file, "%s\t%s\t%u\n", voiceName, filenames[entry.file].c_str(), entry.voiceNum);
+            }
+            else
+            {
+                fprintf(file, "%016llX\t%s\t%u\n", (unsigned long long)entry.key,
+                        filenames[entry.file].c_str(), entry.voiceNum);
+            }
+        }
+        if (CloseIndexFile(file, prefix, kind))
+            return 1;
     }
-    else if (softError)
+    fprintf(out, "%zu files, %u skipped, %zu voices: %s.catalog, %s.names, %s.hashes\n", filenames.size(),
+            skipped, hashes.size(), prefix, prefix, prefix);
+    return 0;
+}
+
+/*! Order of index lines: the fields up to the voice-# (tab separated, the
+ *  voice-# as number), then the rest of the line.
+ *
+ *  \param a first line
+ *  \param b second line
+ *  \param voiceField field of the voice-#
+ *  \return <0, 0, or >0 like strcmp
+ */
+int CompareIndexLines(const std::string &a, const std::string &b, unsigned voiceField)
+{
+    size_t i = 0, j = 0;
+    for (unsigned field = 0; field <= voiceField; field++)
     {
-        puts("");
+        size_t endA = a.find('\t', i), endB = b.find('\t', j);
+        if (endA == std::string::npos)
+            endA = a.size();
+        if (endB == std::string::npos)
+            endB = b.size();
+        // numbers without leading zeros: the shorter one is smaller
+        if (field == voiceField && endA - i != endB - j)
+            return (endA - i < endB - j) ? -1 : 1;
+        const int result = a.compare(i, endA - i, b, j, endB - j);
+        if (result != 0)
+            return result;
+        i = endA + 1;
+        j = endB + 1;
     }
+    return a.compare(std::min(i, a.size()), std::string::npos, b, std::min(j, b.size()), std::string::npos);
+}
 
-    // Fix file if neccessary
-    if (fixFiles && fixNeeded)
+/*! Merge phase of the index build: k-way merge of the sorted index files of
+ *  the shards into the global index PREFIX.catalog, PREFIX.names, and
+ *  PREFIX.hashes. Equal lines keep the order of the shards.
+ *
+ *  \param argc number of shards
+ *  \param argv path prefixes of the shard indexes
+ *  \param prefix path prefix of the global index
+ *  \return 0 if ok
+ */
+int RunIndexMerge(int argc, char *argv[], const char *prefix)
+{
+    unsigned long lines[3] = { 0, 0, 0 };
+    for (unsigned kind = 0; kind < 3; kind++)
     {
-        if (askToFix)
+        std::vector<FILE *> shards;
+        for (int i = 0; i < argc; i++)
         {
-            char choice[2];
-            printf("Fix this file? [Y/n] ");
-            fgets (choice, sizeof(choice), stdin);
-            if (choice[0] == 'N' || choice[0] == 'n')
-                return 0;
+            const std::string filename = std::string(argv[i]) + indexKinds[kind];
+            FILE *file = fopen(filename.c_str(), "r");
+            if (file == NULL)
+            {
+                fprintf(out, "Can't open the file: %s. %s\n", filename.c_str(), strerror(errno));
+                for (unsigned s = 0; s < shards.size(); s++)
+                    fclose(shards[s]);
+                return 1;
+            }
+            shards.push_back(file);
         }
+        FILE *merged = OpenIndexFile(prefix, kind);
+        if (merged == NULL)
+            return 1;
 
-        //printf("FIXING\n");
-        FixFile(sysex, filename);
+        // heap of the current line of every shard, smallest line on top
+        std::vector<std::string> current(shards.size());
+        auto after = [&](unsigned a, unsigned b)
+        {
+            const int result = CompareIndexLines(current[a], current[b], indexVoiceField[kind]);
+            return result != 0 ? result > 0 : a > b;
+        };
+        std::vector<unsigned> heap;
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len;
+        for (unsigned s = 0; s < shards.size(); s++)
+        {
+            if ((len = getline(&line, &size, shards[s])) > 0)
+            {
+                current[s].assign(line, len - (line[len - 1] == '\n'));
+                heap.push_back(s);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), after);
+        while (!heap.empty())
+        {
+            std::pop_heap(heap.begin(), heap.end(), after);
+            const unsigned s = heap.back();
+            fwrite(current[s].data(), 1, current[s].size(), merged);
+            fputc('\n', merged);
+            lines[kind]++;
+            if ((len = getline(&line, &size, shards[s])) > 0)
+            {
+                current[s].assign(line, len - (line[len - 1] == '\n'));
+                std::push_heap(heap.begin(), heap.end(), after);
+            }
+            else
+            {
+                heap.pop_back();
+            }
+        }
+        free(line);
+        for (unsigned s = 0; s < shards.size(); s++)
+            fclose(shards[s]);
+        if (CloseIndexFile(merged, prefix, kind))
+            return 1;
     }
-
-    if (findDupes)
-        FindDupes(sysex);
-
+    fprintf(out, "%d shards merged: %lu catalog lines, %lu names, %lu voice hashes\n", argc,
+            lines[0], lines[1], lines[2]);
     return 0;
-};
-
-
-
+}
 
 // ***************************************************************************
 
@@ -1762,22 +9869,155 @@ int processFile (char* filename)
  */
 int main(int argc, char *argv[])
 {
-    processOpts(&argc, &argv);
+    const char *programName = strrchr(argv[0], '/');
+    programName = programName ? programName + 1 : argv[0];
+
+    const int rc = processOpts(&argc, &argv);
+    if (rc >= 0)
+        return rc;
+
+    if (strcmp(programName, "dx7dumpd") == 0 && argc > 0)
+        serveSocket = argv[0];
+
+    if (serveSocket)
+        return RunServer(serveSocket);
+
+    if (httpPort)
+    {
+        SelectRenderer();
+        return RunHttpServer(httpPort, catalogFile);
+    }
+
+    if (watchDir)
+    {
+        SelectRenderer();
+        return WatchDirectory(watchDir);
+    }
+
+    if (undoFile)
+        return UndoJournal(undoFile);
+
+    if (resumeJournal)
+        return ResumeJournal(resumeJournal);
+
+    // without FILEs the table has INIT VOICE only
+    if (factoryTable)
+        return RunFactoryTable(argc, argv);
+
+    // a shard without FILEs gets an empty index
+    if (indexMap)
+        return RunIndexMap(argc, argv, indexMap);
 
     if (argc == 0)
     {
-        puts("Expecting a filename.");
+        PutLine("Expecting a filename.");
+        return 1;
+    }
+
+    if (editWhere && editSets.empty() && !assembleBank)
+    {
+        PutLine("Option --where needs --set or --assemble.");
+        return 1;
+    }
+    if (!editSets.empty())
+    {
+        if (fixFiles || repairPlan || undoJournal)
+        {
+            PutLine("Option --set can't be combined with --fix, --repair, or --in-place.");
+            return 1;
+        }
+        return RunEdit(argc, argv);
+    }
+    if (splitDir)
+        return RunSplit(argc, argv, splitDir);
+    if (mergeBank)
+        return RunMerge(argc, argv, mergeBank);
+    if (assembleBank)
+        return RunAssemble(argc, argv, assembleBank);
+    if (defragBank)
+        return RunDefrag(argc, argv, defragBank);
+    if (diffFiles)
+    {
+        if (argc != 2)
+        {
+            PutLine("Option --diff needs two files or two directories.");
+            return 1;
+        }
+        return RunDiff(argv[0], argv[1]);
+    }
+    if (compareTrees)
+    {
+        struct stat stA, stB;
+        if (argc != 2 || stat(argv[0], &stA) != 0 || !S_ISDIR(stA.st_mode) ||
+            stat(argv[1], &stB) != 0 || !S_ISDIR(stB.st_mode))
+        {
+            PutLine("Option --compare needs two directories.");
+            return 1;
+        }
+        return RunCompare(argv[0], argv[1]);
+    }
+    if (provenanceThreshold)
+        return RunProvenance(argc, argv, provenanceThreshold);
+    if (dedupMode)
+        return RunDedup(argc, argv, dedupMode);
+    if (indexMerge)
+        return RunIndexMerge(argc, argv, indexMerge);
+
+    if (undoJournal && !fixFiles && !repairPlan)
+    {
+        PutLine("Option --in-place needs --fix or --repair.");
         return 1;
     }
+    if (undoJournal && !dryRun && OpenJournal())
+        return 1;
 
-    setVertLineChar();
+    if (repairPlan)
+    {
+        const int repairRc = RunRepair(argc, argv);
+        if (journalFd >= 0)
+            CloseJournal();
+        return repairRc;
+    }
 
-    if (processFile(argv[0]))
+    if (fixFiles && (outputFormat != FORMAT_TEXT || !outputSinks.empty()))
     {
-        // we had errors processing the file
+        PutLine("Option --fix can't be combined with --format, --validate, or --output.");
         return 1;
     }
 
-    return 0;
+    if (templateText)
+    {
+        // check the template once before any file is processed
+        std::string error;
+        if (CompileTemplate(templateText, compiledTemplate, error))
+        {
+            fprintf(out, "Invalid template: %s\n", error.c_str());
+            return 1;
+        }
+    }
+
+    if (!outputSinks.empty())
+        return RunSinks(argc, argv);
+
+    SelectRenderer();
+
+    int errors = 0;
+    BeginOutput();
+    for (int i = 0; i < argc; i++)
+    {
+        fileIndex = i;
+        if (processFile(argv[i]))
+        {
+            // we had errors processing the file
+            errors++;
+        }
+    }
+    EndOutput();
+    if (fixFiles && fsyncPolicy == FSYNC_END && SyncWrittenFiles())
+        errors++;
+    if (journalFd >= 0)
+        CloseJournal();
+
+    return errors ? 1 : 0;
 }
 
@@ -0,0 +1,32 @@
+/*! \file dx7factory.h
+ *  \brief Known factory voices of the Yamaha DX7
+ *
+ *  Generated by "dx7dump --factory-table FILEs > dx7factory.h": the sound
+ *  hashes (VoiceHash()) of the voices, placed by a perfect hash. Regenerate
+ *  it after changes of VoiceHash().
+ *
+ *  License: GPLv3+
+ */
+
+#ifndef _dx7factory_h
+#define _dx7factory_h
+
+//! A known voice: hash of the sound and label, e.g. "ROM1A #12"
+struct FactoryVoice
+{
+    uint64_t hash;
+    const char *label;
+};
+
+//! known voices in the slots of the perfect hash (empty slots: NULL label)
+constexpr FactoryVoice factoryVoices[] = {
+    { 0x5B5AB9FB39E2869DULL, "INIT VOICE" },
+    { 0, NULL },
+};
+
+//! displacements of the buckets of the perfect hash
+constexpr uint16_t factoryDisplacements[] = {
+    0,
+};
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/bash
+# ---------------------------------------------------
+# build the voice index of a directory tree with several processes:
+# one map process per shard (dx7dump --index-map), then one merge
+# (dx7dump --index-merge)
+#
+# Parameters :
+#   prefix    path prefix of the index: PREFIX.catalog, PREFIX.names, PREFIX.hashes
+#   shards    number of shards (map processes running at the same time)
+#   path      directory tree; its entries are distributed to the shards
+#
+# On several storage nodes, run "dx7dump --index-map SHARD DIR" on every
+# node, copy the shard indexes to one host and merge them there.
+#
+# License: GPLv3+
+# ---------------------------------------------------
+
+if [ -z "$3" ] || [ "$1" = "-h" ] || [ "$1" = "--help" ]; then
+	echo "Usage: dx7index PREFIX SHARDS PATH"
+	exit
+fi
+
+prefix="$1"
+shards="$2"
+searchpath="$3"
+
+# entries of the path, round-robin to the shards
+declare -a entries
+while IFS= read -r -d '' entry; do
+	entries+=("$entry")
+done < <(find "$searchpath" -mindepth 1 -maxdepth 1 -print0 | sort -z)
+
+pids=()
+for ((shard = 0; shard < shards; shard++)); do
+	args=()
+	for ((i = shard; i < ${#entries[@]}; i += shards)); do
+		args+=("${entries[$i]}")
+	done
+	dx7dump --index-map "$prefix.shard$shard" "${args[@]}" &
+	pids+=($!)
+done
+for pid in "${pids[@]}"; do
+	wait "$pid" || exit 1
+done
+
+for ((shard = 0; shard < shards; shard++)); do
+	parts+=("$prefix.shard$shard")
+done
+dx7dump --index-merge "$prefix" "${parts[@]}" || exit 1
+for part in "${parts[@]}"; do
+	rm -f "$part.catalog" "$part.names" "$part.hashes"
+done
@@ -0,0 +1,47 @@
+#!/bin/bash
+# ---------------------------------------------------
+# load test for the dx7dump HTTP/JSON query server
+#
+# Parameters :
+#   catalog   voice catalog (see dx7dump --catalog)
+#   port      TCP port of the server (default 8077)
+#   seconds   duration of each test (default 10)
+#
+# Needs wrk or ab (apache2-utils). The server is started and stopped
+# by this script.
+#
+# License: GPLv3+
+# ---------------------------------------------------
+
+if [ -z "$1" ] || [ "$1" = "-h" ] || [ "$1" = "--help" ]; then
+	echo "Usage: dx7loadtest CATALOG [PORT] [SECONDS]"
+	exit
+fi
+
+catalog="$1"
+port="${2:-8077}"
+seconds="${3:-10}"
+base="http://127.0.0.1:$port"
+
+dx7dump --http "$port" --catalog "$catalog" &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT
+sleep 1
+
+# first voice of the catalog as reference for /voice and /similar
+path=$(head -n1 "$catalog" | cut -f1 | sed 's/ /%20/g')
+
+for url in "/banks" \
+		"/voice?path=$path&voice=1" \
+		"/search?name=piano&algorithm=4" \
+		"/similar?path=$path&voice=1&limit=10"; do
+	echo "*** $url"
+	if command -v wrk >/dev/null; then
+		wrk -t4 -c64 -d"${seconds}s" "$base$url" | grep -E "Requests/sec|Latency"
+	elif command -v ab >/dev/null; then
+		ab -k -q -c64 -t"$seconds" -n 10000000 "$base$url" | grep -E "Requests per second|Time per request"
+	else
+		echo "neither wrk nor ab found"
+		exit 1
+	fi
+done
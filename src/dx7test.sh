@@ -0,0 +1,231 @@
+#!/bin/bash
+# ---------------------------------------------------
+# regression tests of dx7dump
+#
+# The environment variable DX7DUMP selects the dx7dump binary
+# (default ./dx7dump). The test banks are generated in a temporary
+# directory.
+#
+# License: GPLv3+
+# ---------------------------------------------------
+
+if [ "$1" = "-h" ] || [ "$1" = "--help" ]; then
+	echo "Usage: dx7test"
+	exit
+fi
+
+dx7dump="$(realpath "${DX7DUMP:-./dx7dump}")"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+failed=0
+
+# write a bank of 32 empty voices (all data bytes 0, checksum 0)
+bank () {
+	{ printf '\xF0\x43\x00\x09\x20\x00'; head -c 4096 /dev/zero; printf '\x00\xF7'; } > "$1"
+}
+
+# write a bank of the voices ID... (voice ID: first two bytes ID % 100 and ID / 100)
+voices () {
+	local file=$1 id sum=0
+	shift
+	{
+		printf '\xF0\x43\x00\x09\x20\x00'
+		for id in "$@"; do
+			printf "\\x$(printf %02X $((id % 100)))\\x$(printf %02X $((id / 100)))"
+			head -c 126 /dev/zero
+			sum=$((sum + id % 100 + id / 100))
+		done
+		printf "\\x$(printf %02X $((-sum & 0x7F)))\\xF7"
+	} > "$file"
+}
+
+# write a single voice dump of an empty voice (all data bytes 0, checksum 0)
+single () {
+	{ printf '\xF0\x43\x00\x00\x01\x1B'; head -c 155 /dev/zero; printf '\x00\xF7'; } > "$1"
+}
+
+# check NAME EXPECTED ACTUAL
+check () {
+	if [ "$2" = "$3" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1: expected \"$2\", got \"$3\""
+		failed=$((failed + 1))
+	fi
+}
+
+# --set only changes the voice selected by -p
+bank p.syx
+"$dx7dump" -p 3 --set lfoSpeed=10 --journal p.txt p.syx > p.out
+check "-p with --set: report" "p.syx: 1 voice changed" "$(head -n1 p.out)"
+check "-p with --set: changed voices" "3" \
+	"$("$dx7dump" --template '{slot} {lfoSpeed}' p.syx | awk '$2 == 10 { print $1 }')"
+
+# an interrupted --set run (journal ends with COMMIT) is completed by --resume
+# and rolled back by --undo
+mkdir j
+bank j/a.syx
+bank j/b.syx
+cp j/a.syx j/orig.syx
+"$dx7dump" --set lfoSpeed=10 --journal j/set.txt j/a.syx j/b.syx > /dev/null
+cp j/a.syx j/edited.syx
+grep -v '^END$' j/set.txt > j/interrupted.txt
+cp j/orig.syx j/a.syx
+cp j/orig.syx j/b.syx
+check "--resume of an interrupted --set" "2 files written, 0 already complete, 0 conflicts, 0 errors" \
+	"$("$dx7dump" --resume j/interrupted.txt | tail -n1)"
+check "--resume: edited banks" "same same" \
+	"$(cmp -s j/edited.syx j/a.syx && echo same) $(cmp -s j/edited.syx j/b.syx && echo same)"
+check "--resume: END in the journal" "END" "$(tail -n1 j/interrupted.txt)"
+"$dx7dump" --undo j/interrupted.txt > /dev/null
+check "--undo of a --set run" "same same" \
+	"$(cmp -s j/orig.syx j/a.syx && echo same) $(cmp -s j/orig.syx j/b.syx && echo same)"
+grep -v '^END$' j/set.txt > j/interrupted.txt
+head -c 100 j/orig.syx > j/a.syx
+check "--resume of a truncated bank" "1 files written, 0 already complete, 0 conflicts, 1 errors" \
+	"$("$dx7dump" --resume j/interrupted.txt | tail -n1)"
+check "--resume of a truncated bank: no END" "COMMIT" "$(tail -n1 j/interrupted.txt)"
+
+# --split only writes the voice selected by -p
+bank s.syx
+"$dx7dump" -p 2 --split split s.syx > /dev/null
+check "-p with --split" "split/s/02-voice.syx" "$(find split -type f)"
+
+# --diff prints the names like the listing (-a: ASCII)
+bank d1.syx
+bank d2.syx
+printf 'A' | dd of=d2.syx bs=1 seek=$((6 + 128 + 118)) conv=notrunc 2> /dev/null
+check "-a with --diff" 'voice 2 "          " renamed to "A         "' \
+	"$("$dx7dump" -a --diff d1.syx d2.syx | grep "renamed to")"
+
+# --compare hashes all bytes of headerless banks
+mkdir c1 c2
+head -c 4096 /dev/zero > c1/r.syx
+head -c 4096 /dev/zero > c2/r.syx
+printf 'A' | dd of=c2/r.syx bs=1 seek=4095 conv=notrunc 2> /dev/null
+check "--compare of headerless banks" "~ c1/r.syx c2/r.syx" "$("$dx7dump" --compare c1 c2 | head -n1)"
+
+# 8-bit name bytes are decoded with the whole LCD table and reported
+bank n.syx
+printf '\xE1\xEF\xF5\x7EABCDEF' | dd of=n.syx bs=1 seek=$((6 + 118)) conv=notrunc 2> /dev/null
+check "8-bit name bytes (Unicode)" " 1 |äöü→ABCDEF|" "$("$dx7dump" n.syx | grep -o '^ 1 |[^|]*|')"
+check "8-bit name bytes reported" "Voices with 8-bit name bytes: 1" "$("$dx7dump" n.syx | grep '8-bit')"
+
+# --index-map skips files that don't load
+mkdir ix
+bank ix/ok.syx
+{ printf '\x00'; head -c 4103 /dev/zero; } > ix/bad.syx
+check "--index-map skips bad files" "ix/bad.syx: skipped (Did not find sysex start F0)" \
+	"$("$dx7dump" --index-map ix/index ix | head -n1)"
+check "--index-map catalog" "32" "$(wc -l < ix/index.catalog)"
+bank "ix/tab	name.syx"
+check "--index-map skips tabs in filenames" "ix/tab	name.syx: skipped (Tab or newline in the filename)" \
+	"$("$dx7dump" --index-map ix/index ix | grep Tab)"
+
+# --repair keeps the original as backup and replaces the bank
+bank r.syx
+printf '\x11' | dd of=r.syx bs=1 seek=4102 conv=notrunc 2> /dev/null
+cp r.syx r.bad
+"$dx7dump" --repair - -y r.syx > /dev/null
+check "--repair backup" "same" "$(cmp -s r.bad r.syx.ORIG && echo same)"
+check "--repair fixed file" "ok" "$("$dx7dump" --format ndjson r.syx | grep -o '"status":"ok"' | head -n1 | cut -d'"' -f4)"
+
+# --provenance clusters the similar banks only
+mkdir pv
+voices pv/a.syx $(seq 0 15) $(seq 200 215)
+voices pv/b.syx $(seq 0 31)
+voices pv/c.syx $(seq 0 27) 100 101 102 103
+check "--provenance" "1 pv/b.syx ~ pv/c.syx (78%, 28 voices shared, 4 other)" \
+	"$("$dx7dump" --provenance 70 pv | grep -c '^Cluster') $("$dx7dump" --provenance 70 pv | sed -n 's/^  //p' | tr '\n' ' ' | sed 's/ $//')"
+
+# --in-place patches the bank and journals the original bytes, --undo restores them
+bank ip.syx
+printf '\x05' | dd of=ip.syx bs=1 seek=2 conv=notrunc 2> /dev/null
+printf '\x11' | dd of=ip.syx bs=1 seek=4102 conv=notrunc 2> /dev/null
+cp ip.syx ip.bad
+"$dx7dump" --repair - --in-place ip.txt ip.syx > /dev/null
+check "--in-place repair" "ok none" \
+	"$("$dx7dump" --format ndjson ip.syx | grep -o '"status":"ok"' | head -n1 | cut -d'"' -f4) $([ -e ip.syx.ORIG ] || echo none)"
+check "--in-place journal" "ip.syx	2:05>00 4102:11>00" "$(cat ip.txt)"
+"$dx7dump" --undo ip.txt > /dev/null
+check "--undo of --in-place" "same" "$(cmp -s ip.bad ip.syx && echo same)"
+
+# the unused voices of --merge are labelled as factory voice
+single fv.syx
+"$dx7dump" --merge fvm.syx fv.syx > /dev/null
+check "factory voices of a bank" "Factory voices: 2-32 [INIT VOICE]" "$("$dx7dump" fvm.syx | grep '^Factory')"
+check "factory voice in the voice data list" 'Name: "INIT VOICE" [INIT VOICE]' \
+	"$("$dx7dump" -d -p 32 fvm.syx | grep '^Name')"
+
+# --format bin: header, then one record per voice (source id, slot, unpacked voice)
+voices bn1.syx $(seq 0 31)
+voices bn2.syx $(seq 100 131)
+"$dx7dump" --format bin bn1.syx bn2.syx > bn.bin
+check "--format bin: header and size" "DX7V $((8 + 64 * 160))" "$(head -c 4 bn.bin) $(wc -c < bn.bin)"
+check "--format bin: record of voice 6 of the 2nd file" "1 0 0 0 5 5 1" \
+	"$(od -A n -t u1 -j $((8 + 37 * 160)) -N 7 bn.bin | tr -s ' ' | sed 's/^ //')"
+
+# --output writes every output of one read, like the separate runs
+voices o1.syx $(seq 0 31)
+voices o2.syx $(seq 0 15) $(seq 0 15)
+"$dx7dump" --output names=- --output ndjson=o.ndjson o1.syx o2.syx > o.txt
+check "--output names" "same" "$("$dx7dump" o1.syx o2.syx | cmp -s - o.txt && echo same)"
+check "--output ndjson" "same" "$("$dx7dump" --format ndjson o1.syx o2.syx | cmp -s - o.ndjson && echo same)"
+
+# --format json: an array of files with their voices, ndjson: one line per file and voice
+check "--format json" '[{"path":"o1.syx","type":"bank","status":"ok" 32' \
+	"$("$dx7dump" --format json o1.syx | head -c 45) $("$dx7dump" --format json o1.syx | grep -o '"voice":' | wc -l)"
+check "--format ndjson" "66 2" \
+	"$("$dx7dump" --format ndjson o1.syx o2.syx | wc -l) $("$dx7dump" --format ndjson o1.syx o2.syx | grep -c '"type":"bank"')"
+
+# --validate reports the out-of-range values
+bank va.syx
+printf '\x7F' | dd of=va.syx bs=1 seek=6 conv=notrunc 2> /dev/null
+printf '\x01' | dd of=va.syx bs=1 seek=4102 conv=notrunc 2> /dev/null
+check "--validate" 'va.syx: voice 1 "          ": op6.EG_R1 = 127 (max 99)' \
+	"$("$dx7dump" -a --validate va.syx | head -n1)"
+
+# --merge fills banks of 32 single voices
+mkdir mg
+for i in $(seq 40); do single mg/$i.syx; done
+check "--merge" "40 voices merged into 2 banks (mg.syx .. mg-2.syx), 0 files skipped" \
+	"$("$dx7dump" --merge mg.syx mg)"
+
+# --assemble --unique drops the voices with the same sound
+check "--assemble --unique" "64 voices matching, 32 duplicates dropped 32 voices in 1 banks (as.syx)" \
+	"$("$dx7dump" --assemble as.syx --unique o1.syx o2.syx | sed 's/^.*skipped\. //' | tr '\n' ' ' | sed 's/ $//')"
+
+# --defrag packs the unique voices, the map lists the new place of every voice
+"$dx7dump" --defrag df.syx o1.syx o2.syx > /dev/null
+check "--defrag" "same" "$(cmp -s o1.syx df.syx && echo same)"
+check "--defrag map" "64 o2.syx	17	df.syx	1" "$(wc -l < df.map) $(awk '$1 == "o2.syx" && $2 == 17' df.map)"
+
+# --index-merge writes the same index in any order of the shards
+mkdir im1 im2
+cp o1.syx im1
+cp o2.syx im2
+"$dx7dump" --index-map im1/i im1 > /dev/null
+"$dx7dump" --index-map im2/i im2 > /dev/null
+"$dx7dump" --index-merge im12 im1/i im2/i > /dev/null
+"$dx7dump" --index-merge im21 im2/i im1/i > /dev/null
+check "--index-merge is deterministic" "same same same" \
+	"$(for k in catalog names hashes; do cmp -s im12.$k im21.$k && echo same; done | tr '\n' ' ' | sed 's/ $//')"
+
+# --dedup links identical banks, with --fix also banks that differ in the checksum only
+mkdir dd
+bank dd/a.syx
+bank dd/b.syx
+bank dd/c.syx
+printf '\x11' | dd of=dd/c.syx bs=1 seek=4102 conv=notrunc 2> /dev/null
+cp dd/c.syx dd.bad
+check "--dedup --dry-run" "  = dd/b.syx 1 1 1" \
+	"$("$dx7dump" --dedup hardlink --dry-run dd | grep '^  ') $(stat -c %h dd/a.syx dd/b.syx dd/c.syx | tr '\n' ' ' | sed 's/ $//')"
+"$dx7dump" --dedup hardlink dd > /dev/null
+check "--dedup hardlink" "2 2 1" "$(stat -c %h dd/a.syx dd/b.syx dd/c.syx | tr '\n' ' ' | sed 's/ $//')"
+"$dx7dump" --dedup hardlink --fix dd > /dev/null
+check "--dedup --fix" "3 3 3" "$(stat -c %h dd/a.syx dd/b.syx dd/c.syx | tr '\n' ' ' | sed 's/ $//')"
+check "--dedup --fix backup" "same" "$(cmp -s dd.bad dd/c.syx.ORIG && echo same)"
+
+[ $failed -eq 0 ] && echo "all tests passed" || echo "$failed tests failed"
+exit $((failed != 0))